@@ -0,0 +1,56 @@
+#!/bin/bash
+# Compares command output sent as is with output sent --compress, for
+# log text, binaries and random data: bytes on the wire, and server CPU
+# per GB of output. Commands go through a control master, so the bytes
+# on the wire are what the master reads from its connection.
+# Usage: compress.sh [MB per data set] [server options...]
+
+cd "$(dirname "$0")/.." || exit 1
+
+port=${PORT:-9096}
+mb=${1:-100}
+shift
+
+tmp=$(mktemp -d)
+./server $port "$@" &
+server=$!
+trap 'kill $master $server 2>/dev/null; rm -rf $tmp' EXIT
+sleep 0.3
+
+./client --master $tmp/master localhost $port &
+master=$!
+sleep 0.3
+
+size=$((mb * 1024 * 1024))
+
+seq 100000000 | awk '{
+  printf "2026-10-17 12:%02d:%02d INFO worker-%d GET /api/items/%d 200 %dms\n",
+         $1 / 60 % 60, $1 % 60, $1 % 8, $1 * 7919 % 100003, $1 % 97 }' |
+  head -c $size > $tmp/text
+find /usr/bin /usr/lib -type f -size +64k 2>/dev/null | xargs cat 2>/dev/null |
+  head -c $size > $tmp/binary
+head -c $size /dev/urandom > $tmp/random
+
+wire() { awk '/^rchar/ { print $2 }' /proc/$master/io; }
+cpu() { awk '{ print $14 + $15 }' /proc/$server/stat; }
+
+# Prints the bytes on the wire in MB and the server CPU in s/GB for
+# sending the file $1 with the client options that follow.
+measure()
+{
+  local file=$1
+  shift
+  local wire0=$(wire) cpu0=$(cpu)
+  ./client --control $tmp/master "$@" cat $file < /dev/null > /dev/null
+  local wire1=$(wire) cpu1=$(cpu)
+  awk "BEGIN { printf \"%10.1fMB %7.2fs\", ($wire1 - $wire0) / 1048576,
+               ($cpu1 - $cpu0) / $(getconf CLK_TCK) * 1024 / $mb }"
+}
+
+printf "%-8s %20s %20s\n" "" "plain" "--compress"
+printf "%-8s %12s %7s %12s %7s\n" "data" "wire" "CPU/GB" "wire" "CPU/GB"
+for data in text binary random; do
+  printf "%-8s %s %s\n" $data \
+    "$(measure $tmp/$data)" "$(measure $tmp/$data --compress)"
+done
+echo "($mb MB each)"
@@ -0,0 +1,138 @@
+// Measures keystroke latency: runs `cat` on a raw tty on a server and
+// types into it one byte at a time, a number of milliseconds apart,
+// timing each byte until cat has echoed it. Prints the round trips in
+// microseconds, one per line, for the caller to put together with those
+// of other runs.
+//
+// Usage: echo <host> <port> [keystrokes] [ms between keystrokes]
+//
+// Output of a tty is interactive, so it is never corked. The keystrokes
+// stay within MSG_CREDIT_WINDOW, so no credit has to be waited for.
+
+#include <netdb.h>
+#include <time.h>
+
+#include "../msgs.h"
+
+static int64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static int connect_to(const char *hostname, const char *port)
+{
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+
+  struct addrinfo *addr;
+  if (getaddrinfo(hostname, port, &hints, &addr) != 0) {
+    fprintf(stderr, "ERROR, no such host\n");
+    exit(1);
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, addr->ai_addr, addr->ai_addrlen) < 0) {
+    error("ERROR connecting");
+  }
+  freeaddrinfo(addr);
+
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  return fd;
+}
+
+
+// Waits for the next byte of output, for up to 10s.
+static void wait_for_echo(int sockfd, struct msg_recv_buffer *rx)
+{
+  while (true) {
+    struct msg_wrapper *message;
+    int n;
+    while ((n = msg_recv_buffer_next(rx, &message)) > 0) {
+      if (message->type == IO_MSG && message->msg.io.data_size > 0) {
+        return;
+      } else if (message->type == EXIT_MSG) {
+        fprintf(stderr, "ERROR cat exited\n");
+        exit(1);
+      }
+    }
+    if (n < 0) {
+      error("ERROR parsing message");
+    }
+
+    struct pollfd pfd;
+    pfd.fd = sockfd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 10000) <= 0) {
+      fprintf(stderr, "ERROR timed out waiting for an echo\n");
+      exit(1);
+    }
+
+    n = msg_recv_buffer_fill(rx, msg_read_fd, &sockfd);
+    if (n == 0 || (n < 0 && errno != EWOULDBLOCK)) {
+      error("ERROR reading from socket");
+    }
+  }
+}
+
+
+int main(int argc, char *argv[])
+{
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <host> <port> [keystrokes] "
+            "[ms between keystrokes]\n", argv[0]);
+    exit(1);
+  }
+
+  int keystrokes = argc > 3 ? atoi(argv[3]) : 200;
+  int interval_ms = argc > 4 ? atoi(argv[4]) : 10;
+  if (keystrokes <= 0 || keystrokes >= MSG_CREDIT_WINDOW || interval_ms < 0) {
+    fprintf(stderr, "ERROR keystrokes must be 1 to %d\n",
+            MSG_CREDIT_WINDOW - 1);
+    exit(1);
+  }
+
+  int sockfd = connect_to(argv[1], argv[2]);
+
+  // The newline says that the tty is raw and cat about to start.
+  char *cmd[] = {(char*) "sh", (char*) "-c",
+                 (char*) "stty raw -echo && echo && exec cat"};
+  struct winsize winsize;
+  memset(&winsize, 0, sizeof(winsize));
+  winsize.ws_row = 24;
+  winsize.ws_col = 80;
+  if (send_cmd_msg(sockfd, 1, cmd, 3, true, false, false, false, false,
+                   false, &winsize, NULL, 0) < 0) {
+    error("ERROR writing to socket");
+  }
+
+  make_non_blocking(sockfd);
+
+  struct buf_pool pool;
+  pool_init(&pool, MSG_RECV_BUFFER_SIZE, 1);
+  struct msg_recv_buffer rx;
+  msg_recv_buffer_init(&rx, &pool);
+
+  wait_for_echo(sockfd, &rx);
+
+  for (int i = 0; i < keystrokes; i++) {
+    usleep(interval_ms * 1000);
+
+    int64_t start = now_ns();
+    char c = 'x';
+    if (send_io_msg(sockfd, 1, STDIN_FILENO, &c, 1) < 0) {
+      error("ERROR writing to socket");
+    }
+    wait_for_echo(sockfd, &rx);
+
+    printf("%.0f\n", (now_ns() - start) / 1e3);
+  }
+
+  return 0;
+}
@@ -0,0 +1,42 @@
+#!/bin/bash
+# Measures the keystroke latency of a session while a second one
+# streams bulk output, for each flush policy of the server: neither
+# corking nor TCP_NOTSENT_LOWAT, each one alone, and both (the
+# default). Prints the p50 and p99 of the round trips.
+# Usage: flush.sh [keystrokes] [server options...]
+
+cd "$(dirname "$0")/.." || exit 1
+
+port=${PORT:-9100}
+keystrokes=${1:-500}
+shift $(($# < 1 ? $# : 1))
+
+tmp=$(mktemp -d)
+trap 'kill $bulk $server 2>/dev/null; rm -rf $tmp' EXIT
+
+policies=("plain:--flush-budget 0 --notsent-lowat 0"
+          "corked:--flush-budget 5 --notsent-lowat 0"
+          "notsent-lowat:--flush-budget 0 --notsent-lowat 131072"
+          "default:")
+
+echo "$keystrokes keystrokes 10ms apart, next to a bulk session"
+printf "%-14s %10s %10s\n" "" "p50" "p99"
+for policy in "${policies[@]}"; do
+  ./server $port ${policy#*:} "$@" &
+  server=$!
+  sleep 0.3
+
+  ./client localhost $port cat /dev/zero < /dev/null > /dev/null &
+  bulk=$!
+  sleep 0.5
+
+  bench/echo localhost $port $keystrokes > $tmp/echo || exit 1
+
+  kill $bulk $server
+  wait $bulk $server 2>/dev/null
+
+  sort -n $tmp/echo | awk -v name="${policy%%:*}" '
+    { us[NR] = $1 }
+    END { printf "%-14s %8.2fms %8.2fms\n", name,
+                 us[int(NR * 0.5)] / 1000, us[int(NR * 0.99)] / 1000 }'
+done
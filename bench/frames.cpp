@@ -0,0 +1,155 @@
+// Measures how fast the server takes in a stream of small frames: runs
+// `cat` on a server and sends it a number of one-byte IO_MSG frames back
+// to back, timing until all of the bytes have been echoed.
+//
+// Usage: frames <host> <port> [frames] [frames per write]
+//
+// The bytes sent stay within MSG_CREDIT_WINDOW, so no credit has to be
+// waited for and the numbers only show the cost per frame.
+
+#include <netdb.h>
+#include <time.h>
+
+#include "../msgs.h"
+
+static int64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static int connect_to(const char *hostname, const char *port)
+{
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+
+  struct addrinfo *addr;
+  if (getaddrinfo(hostname, port, &hints, &addr) != 0) {
+    fprintf(stderr, "ERROR, no such host\n");
+    exit(1);
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, addr->ai_addr, addr->ai_addrlen) < 0) {
+    error("ERROR connecting");
+  }
+  freeaddrinfo(addr);
+
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  return fd;
+}
+
+
+int main(int argc, char *argv[])
+{
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <host> <port> [frames] [frames per write]\n",
+            argv[0]);
+    exit(1);
+  }
+
+  int frames = argc > 3 ? atoi(argv[3]) : 200000;
+  int per_write = argc > 4 ? atoi(argv[4]) : frames;
+  if (frames <= 0 || frames > MSG_CREDIT_WINDOW || per_write <= 0) {
+    fprintf(stderr, "ERROR frames must be 1 to %d\n", MSG_CREDIT_WINDOW);
+    exit(1);
+  }
+
+  int sockfd = connect_to(argv[1], argv[2]);
+
+  char *cmd[] = {(char*) "cat"};
+  if (send_cmd_msg(sockfd, 1, cmd, 1, false, false, false, false, false,
+                   false, NULL, NULL, 0) < 0) {
+    error("ERROR writing to socket");
+  }
+
+  // Every frame is laid out ahead of time, so the sender costs next to
+  // nothing per frame.
+  size_t frame_size = MSG_ALIGNED(IO_MSG_HEADER_SIZE + 1);
+  size_t total = frames * frame_size;
+  size_t chunk = per_write * frame_size;
+  char *stream = (char*) calloc(frames, frame_size);
+  if (stream == NULL) {
+    error("ERROR allocating frames");
+  }
+
+  for (int i = 0; i < frames; i++) {
+    struct msg_wrapper *message =
+      (struct msg_wrapper*) (stream + i * frame_size);
+    message->type = IO_MSG;
+    message->channel = 1;
+    message->msg.io.destfd = STDIN_FILENO;
+    message->msg.io.data_size = 1;
+    stream[i * frame_size + IO_MSG_HEADER_SIZE] = 'x';
+  }
+
+  make_non_blocking(sockfd);
+
+  struct buf_pool pool;
+  pool_init(&pool, MSG_RECV_BUFFER_SIZE, 1);
+  struct msg_recv_buffer rx;
+  msg_recv_buffer_init(&rx, &pool);
+
+  size_t sent = 0;
+  int echoed = 0;
+  int64_t start = now_ns();
+
+  while (echoed < frames) {
+    struct pollfd pfd;
+    pfd.fd = sockfd;
+    pfd.events = POLLIN | (sent < total ? POLLOUT : 0);
+
+    if (poll(&pfd, 1, 10000) <= 0) {
+      fprintf(stderr, "ERROR timed out with %d of %d bytes echoed\n",
+              echoed, frames);
+      exit(1);
+    }
+
+    while (sent < total && (pfd.revents & POLLOUT)) {
+      size_t count = total - sent < chunk ? total - sent : chunk;
+      ssize_t n = write(sockfd, stream + sent, count);
+      if (n < 0) {
+        if (errno != EAGAIN) {
+          error("ERROR writing to socket");
+        }
+        break;
+      }
+      sent += n;
+    }
+
+    if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+      continue;
+    }
+
+    int n = msg_recv_buffer_fill(&rx, msg_read_fd, &sockfd);
+    if (n == 0 || (n < 0 && errno != EWOULDBLOCK)) {
+      error("ERROR reading from socket");
+    }
+
+    struct msg_wrapper *message;
+    while ((n = msg_recv_buffer_next(&rx, &message)) > 0) {
+      if (message->type == IO_MSG) {
+        echoed += message->msg.io.data_size;
+      } else if (message->type == EXIT_MSG) {
+        fprintf(stderr, "ERROR cat exited\n");
+        exit(1);
+      }
+    }
+    if (n < 0) {
+      error("ERROR parsing message");
+    }
+  }
+
+  int64_t ns = now_ns() - start;
+
+  printf("%d frames in %.1f ms: %.0f frames/s\n",
+         frames, ns / 1e6, frames * 1e9 / ns);
+
+  return 0;
+}
@@ -0,0 +1,24 @@
+#!/bin/bash
+# Runs bench/frames against a server of its own and reports how many
+# read calls the server made to take the frames in.
+# Usage: frames.sh [frames per write] [server options...]
+
+cd "$(dirname "$0")/.." || exit 1
+
+port=${PORT:-9098}
+frames=${FRAMES:-200000}
+per_write=${1:-$frames}
+shift
+
+./server $port "$@" &
+server=$!
+trap 'kill $server 2>/dev/null' EXIT
+sleep 0.3
+
+reads() { awk '/^syscr/ { print $2 }' /proc/$server/io; }
+
+before=$(reads)
+bench/frames localhost $port $frames $per_write || exit 1
+after=$(reads)
+
+echo "server reads: $((after - before)) ($frames frames, $per_write per write)"
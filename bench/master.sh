@@ -0,0 +1,41 @@
+#!/bin/bash
+# Compares command startup through a fresh connection with startup
+# through a control master: runs a short command a number of times each
+# way and prints the mean wall time per run.
+# Usage: master.sh [runs] [server options...]
+
+cd "$(dirname "$0")/.." || exit 1
+
+port=${PORT:-9097}
+runs=${1:-200}
+shift
+
+tmp=$(mktemp -d)
+./server $port "$@" &
+server=$!
+trap 'kill $master $server 2>/dev/null; rm -rf $tmp' EXIT
+sleep 0.3
+
+./client --master $tmp/master localhost $port &
+master=$!
+sleep 0.3
+
+now_ns() { date +%s%N; }
+
+# Times $runs runs of the command given and prints the mean in ms.
+timed()
+{
+  local start=$(now_ns)
+  for i in $(seq $runs); do
+    if [ "$("$@" echo x < /dev/null)" != "x" ]; then
+      echo "ERROR $* failed" >&2
+      exit 1
+    fi
+  done
+  local end=$(now_ns)
+  awk "BEGIN { printf \"%.2f\", ($end - $start) / $runs / 1000000 }"
+}
+
+echo "direct: $(timed ./client localhost $port) ms per run"
+echo "master: $(timed ./client --control $tmp/master) ms per run"
+echo "($runs runs of echo x)"
@@ -0,0 +1,40 @@
+#!/bin/bash
+# Measures aggregate throughput of parallel `cat` sessions against the
+# number of server worker threads.
+# Usage: scaling.sh [sessions] [MB per session] [server options...]
+# THREADS lists the worker counts to try (default "1 2 4 8").
+
+cd "$(dirname "$0")/.." || exit 1
+
+port=${PORT:-9095}
+sessions=${1:-8}
+mb=${2:-20}
+shift $(($# < 2 ? $# : 2))
+
+tmp=$(mktemp -d)
+trap 'kill $server 2>/dev/null; rm -rf $tmp' EXIT
+
+head -c $((mb * 1024 * 1024)) /dev/urandom > $tmp/data
+
+echo "$sessions sessions of $mb MB, $(nproc) CPUs"
+for threads in ${THREADS:-1 2 4 8}; do
+  ./server $port --threads $threads "$@" &
+  server=$!
+  sleep 0.3
+
+  start=$(date +%s%N)
+  pids=""
+  for i in $(seq $sessions); do
+    ./client localhost $port cat $tmp/data < /dev/null > /dev/null &
+    pids="$pids $!"
+  done
+  wait $pids
+  end=$(date +%s%N)
+
+  kill $server
+  wait $server 2>/dev/null
+
+  awk "BEGIN { printf \"threads %-3d %6.0f ms %8.0f MB/s\n\", $threads,
+               ($end - $start) / 1000000,
+               $sessions * $mb * 1000000000 / ($end - $start) }"
+done
@@ -0,0 +1,52 @@
+#!/bin/bash
+# Measures the keystroke latency of interactive sessions while a few
+# others stream bulk output, with the workers balancing their load and
+# without (--no-balance): prints the p50 and p99 of the round trips.
+# Usage: skew.sh [bulk sessions] [interactive sessions] [server options...]
+# THREADS is the number of workers (default 4), KEYSTROKES the number
+# each interactive session types, 10ms apart (default 200).
+
+cd "$(dirname "$0")/.." || exit 1
+
+port=${PORT:-9099}
+bulk=${1:-2}
+interactive=${2:-16}
+shift $(($# < 2 ? $# : 2))
+threads=${THREADS:-4}
+
+tmp=$(mktemp -d)
+trap 'kill $bulk_pids $server 2>/dev/null; rm -rf $tmp' EXIT
+
+echo "$bulk bulk and $interactive interactive sessions," \
+     "$threads threads, $(nproc) CPUs"
+printf "%-12s %10s %10s\n" "" "p50" "p99"
+for balance in "" --no-balance; do
+  ./server $port --threads $threads $balance "$@" &
+  server=$!
+  sleep 0.3
+
+  bulk_pids=""
+  for i in $(seq $bulk); do
+    ./client localhost $port cat /dev/zero < /dev/null > /dev/null &
+    bulk_pids="$bulk_pids $!"
+  done
+
+  # Leaves the workers time to even out.
+  sleep 1
+
+  pids=""
+  for i in $(seq $interactive); do
+    bench/echo localhost $port ${KEYSTROKES:-200} > $tmp/echo.$i &
+    pids="$pids $!"
+  done
+  wait $pids
+
+  kill $bulk_pids $server
+  wait $bulk_pids $server 2>/dev/null
+  bulk_pids=""
+
+  sort -n $tmp/echo.* | awk -v name="${balance:-balance}" '
+    { us[NR] = $1 }
+    END { printf "%-12s %8.2fms %8.2fms\n", name,
+                 us[int(NR * 0.5)] / 1000, us[int(NR * 0.99)] / 1000 }'
+done
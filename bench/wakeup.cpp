@@ -0,0 +1,157 @@
+// Measures what one reactor wakeup costs depending on how many fds are
+// registered: N idle eventfds are watched along with a pipe that gets
+// one byte per round, and each round is a write, a reactor_run_once()
+// and a read from the handler.
+//
+// Usage: wakeup [--rounds <n>] [epoll|poll|io_uring]...
+
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "../reactor.h"
+
+static const int counts[] = {10, 100, 1000, 10000};
+
+static int rounds = 10000;
+static int woken;
+
+
+static int64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static void on_ready(struct reactor_watch *w, int events)
+{
+  char c;
+  while (read(w->fd, &c, 1) == 1) {
+    woken++;
+  }
+}
+
+
+static void on_idle(struct reactor_watch *w, int events)
+{
+  fprintf(stderr, "ERROR idle fd woke up\n");
+  exit(1);
+}
+
+
+// Returns the mean nanoseconds per wakeup with 'count' idle fds, or -1.
+static double run(int backend, int count)
+{
+  struct reactor reactor;
+  if (reactor_init(&reactor, backend) < 0) {
+    return -1;
+  }
+
+  struct reactor_watch *idle =
+    (struct reactor_watch*) calloc(count, sizeof(struct reactor_watch));
+  int pipefd[2];
+  if (idle == NULL || pipe2(pipefd, O_NONBLOCK) < 0) {
+    error("ERROR setting up");
+  }
+
+  for (int i = 0; i < count; i++) {
+    int fd = eventfd(0, EFD_NONBLOCK);
+    if (fd < 0 ||
+        reactor_add(&reactor, &idle[i], fd, REACTOR_READ, on_idle, NULL) < 0) {
+      error("ERROR adding idle fd");
+    }
+  }
+
+  struct reactor_watch ready;
+  if (reactor_add(&reactor, &ready, pipefd[0], REACTOR_READ,
+                  on_ready, NULL) < 0) {
+    error("ERROR adding pipe");
+  }
+
+  // Let io_uring arm everything before timing.
+  reactor_run_once(&reactor, 0);
+
+  woken = 0;
+  int64_t start = now_ns();
+
+  for (int i = 0; i < rounds; i++) {
+    if (write(pipefd[1], "x", 1) != 1) {
+      error("ERROR writing to pipe");
+    }
+    while (woken <= i) {
+      if (reactor_run_once(&reactor, -1) < 0) {
+        error("ERROR running reactor");
+      }
+    }
+  }
+
+  double ns = (double) (now_ns() - start) / rounds;
+
+  for (int i = 0; i < count; i++) {
+    int fd = idle[i].fd;
+    reactor_del(&reactor, &idle[i]);
+    close(fd);
+  }
+  reactor_del(&reactor, &ready);
+  close(pipefd[0]);
+  close(pipefd[1]);
+  free(idle);
+  reactor_destroy(&reactor);
+
+  return ns;
+}
+
+
+int main(int argc, char *argv[])
+{
+  static const char *names[] = {"epoll", "poll", "io_uring"};
+  static const int backends[] = {REACTOR_EPOLL, REACTOR_POLL, REACTOR_URING};
+  bool wanted[3] = {false, false, false};
+  bool any = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) {
+      rounds = atoi(argv[++i]);
+      continue;
+    }
+    for (int b = 0; b < 3; b++) {
+      if (strcmp(argv[i], names[b]) == 0) {
+        wanted[b] = any = true;
+      }
+    }
+  }
+
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  printf("%-10s", "idle fds");
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    printf("%10d", counts[i]);
+  }
+  printf("   (ns per wakeup)\n");
+
+  for (int b = 0; b < 3; b++) {
+    if (any && !wanted[b]) {
+      continue;
+    }
+
+    printf("%-10s", names[b]);
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+      double ns = run(backends[b], counts[i]);
+      if (ns < 0) {
+        printf("%10s", "-");
+      } else {
+        printf("%10.0f", ns);
+      }
+      fflush(stdout);
+    }
+    printf("\n");
+  }
+
+  return 0;
+}
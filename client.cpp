@@ -9,16 +9,121 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 
 #include "common.h"
+#include "flush.h"
+#include "master.h"
 #include "msgs.h"
+#include "predict.h"
+#include "reactor.h"
+#include "term.h"
 
 volatile int sockfd = -1;
 volatile int ttyfd = -1;
 struct termios original_termios;
 struct winsize original_winsize;
 
+int infd = STDIN_FILENO;
+int outfd = STDOUT_FILENO;
+int errfd = STDERR_FILENO;
+int sigwinch_pipe[2];
+bool done = false;
+struct buf_pool rx_pool;
+struct msg_recv_buffer rx;
+struct reactor reactor;
+struct reactor_watch input_watch;
+
+int exit_status = 0;
+
+// Flow control: how much stdin the server still takes.
+int stdin_credit = MSG_CREDIT_WINDOW;
+
+// Stdin that is not a tty is bulk and may be corked for a while; see
+// flush.h.
+struct flush_policy flush_policy;
+struct flush_state flush;
+
+// Whether the server is asked to compress output.
+bool compress = false;
+
+// Whether a --tty command runs synchronized: the server sends its
+// screen, kept here as 'screen', and 'shown' is what has been drawn of
+// it on the terminal so far.
+bool sync_screen = false;
+struct term_screen screen;
+struct term_screen shown;
+char render_buffer[64 * 1024];
+
+// With --predict, keystrokes are echoed locally before the server has
+// seen them; 'display' is 'screen' with the guesses drawn over it.
+bool predict = false;
+struct predictor predictor;
+struct term_screen display;
+
+// With --resumable the session outlives its connection: frames sent
+// are kept in 'resume' until the server acks them, and a connection
+// that breaks is replaced by a new one to 'server_addr' that picks up
+// where it left off; see resume.h.
+bool resumable = false;
+struct resume_log resume;
+char resume_token[RESUME_TOKEN_SIZE];
+struct sockaddr_in server_addr;
+struct reactor_watch socket_watch;
+
+// With --detach the command is started in a session of its own that
+// goes on without a client, and --attach joins the clients attached to
+// such a session until DETACH_KEY is typed or the client goes away.
+// With --read-only it only watches.
+bool detach = false;
+unsigned int attach_id = 0;
+bool read_only = false;
+bool detached = false;
+
+#define DETACH_KEY 0x1c // Ctrl-backslash
+
+// With --local --direct the server passes the command's fds (FDS_MSG)
+// and the client reads and writes them itself: a tty's are all the same
+// pty master. Input the command has not taken yet waits in
+// 'direct_input', and no more is read until it has. The client is done
+// once the command has exited and its output has ended.
+bool direct = false;
+int direct_fds[3] = { -1, -1, -1 };
+int num_direct_fds = 0;
+struct reactor_watch direct_watches[3];
+char direct_input[4096];
+size_t direct_input_start = 0;
+size_t direct_input_len = 0;
+bool exited = false;
+
+// Room for a ZIO_MSG frame once it has been decompressed.
+int zio_frame[(IO_MSG_HEADER_SIZE + MSG_MAX_IO_SIZE) / sizeof(int)];
+
+// Set once stdin has ended. A single command is told with an EOF_MSG
+// and its output is still forwarded until it exits.
+bool input_eof = false;
+
+// A command running on a channel of the connection, and how much of its
+// output has been written out here without being credited back. A
+// single command runs on channel 0; in batch mode the channel ids are
+// the indices of this array.
+struct job
+{
+  bool busy;
+  int written[3];
+};
+
+struct job *jobs;
+int max_jobs = 1;
+int running = 0;
+
+// Batch mode: commands are read from stdin, one per line, and run on
+// their own channels of one connection, up to max_jobs at a time.
+bool batch = false;
+char *lines = NULL;
+size_t lines_start = 0;
+size_t lines_len = 0;
+size_t lines_size = 0;
+
 
 void sigterm(int sig)
 {
@@ -36,8 +141,25 @@ void sigterm(int sig)
 }
 
 
-void sigwinch(int sig){
-  signal(SIGWINCH, SIG_IGN);
+// The winsize message is sent from the event loop rather than the
+// signal handler so it can never interleave with another message.
+void sigwinch(int sig)
+{
+  int saved_errno = errno;
+  char c = 0;
+  write(sigwinch_pipe[1], &c, 1);
+  errno = saved_errno;
+}
+
+
+void on_sigwinch(struct reactor_watch *w, int events)
+{
+  char drain[64];
+  while (read(sigwinch_pipe[0], drain, sizeof(drain)) > 0) {}
+
+  if (read_only) {
+    return;
+  }
 
   struct winsize winsize;
   int result = ioctl(0, TIOCGWINSZ, &winsize);
@@ -45,76 +167,1059 @@ void sigwinch(int sig){
     error("ERROR getting winsize");
   }
 
-  int n = send_winsize_msg(sockfd, &winsize);
+  if (direct) {
+    if (direct_fds[STDIN_FILENO] >= 0 &&
+        ioctl(direct_fds[STDIN_FILENO], TIOCSWINSZ, &winsize) < 0) {
+      error("ERROR setting winsize parameters");
+    }
+    return;
+  }
+
+  int n = send_winsize_msg(sockfd, 0, &winsize);
   if (n < 0) {
     error("ERROR writing to sockfd");
   }
+}
+
+
+void draw_screen();
+
+void on_input(struct reactor_watch *w, int events)
+{
+  while (!input_eof && stdin_credit > 0) {
+    char buffer[4096];
+
+    int size = stdin_credit < 4096 ? stdin_credit : 4096;
+
+    int n = read_all(infd, buffer, size);
+    if (n < 0) {
+      if (errno == EWOULDBLOCK) {
+        break;
+      }
+      error("ERROR reading from infd");
+    }
+
+    if (n == 0) {
+      input_eof = true;
+
+      if (reactor_del(&reactor, &input_watch) < 0) {
+        error("ERROR removing infd watch");
+      }
+
+      if (send_eof_msg(sockfd, 0) < 0) {
+        error("ERROR writing to sockfd");
+      }
+      flush_push(sockfd, &flush);
+      break;
+    }
+
+    // What was typed before the detach key still goes out.
+    if (attach_id != 0) {
+      char *key = (char*) memchr(buffer, DETACH_KEY, n);
+      if (key != NULL) {
+        detached = true;
+        done = true;
+        n = key - buffer;
+        if (n == 0) {
+          break;
+        }
+      }
+    }
+
+    if (read_only) {
+      if (detached) {
+        break;
+      }
+      continue;
+    }
+
+    stdin_credit -= n;
+
+    if (ttyfd < 0) {
+      flush_bulk(sockfd, &flush, &flush_policy);
+    }
+
+    if (predict) {
+      predictor_input(&predictor, &screen, buffer, n, flush_now_ms());
+    }
+
+    n = send_io_msg(sockfd, 0, STDIN_FILENO, buffer, n);
+    if (n < 0) {
+      error("ERROR writing to sockfd");
+    }
+
+    if (predict && predictor.showing && screen.cells != NULL) {
+      draw_screen();
+    }
+
+    if (detached) {
+      break;
+    }
+  }
+
+  // Out of credit: stop reading stdin until the server hands more back.
+  if (!input_eof && stdin_credit == 0) {
+    if (reactor_update(&reactor, &input_watch, 0) < 0) {
+      error("ERROR updating infd watch");
+    }
+  }
+}
+
+
+void direct_update_watches()
+{
+  bool pending = direct_input_start < direct_input_len;
+  int result = 0;
+
+  if (!input_eof) {
+    result |= reactor_update(&reactor, &input_watch,
+                             pending ? 0 : REACTOR_READ);
+  }
+
+  // A tty is read and written through the same fd, and so the same
+  // watch.
+  if (direct_fds[STDIN_FILENO] == direct_fds[STDOUT_FILENO]) {
+    if (direct_fds[STDOUT_FILENO] >= 0) {
+      result |= reactor_update(&reactor, &direct_watches[STDOUT_FILENO],
+                               REACTOR_READ | (pending ? REACTOR_WRITE : 0));
+    }
+  } else if (direct_fds[STDIN_FILENO] >= 0) {
+    result |= reactor_update(&reactor, &direct_watches[STDIN_FILENO],
+                             pending ? REACTOR_WRITE : 0);
+  }
+
+  if (result < 0) {
+    error("ERROR updating watches");
+  }
+}
+
+
+// Writes as much of the pending input as the command takes. Once stdin
+// has ended and all of it is written, the command's stdin pipe is
+// closed; a tty has no such thing and is left alone.
+void direct_flush_input()
+{
+  int fd = direct_fds[STDIN_FILENO];
+
+  while (fd >= 0 && direct_input_start < direct_input_len) {
+    ssize_t n = write(fd, direct_input + direct_input_start,
+                      direct_input_len - direct_input_start);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && errno == EWOULDBLOCK) {
+      break;
+    }
+
+    // The command does not read its input any more, so the rest of it
+    // is dropped.
+    if (n < 0) {
+      direct_input_start = direct_input_len;
+      if (!input_eof) {
+        input_eof = true;
+        if (reactor_del(&reactor, &input_watch) < 0) {
+          error("ERROR removing infd watch");
+        }
+      }
+      break;
+    }
+
+    direct_input_start += n;
+  }
+
+  if (input_eof && direct_input_start == direct_input_len &&
+      fd >= 0 && fd != direct_fds[STDOUT_FILENO]) {
+    reactor_del(&reactor, &direct_watches[STDIN_FILENO]);
+    close(fd);
+    direct_fds[STDIN_FILENO] = -1;
+  }
+
+  direct_update_watches();
+}
+
+
+void on_direct_input(struct reactor_watch *w, int events)
+{
+  while (!input_eof && direct_input_start == direct_input_len) {
+    int n = read_all(infd, direct_input, sizeof(direct_input));
+    if (n < 0) {
+      if (errno == EWOULDBLOCK) {
+        break;
+      }
+      error("ERROR reading from infd");
+    }
+
+    if (n == 0) {
+      input_eof = true;
+      if (reactor_del(&reactor, &input_watch) < 0) {
+        error("ERROR removing infd watch");
+      }
+      break;
+    }
+
+    direct_input_start = 0;
+    direct_input_len = n;
+    direct_flush_input();
+  }
+
+  direct_flush_input();
+}
+
+
+void on_direct_write(struct reactor_watch *w, int events)
+{
+  direct_flush_input();
+}
+
+
+// Copies the command's output to ours until it ends (EOF, or EIO from
+// a pty whose tty has been closed by everyone).
+void on_direct_output(struct reactor_watch *w, int events)
+{
+  int stream = w == &direct_watches[STDERR_FILENO] ?
+               STDERR_FILENO : STDOUT_FILENO;
+  int destfd = stream == STDERR_FILENO ? errfd : outfd;
+
+  if (events & REACTOR_WRITE) {
+    direct_flush_input();
+  }
+
+  while (direct_fds[stream] >= 0) {
+    char buffer[MSG_MAX_IO_SIZE];
+
+    int n = read_all(direct_fds[stream], buffer, sizeof(buffer));
+    if (n < 0) {
+      if (errno == EWOULDBLOCK) {
+        break;
+      }
+      error("ERROR reading from command output");
+    }
+
+    if (n == 0) {
+      if (reactor_del(&reactor, w) < 0) {
+        error("ERROR removing command output watch");
+      }
+      close(direct_fds[stream]);
+      if (direct_fds[STDIN_FILENO] == direct_fds[stream]) {
+        direct_fds[STDIN_FILENO] = -1;
+      }
+      direct_fds[stream] = -1;
+      break;
+    }
+
+    if (write_all(destfd, buffer, n) < 0) {
+      error("ERROR writing to stdout");
+    }
+  }
+
+  if (exited && direct_fds[STDOUT_FILENO] < 0 &&
+      direct_fds[STDERR_FILENO] < 0) {
+    done = true;
+  }
+}
+
+
+// Returns the next non-empty command line, or NULL if there is no
+// complete one yet. Once stdin is at EOF a last unterminated line
+// counts as complete.
+char *next_line()
+{
+  while (lines_start < lines_len) {
+    char *line = lines + lines_start;
+    char *end = (char*) memchr(line, '\n', lines_len - lines_start);
+
+    if (end == NULL) {
+      if (!input_eof) {
+        return NULL;
+      }
+      end = lines + lines_len;
+    }
+
+    *end = '\0';
+    lines_start = end - lines + 1;
+
+    if (*line != '\0') {
+      return line;
+    }
+  }
+
+  return NULL;
+}
+
+
+bool have_line()
+{
+  size_t pending = lines_len > lines_start ? lines_len - lines_start : 0;
+
+  if (pending == 0) {
+    return false;
+  }
+
+  return input_eof || memchr(lines + lines_start, '\n', pending) != NULL;
+}
+
+
+// Starts commands on free channels while there are lines for them, and
+// only reads more of stdin when a channel is waiting for a line.
+void start_jobs()
+{
+  while (running < max_jobs) {
+    char *line = next_line();
+    if (line == NULL) {
+      break;
+    }
+
+    int id = 0;
+    while (jobs[id].busy) {
+      id++;
+    }
+
+    char sh[] = "sh";
+    char dash_c[] = "-c";
+    char *cmd[] = { sh, dash_c, line };
+
+    if (send_cmd_msg(sockfd, id, cmd, 3, false, true, compress, false, false,
+                     false, NULL, NULL, 0) < 0) {
+      error("ERROR writing cmd to socket");
+    }
+
+    memset(&jobs[id], 0, sizeof(struct job));
+    jobs[id].busy = true;
+    running++;
+  }
+
+  if (input_eof && !have_line() && running == 0) {
+    done = true;
+    return;
+  }
+
+  int events = !input_eof && !have_line() ? REACTOR_READ : 0;
+  if (reactor_update(&reactor, &input_watch, events) < 0) {
+    error("ERROR updating infd watch");
+  }
+}
+
+
+void on_batch_input(struct reactor_watch *w, int events)
+{
+  while (!input_eof && !have_line()) {
+    if (lines_start > 0) {
+      memmove(lines, lines + lines_start, lines_len - lines_start);
+      lines_len -= lines_start;
+      lines_start = 0;
+    }
+
+    // One spare byte, so a last line without a newline can always be
+    // terminated in place.
+    if (lines_size - lines_len < 4096 + 1) {
+      lines_size = lines_size == 0 ? 65536 : lines_size * 2;
+      lines = (char*) realloc(lines, lines_size);
+      if (lines == NULL) {
+        error("ERROR allocating line buffer");
+      }
+    }
+
+    int n = read_all(infd, lines + lines_len, lines_size - lines_len - 1);
+    if (n < 0) {
+      if (errno == EWOULDBLOCK) {
+        break;
+      }
+      error("ERROR reading from infd");
+    }
+
+    if (n == 0) {
+      input_eof = true;
+      break;
+    }
+
+    lines_len += n;
+  }
+
+  start_jobs();
+}
+
+
+// Brings the terminal in line with the screen sent by the server, and
+// whatever is predicted on top of it.
+void draw_screen()
+{
+  struct term_screen *target = &screen;
+  if (predict && predictor_overlay(&predictor, &screen, &display)) {
+    target = &display;
+  }
+
+  bool done = false;
+
+  while (!done) {
+    size_t size = term_render(&shown, target, render_buffer,
+                              sizeof(render_buffer), &done);
+
+    if (write_all(outfd, render_buffer, size) < 0) {
+      error("ERROR writing to stdout");
+    }
+  }
+}
+
+
+void handle_screen_msg(struct screen_msg *update)
+{
+  if (update->flags & SCREEN_RESET ||
+      update->rows != screen.rows ||
+      update->cols != screen.cols) {
+    term_screen_destroy(&screen);
+    term_screen_destroy(&shown);
+    term_screen_destroy(&display);
+
+    if (term_screen_init(&screen, update->rows, update->cols) < 0 ||
+        term_screen_init(&shown, update->rows, update->cols) < 0 ||
+        term_screen_init(&display, update->rows, update->cols) < 0) {
+      error("ERROR allocating screen");
+    }
+
+    predictor_reset(&predictor);
+
+    const char clear[] = "\033[0m\033[H\033[2J";
+    if (write_all(outfd, clear, sizeof(clear) - 1) < 0) {
+      error("ERROR writing to stdout");
+    }
+  }
+
+  if (term_apply(&screen, update->data, update->data_size) < 0 ||
+      update->cursor_row >= screen.rows ||
+      update->cursor_col >= screen.cols) {
+    errno = EPROTO;
+    error("ERROR parsing screen from sockfd");
+  }
+
+  if (update->flags & SCREEN_FINAL) {
+    screen.cursor_row = update->cursor_row;
+    screen.cursor_col = update->cursor_col;
+    screen.cursor_visible = update->flags & SCREEN_CURSOR_VISIBLE;
+    if (predict) {
+      predictor_check(&predictor, &screen, update->echo_ack, flush_now_ms());
+    }
+    draw_screen();
+  }
+}
+
+
+void handle_message(struct msg_wrapper *message)
+{
+  message = msg_expand(message, (struct msg_wrapper*) zio_frame);
+  if (message == NULL) {
+    error("ERROR decompressing message from sockfd");
+  }
+
+  switch (message->type) {
+    case WINSIZE_MSG: {
+      int result = ioctl(
+          ttyfd,
+          TIOCSWINSZ,
+          &message->msg.winsize.winsize);
+
+      if (result < 0) {
+        error("ERROR setting winsize parameters");
+      }
+
+      break;
+    }
+    case IO_MSG: {
+      int destfd = -1;
+
+      switch (message->msg.io.destfd) {
+        case STDIN_FILENO:
+          destfd = infd;
+          break;
+        case STDOUT_FILENO:
+          destfd = outfd;
+          break;
+        case STDERR_FILENO:
+          destfd = errfd;
+          break;
+      }
+
+      int n = write_all(
+          destfd,
+          message->msg.io.data,
+          message->msg.io.data_size);
+
+      if (n < 0) {
+        error("ERROR writing to stdout");
+      }
+
+      // The data is out of our hands, so the server may send more.
+      int stream = message->msg.io.destfd;
+      if (stream == STDOUT_FILENO || stream == STDERR_FILENO) {
+        int *written = jobs[message->channel].written;
+        written[stream] += message->msg.io.data_size;
+
+        if (written[stream] >= MSG_CREDIT_THRESHOLD) {
+          int n = send_credit_msg(
+              sockfd,
+              message->channel,
+              stream,
+              written[stream]);
+
+          if (n < 0) {
+            error("ERROR writing to sockfd");
+          }
+          flush_push(sockfd, &flush);
+          written[stream] = 0;
+        }
+      }
+      break;
+    }
+    case SCREEN_MSG: {
+      handle_screen_msg(&message->msg.screen);
+      break;
+    }
+    case EXIT_MSG: {
+      int status = message->msg.exit.status;
+      int code = WIFEXITED(status) ?
+        WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+      // Passed fds may still have output in them.
+      if (!batch) {
+        exit_status = code;
+        exited = true;
+        done = !direct || (direct_fds[STDOUT_FILENO] < 0 &&
+                           direct_fds[STDERR_FILENO] < 0);
+        break;
+      }
+
+      if (code != 0) {
+        exit_status = 1;
+      }
+
+      jobs[message->channel].busy = false;
+      running--;
+      start_jobs();
+      break;
+    }
+    case ACK_MSG: {
+      resume_log_ack(&resume, message->msg.ack.received);
+      break;
+    }
+    case CREDIT_MSG: {
+      if (message->msg.credit.destfd != STDIN_FILENO || batch) {
+        break;
+      }
+
+      bool stalled = stdin_credit == 0;
+      stdin_credit += message->msg.credit.bytes;
+
+      if (stalled && !input_eof) {
+        if (reactor_update(&reactor, &input_watch, REACTOR_READ) < 0) {
+          error("ERROR updating infd watch");
+        }
+      }
+      break;
+    }
+  }
+}
+
+
+void on_socket(struct reactor_watch *w, int events)
+{
+  int fd = sockfd;
+
+  while (!done) {
+    struct msg_wrapper *message;
+    size_t start = rx.start;
+    int n = msg_recv_buffer_next(&rx, &message);
+
+    if (n < 0) {
+      error("ERROR parsing message from sockfd");
+    }
+
+    if (n > 0 && (message->channel < 0 || message->channel >= max_jobs)) {
+      errno = EPROTO;
+      error("ERROR parsing message from sockfd");
+    }
+
+    if (n > 0) {
+      size_t size = rx.start - start;
+
+      handle_message(message);
+
+      if (resumable && resume_log_received(&resume, size)) {
+        if (send_ack_msg(sockfd, resume_log_acking(&resume)) < 0) {
+          error("ERROR writing to sockfd");
+        }
+      }
+      continue;
+    }
+
+    n = msg_recv_buffer_fill(&rx, msg_read_fd, &fd);
+
+    if (n < 0 && errno == EWOULDBLOCK) {
+      break;
+    }
 
-  signal(SIGWINCH, sigwinch);
+    // The main loop gets a new connection.
+    if (n <= 0 && resumable) {
+      resume.broken = true;
+      break;
+    }
+
+    if (n < 0) {
+      error("ERROR reading from sockfd");
+    }
+
+    // The server never closes first while a command is running.
+    if (n == 0) {
+      errno = ECONNRESET;
+      error("ERROR reading from sockfd");
+    }
+  }
 }
 
 
 void usage(char *cmd)
 {
   fprintf(stderr,
-          "Usage: %s <hostname> <port> [--tty] <cmd> [<args...>]\n",
-          cmd);
+          "Usage: %s <hostname> <port> [--tty [--sync | --predict]]\n"
+          "           [--compress] [--resumable] [<flush options>]\n"
+          "           <cmd> [<args...>]\n"
+          "       %s <hostname> <port> --detach [--sync] <cmd> [<args...>]\n"
+          "       %s <hostname> <port> --attach <id> [--read-only]\n"
+          "       %s <hostname> <port> --batch [--jobs <n>] [--compress]\n"
+          "           [--resumable] [<flush options>]\n"
+          "       %s --master <socket> <hostname> <port>\n"
+          "       %s --control <socket> [--tty] [--compress]\n"
+          "           <cmd> [<args...>]\n"
+          "       %s --local <socket> [--direct] <options as above> <cmd>\n"
+          "           [<args...>]\n"
+          "Flush options: [--flush-budget <ms>] [--notsent-lowat <bytes>]\n",
+          cmd, cmd, cmd, cmd, cmd, cmd, cmd);
   exit(1);
 }
 
 
-int main(int argc, char *argv[])
+// Returns a socket connected to 'serv_addr', or -1 with errno set.
+int open_connection(struct sockaddr_in *serv_addr)
 {
-  if (argc < 4) {
-    usage(argv[0]);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)  {
+    return -1;
   }
 
-  if ((strcmp(argv[3], "--tty") == 0) && (argc < 5)) {
-    usage(argv[0]);
+  int result = connect(
+      fd,
+      (struct sockaddr *) serv_addr,
+      sizeof(struct sockaddr_in));
+
+  if (result < 0 || flush_setup(fd, &flush_policy) < 0) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
   }
 
-  struct hostent *server = gethostbyname(argv[1]);
+  return fd;
+}
+
+
+int connect_to_server(const char *hostname, const char *port)
+{
+  struct hostent *server = gethostbyname(hostname);
   if (server == NULL) {
     fprintf(stderr, "ERROR, no such host\n");
     exit(1);
   }
 
-  int portno = atoi(argv[2]);
+  int portno = atoi(port);
+
+  memset((char *) &server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  memcpy((char *)&server_addr.sin_addr.s_addr,
+         (char *)server->h_addr,
+         server->h_length);
+  server_addr.sin_port = htons(portno);
+
+  int fd = open_connection(&server_addr);
+  if (fd < 0) {
+    error("ERROR connecting");
+  }
+
+  return fd;
+}
+
+
+// Starts a session over the blocking socket 'fd', or resumes the one of
+// 'resume_token' if 'resuming'. Returns 1 and sets '*received' to what
+// the server has received of it, 0 if the server does not know it, or
+// -1 with errno set if the connection failed.
+int session_handshake(int fd, bool resuming, uint32_t *received)
+{
+  char token[RESUME_TOKEN_SIZE];
+  memset(token, 0, sizeof(token));
+  if (resuming) {
+    memcpy(token, resume_token, sizeof(token));
+  }
+
+  if (send_session_msg(fd, token, (uint32_t) resume.received,
+                       resume.size) < 0) {
+    return -1;
+  }
+
+  struct msg_wrapper reply;
+  size_t size = MSG_HEADER_SIZE + sizeof(struct session_msg);
+
+  int n = read_all(fd, (char*) &reply, size);
+  if (n < 0) {
+    return -1;
+  }
+
+  if ((size_t) n < size || reply.type != SESSION_MSG) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  // A token of zeros is a no.
+  memset(token, 0, sizeof(token));
+  if (memcmp(reply.msg.session.token, token, sizeof(token)) == 0) {
+    return 0;
+  }
+
+  memcpy(resume_token, reply.msg.session.token, sizeof(token));
+  resume.peer_size = reply.msg.session.log_size;
+  *received = reply.msg.session.received;
+  return 1;
+}
+
+
+// Replaces a broken connection with a new one to the same session and
+// sends again whatever the server is missing. Gives up once the server
+// would have dropped the session.
+void reconnect()
+{
+  reactor_del(&reactor, &socket_watch);
+  close(sockfd);
+  msg_recv_buffer_release(&rx);
+  flush_state_init(&flush);
+  msg_log_fd = -1;
+
+  int64_t deadline = flush_now_ms() + RESUME_DEFAULT_TIMEOUT * 1000;
+  uint32_t received = 0;
+  int fd = -1;
+
+  while (true) {
+    fd = open_connection(&server_addr);
+    if (fd >= 0) {
+      int result = session_handshake(fd, true, &received);
+      if (result > 0) {
+        break;
+      }
+      if (result == 0) {
+        fprintf(stderr, "ERROR, session expired\n");
+        exit(1);
+      }
+      close(fd);
+    }
+
+    if (flush_now_ms() >= deadline) {
+      error("ERROR reconnecting");
+    }
+    sleep(1);
+  }
+
+  if (resume_log_rewind(&resume, received) < 0) {
+    errno = EPROTO;
+    error("ERROR resuming session");
+  }
+  resume.acked = resume.received;
+
+  while (resume_log_resending(&resume)) {
+    char *data;
+    size_t size = resume_log_pending(&resume, &data);
+
+    if (write_all(fd, data, size) < 0) {
+      error("ERROR writing to sockfd");
+    }
+    resume_log_resent(&resume, size);
+  }
+
+  if (make_non_blocking(fd) < 0) {
+    error("ERROR making sockfd non blocking");
+  }
+
+  sockfd = fd;
+  msg_log_fd = fd;
+  resume.broken = false;
+
+  if (reactor_add(&reactor, &socket_watch, sockfd, REACTOR_READ,
+                  on_socket, NULL) < 0) {
+    error("ERROR watching sockfd");
+  }
+}
+
+
+// Reads the socket like msg_read_fd(), taking in the fds the server
+// passes along with an FDS_MSG.
+int read_passed_fds(void *ctx, char *buf, size_t count)
+{
+  while (true) {
+    ssize_t n = read_fds(sockfd, buf, count, direct_fds, &num_direct_fds, 3);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    return n;
+  }
+}
+
+
+// Waits for the frame of 'type' that the server answers with: an
+// ATTACH_MSG for a detached command or an attach, an FDS_MSG for a
+// --direct one. A command that fails to start is answered with its exit
+// status instead, which ends the client.
+struct msg_wrapper *wait_for_reply(int type)
+{
+  int fd = sockfd;
+
+  while (true) {
+    struct msg_wrapper *message;
+    int n = msg_recv_buffer_next(&rx, &message);
+
+    if (n < 0) {
+      error("ERROR parsing message from sockfd");
+    }
+
+    if (n > 0 && message->type == type) {
+      return message;
+    }
+
+    if (n > 0 && message->type == EXIT_MSG) {
+      handle_message(message);
+      exit(exit_status);
+    }
+
+    if (n > 0) {
+      errno = EPROTO;
+      error("ERROR parsing message from sockfd");
+    }
+
+    n = msg_recv_buffer_fill(&rx, read_passed_fds, NULL);
+
+    if (n < 0 && errno == EWOULDBLOCK) {
+      struct pollfd pollfd = { fd, POLLIN, 0 };
+      poll(&pollfd, 1, -1);
+      continue;
+    }
+
+    if (n < 0) {
+      error("ERROR reading from sockfd");
+    }
+
+    if (n == 0) {
+      errno = ECONNRESET;
+      error("ERROR reading from sockfd");
+    }
+  }
+}
+
+
+int main(int argc, char *argv[])
+{
+  if (argc < 4) {
+    usage(argv[0]);
+  }
+
+  flush_policy_init(&flush_policy);
+  flush_state_init(&flush);
+
+  if (strcmp(argv[1], "--master") == 0) {
+    if (argc != 5) {
+      usage(argv[0]);
+    }
+    return master_run(argv[2], connect_to_server(argv[3], argv[4]));
+  }
+
+  // A control client hands its stdio over to the master, which does
+  // all the reading and writing; all that is left here is waiting for
+  // the exit status (and forwarding window size changes).
+  bool control = strcmp(argv[1], "--control") == 0;
+
+  // A local client talks to the server over its unix socket instead,
+  // and may have it pass the command's fds with --direct.
+  bool local = strcmp(argv[1], "--local") == 0;
 
   bool tty = false;
+  int num_jobs = 16;
+  bool have_jobs = false;
   int cmd_start_idx = 3;
-  if (strcmp(argv[3], "--tty") == 0) {
-    tty = true;
-    cmd_start_idx = 4;
+
+  // Options go between the address and the command.
+  while (cmd_start_idx < argc &&
+         strncmp(argv[cmd_start_idx], "--", 2) == 0) {
+    int flush_option = flush_policy_option(
+        &flush_policy, argc, argv, &cmd_start_idx);
+    if (flush_option < 0) {
+      usage(argv[0]);
+    }
+    if (flush_option > 0) {
+      continue;
+    }
+
+    const char *option = argv[cmd_start_idx++];
+
+    if (strcmp(option, "--tty") == 0) {
+      tty = true;
+    } else if (strcmp(option, "--sync") == 0 && !control) {
+      sync_screen = true;
+    } else if (strcmp(option, "--predict") == 0 && !control) {
+      sync_screen = true;
+      predict = true;
+    } else if (strcmp(option, "--compress") == 0) {
+      compress = true;
+    } else if (strcmp(option, "--resumable") == 0 && !control) {
+      resumable = true;
+    } else if (strcmp(option, "--detach") == 0 && !control) {
+      detach = true;
+    } else if (strcmp(option, "--attach") == 0 && !control &&
+               cmd_start_idx < argc) {
+      attach_id = strtoul(argv[cmd_start_idx++], NULL, 10);
+      if (attach_id == 0) {
+        usage(argv[0]);
+      }
+    } else if (strcmp(option, "--direct") == 0 && local) {
+      direct = true;
+    } else if (strcmp(option, "--read-only") == 0 && !control) {
+      read_only = true;
+    } else if (strcmp(option, "--batch") == 0 && !control) {
+      batch = true;
+    } else if (strcmp(option, "--jobs") == 0 && cmd_start_idx < argc) {
+      num_jobs = atoi(argv[cmd_start_idx++]);
+      have_jobs = true;
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  // Passed fds are read and written as they are, and a resumed session
+  // would be looked for over TCP.
+  if ((direct && (sync_screen || compress || detach || attach_id != 0 ||
+                  batch || have_jobs)) ||
+      (local && resumable)) {
+    usage(argv[0]);
+  }
+
+  if (detach || attach_id != 0) {
+    if (batch || tty || have_jobs || compress || predict || resumable ||
+        (detach && (attach_id != 0 || read_only || cmd_start_idx == argc)) ||
+        (attach_id != 0 && (sync_screen || cmd_start_idx != argc))) {
+      usage(argv[0]);
+    }
+    tty = attach_id != 0;
+  } else if (read_only) {
+    usage(argv[0]);
+  } else if (batch) {
+    if (tty || cmd_start_idx != argc || num_jobs < 1) {
+      usage(argv[0]);
+    }
+    max_jobs = num_jobs;
+  } else if (have_jobs || cmd_start_idx == argc || (sync_screen && !tty)) {
+    usage(argv[0]);
   }
 
   char **cmd = &argv[cmd_start_idx];
 
-  sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (sockfd < 0)  {
-    error("ERROR opening socket");
+  int result;
+
+  predictor_init(&predictor);
+
+  if (control) {
+    sockfd = unix_connect(argv[2]);
+    if (sockfd < 0) {
+      error("ERROR connecting to master");
+    }
+  } else if (local) {
+    sockfd = unix_connect(argv[2]);
+    if (sockfd < 0) {
+      error("ERROR connecting");
+    }
+  } else {
+    sockfd = connect_to_server(argv[1], argv[2]);
   }
 
-  struct sockaddr_in serv_addr;
-  memset((char *) &serv_addr, 0, sizeof(serv_addr));
-  serv_addr.sin_family = AF_INET;
-  memcpy((char *)&serv_addr.sin_addr.s_addr,
-         (char *)server->h_addr,
-         server->h_length);
-  serv_addr.sin_port = htons(portno);
+  if (resumable) {
+    if (resume_log_init(&resume, RESUME_DEFAULT_SIZE) < 0) {
+      error("ERROR allocating resume log");
+    }
 
-  int result = connect(
-      sockfd,
-      (struct sockaddr *) &serv_addr,
-      sizeof(serv_addr));
+    uint32_t received;
+    int n = session_handshake(sockfd, false, &received);
+    if (n < 0) {
+      error("ERROR starting session");
+    }
+    if (n == 0) {
+      fprintf(stderr, "ERROR, server does not resume sessions\n");
+      exit(1);
+    }
+
+    // From here on writes that fail are made up for by reconnect().
+    signal(SIGPIPE, SIG_IGN);
+    msg_log = &resume;
+    msg_log_fd = sockfd;
+  }
 
+  jobs = (struct job*) calloc(max_jobs, sizeof(struct job));
+  if (jobs == NULL) {
+    error("ERROR allocating jobs");
+  }
+
+  result = make_non_blocking(sockfd);
   if (result < 0) {
-    error("ERROR connecting");
+    error("ERROR making sockfd non blocking");
   }
 
-  int infd = STDIN_FILENO;
-  int outfd = STDOUT_FILENO;
-  int errfd = STDERR_FILENO;
+  pool_init(&rx_pool, MSG_RECV_BUFFER_SIZE, 1);
+  msg_recv_buffer_init(&rx, &rx_pool);
+
+  // The session's tty keeps whatever size the last client gave it.
+  if (detach) {
+    if (ioctl(0, TIOCGWINSZ, &original_winsize) < 0) {
+      original_winsize.ws_row = 24;
+      original_winsize.ws_col = 80;
+    }
+
+    if (send_cmd_msg(sockfd, 0, cmd, argc - cmd_start_idx, true, false,
+                     false, sync_screen, true, false, &original_winsize,
+                     NULL, 0) < 0) {
+      error("ERROR writing cmd to socket");
+    }
+
+    printf("%u\n", wait_for_reply(ATTACH_MSG)->msg.attach.id);
+
+    // Output may be on its way already; the server closes once it has
+    // let go of the session.
+    shutdown(sockfd, SHUT_WR);
+    while (true) {
+      char drain[4096];
+      int n = read(sockfd, drain, sizeof(drain));
+      if (n < 0 && errno == EWOULDBLOCK) {
+        struct pollfd pollfd = { sockfd, POLLIN, 0 };
+        poll(&pollfd, 1, -1);
+      } else if (n == 0 || (n < 0 && errno != EINTR)) {
+        break;
+      }
+    }
+    return 0;
+  }
+
+  if (attach_id != 0) {
+    if (send_attach_msg(sockfd, attach_id,
+                        read_only ? ATTACH_READ_ONLY : 0) < 0) {
+      error("ERROR writing to sockfd");
+    }
+
+    struct attach_msg reply = wait_for_reply(ATTACH_MSG)->msg.attach;
+    if (reply.id == 0) {
+      fprintf(stderr, "ERROR, no such session\n");
+      exit(1);
+    }
+    sync_screen = reply.flags & ATTACH_SYNC;
+  }
 
   if (tty) {
     char *ttyname = ctermid(NULL);
@@ -149,133 +1254,150 @@ int main(int argc, char *argv[])
     errfd = ttyfd;
 
     signal(SIGTERM, sigterm);
-    signal(SIGWINCH, sigwinch);
   }
 
-  int n = send_cmd_msg(
-      sockfd,
-      cmd,
-      argc - cmd_start_idx,
-      tty,
-      &original_winsize);
+  if (attach_id != 0) {
+    if (!read_only && send_winsize_msg(sockfd, 0, &original_winsize) < 0) {
+      error("ERROR writing to sockfd");
+    }
 
-  if (n < 0) {
-    error("ERROR writing cmd to socket");
-  }
+    jobs[0].busy = true;
+    running = 1;
+  } else if (!batch) {
+    int fds[3] = { infd, outfd, errfd };
 
-  result = make_non_blocking(infd);
-  if (result < 0) {
-    error("ERROR making infd non blocking");
-  }
+    int n = send_cmd_msg(
+        sockfd,
+        0,
+        cmd,
+        argc - cmd_start_idx,
+        tty,
+        false,
+        compress,
+        sync_screen,
+        false,
+        direct,
+        &original_winsize,
+        fds,
+        control ? 3 : 0);
 
-  result = make_non_blocking(sockfd);
-  if (result < 0) {
-    error("ERROR making sockfd non blocking");
-  }
+    if (n < 0) {
+      error("ERROR writing cmd to socket");
+    }
 
-  struct async_msg_state msg_state;
-  memset(&msg_state, 0, sizeof(struct async_msg_state));
+    if (direct) {
+      int num_fds = wait_for_reply(FDS_MSG)->msg.fds.num_fds;
+      if (num_fds != (tty ? 1 : 3) || num_direct_fds != num_fds) {
+        errno = EPROTO;
+        error("ERROR receiving fds from sockfd");
+      }
+      if (tty) {
+        direct_fds[STDOUT_FILENO] = direct_fds[STDIN_FILENO];
+      }
 
-  int infd_n = -1, sockfd_n = -1;
+      // A command that stops reading its input only makes writes fail.
+      signal(SIGPIPE, SIG_IGN);
+    }
 
-  while (true) {
-    fd_set fd_in;
-    FD_ZERO(&fd_in);
+    jobs[0].busy = true;
+    running = 1;
+  }
 
-    if (infd_n != 0) {
-      FD_SET(infd, &fd_in);
-    }
-    if (sockfd_n != 0) {
-      FD_SET(sockfd, &fd_in);
+  if (!control) {
+    result = make_non_blocking(infd);
+    if (result < 0) {
+      error("ERROR making infd non blocking");
     }
+  }
 
-    int maxfd = sockfd > infd ? sockfd : infd;
-
-    int result = select(maxfd + 1, &fd_in, NULL, NULL, NULL);
+  if (reactor_init(&reactor, REACTOR_DEFAULT) < 0) {
+    error("ERROR creating reactor");
+  }
 
+  if (!control) {
+    result = reactor_add(&reactor, &input_watch, infd, REACTOR_READ,
+                         direct ? on_direct_input :
+                         batch ? on_batch_input : on_input, NULL);
     if (result < 0) {
-      if (errno == EINTR) {
-        continue;
-      }
-      error("ERROR waiting on select");
+      error("ERROR watching infd");
     }
+  }
 
-    if (result == 0) {
+  for (int i = 0; direct && i < 3; i++) {
+    if (direct_fds[i] < 0 ||
+        (i == STDIN_FILENO && direct_fds[i] == direct_fds[STDOUT_FILENO])) {
       continue;
     }
 
-    if (FD_ISSET(infd, &fd_in)) {
-      char buffer[4096];
+    if (i == STDIN_FILENO) {
+      result = reactor_add(&reactor, &direct_watches[i], direct_fds[i], 0,
+                           on_direct_write, NULL);
+    } else {
+      result = reactor_add(&reactor, &direct_watches[i], direct_fds[i],
+                           REACTOR_READ, on_direct_output, NULL);
+    }
+    if (result < 0) {
+      error("ERROR watching command fds");
+    }
+  }
 
-      infd_n = read_all(infd, buffer, 4096);
-      if (infd_n < 0) {
-        error("ERROR reading from infd");
-      }
+  result = reactor_add(&reactor, &socket_watch, sockfd, REACTOR_READ,
+                       on_socket, NULL);
+  if (result < 0) {
+    error("ERROR watching sockfd");
+  }
 
-      if (infd_n > 0) {
-        n = send_io_msg(sockfd, STDIN_FILENO, buffer, infd_n);
-        if (n < 0) {
-          error("ERROR writing to sockfd");
-        }
-      }
+  struct reactor_watch sigwinch_watch;
+  if (tty) {
+    if (pipe(sigwinch_pipe) < 0 ||
+        make_non_blocking(sigwinch_pipe[0]) < 0 ||
+        make_non_blocking(sigwinch_pipe[1]) < 0) {
+      error("ERROR creating sigwinch pipe");
     }
 
-    if (FD_ISSET(sockfd, &fd_in)) {
-      sockfd_n = recv_msg_async(sockfd, &msg_state);
-
-      if (sockfd_n < 0) {
-        error("ERROR reading from sockfd");
-      }
+    result = reactor_add(&reactor, &sigwinch_watch, sigwinch_pipe[0],
+                         REACTOR_READ, on_sigwinch, NULL);
+    if (result < 0) {
+      error("ERROR watching sigwinch pipe");
+    }
 
-      if (msg_state.finished) {
-        switch (msg_state.message->type) {
-          case WINSIZE_MSG: {
-            int result = ioctl(
-                ttyfd,
-                TIOCSWINSZ,
-                &msg_state.message->msg.winsize.winsize);
+    signal(SIGWINCH, sigwinch);
+  }
 
-            if (result < 0) {
-              error("ERROR setting winsize parameters");
-            }
+  // Frames that came along with the answer to the attach (or the fds)
+  // are already buffered, and the socket may not get readable again for
+  // a while.
+  if (attach_id != 0 || direct) {
+    on_socket(&socket_watch, REACTOR_READ);
+  }
 
-            break;
-          }
-          case IO_MSG: {
-            int destfd = -1;
-
-            switch (msg_state.message->msg.io.destfd) {
-              case STDIN_FILENO:
-                destfd = infd;
-                break;
-              case STDOUT_FILENO:
-                destfd = outfd;
-                break;
-              case STDERR_FILENO:
-                destfd = errfd;
-                break;
-            }
-
-            sockfd_n = write_all(
-                destfd,
-                msg_state.message->msg.io.data,
-                msg_state.message->msg.io.data_size);
-
-            if (sockfd_n < 0) {
-              error("ERROR writing to stdout");
-            }
-            break;
-          }
-        }
+  while (!done) {
+    result = reactor_run_once(&reactor, flush_timeout(&flush, flush_now_ms()));
 
-        free(msg_state.message);
-        memset(&msg_state, 0, sizeof(async_msg_state));
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
       }
+      error("ERROR waiting on reactor");
     }
 
-    if ((infd_n == 0) || (sockfd_n == 0)) {
-      break;
+    if (resumable && resume.broken && !done) {
+      reconnect();
     }
+
+    flush_expire(sockfd, &flush, flush_now_ms());
+  }
+
+  reactor_destroy(&reactor);
+
+  if (sync_screen) {
+    const char restore[] = "\033[0m\033[?25h";
+    if (write_all(outfd, restore, sizeof(restore) - 1) < 0) {
+      error("ERROR writing to stdout");
+    }
+    term_screen_destroy(&screen);
+    term_screen_destroy(&shown);
+    term_screen_destroy(&display);
   }
 
   if (tty) {
@@ -289,7 +1411,16 @@ int main(int argc, char *argv[])
     close(ttyfd);
   }
 
+  if (detached) {
+    fprintf(stderr, "[detached from session %u]\n", attach_id);
+  }
+
+  msg_recv_buffer_destroy(&rx);
+  pool_destroy(&rx_pool);
+  free(jobs);
+  free(lines);
+  resume_log_destroy(&resume);
   close(sockfd);
 
-  return 0;
+  return exit_status;
 }
@@ -4,13 +4,22 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
 static inline void error(const char *msg)
@@ -43,32 +52,33 @@ static inline int make_non_blocking(int fd)
 }
 
 
-static inline int wait_all(int pid, int *status)
+static inline int make_cloexec(int fd)
 {
-  while (true) {
-    int status;
-    int result = waitpid(-1, &status, 0);
+  int flags = fcntl(fd, F_GETFD, 0);
 
-    if (result < 0) {
-      if (errno == EINTR) {
-        continue;
-      }
-      return result;
-    }
+  if(flags < 0) {
+   return flags;
+  }
 
-    if (WIFSTOPPED(status)) {
-      continue;
-    }
+  flags |= FD_CLOEXEC;
+
+  return fcntl(fd, F_SETFD, flags);
+}
 
-    if (pid == result) {
-      break;
-    }
-  }
 
-  return 0;
+// Frames are batched before they are written, so Nagle's algorithm
+// would only hold back the small frames that end a burst (an EXIT_MSG
+// after the last output) until the peer's delayed ACK.
+static inline int make_nodelay(int fd)
+{
+  int yes = 1;
+  return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
 }
 
 
+// Blocking write of the whole buffer. A non-blocking fd that fills up
+// is waited on with poll() instead of being spun on; code that must not
+// stall uses an out_queue instead.
 static inline int write_all(int fd, const char *buf, size_t count)
 {
   size_t offset = 0;
@@ -81,7 +91,9 @@ static inline int write_all(int fd, const char *buf, size_t count)
         continue;
       }
       if (errno == EWOULDBLOCK) {
-        continue; // We don't ever want the write side non-blocking!
+        struct pollfd pollfd = { fd, POLLOUT, 0 };
+        poll(&pollfd, 1, -1);
+        continue;
       }
       if (errno == EIO && isatty(fd)) {
         return offset;
@@ -101,6 +113,180 @@ static inline int write_all(int fd, const char *buf, size_t count)
 }
 
 
+// Writes out a whole iovec with as few writev() calls as possible,
+// picking up after partial writes. A non-blocking fd that fills up is
+// waited on with poll() instead of being spun on. If fds are given
+// (fd must then be a unix socket) they are passed along with the first
+// bytes as SCM_RIGHTS.
+static inline int writev_all_fds(
+    int fd,
+    struct iovec *iov,
+    int iovcnt,
+    int *fds,
+    int num_fds)
+{
+  size_t total = 0;
+
+  while (iovcnt > 0) {
+    int count = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+    ssize_t length;
+
+    if (num_fds > 0) {
+      char control[CMSG_SPACE(num_fds * sizeof(int))];
+      memset(control, 0, sizeof(control));
+
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = count;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+      memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+
+      length = sendmsg(fd, &msg, 0);
+      if (length >= 0) {
+        num_fds = 0;
+      }
+    } else {
+      length = writev(fd, iov, count);
+    }
+
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EWOULDBLOCK) {
+        struct pollfd pollfd = { fd, POLLOUT, 0 };
+        poll(&pollfd, 1, -1);
+        continue;
+      }
+      if (errno == EIO && isatty(fd)) {
+        return total;
+      }
+      return length;
+    }
+
+    total += length;
+
+    while (iovcnt > 0 && (size_t) length >= iov->iov_len) {
+      length -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+
+    if (iovcnt > 0) {
+      iov->iov_base = (char*) iov->iov_base + length;
+      iov->iov_len -= length;
+    }
+  }
+
+  return total;
+}
+
+
+static inline int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+  return writev_all_fds(fd, iov, iovcnt, NULL, 0);
+}
+
+
+// write() for a unix socket that passes fds along with the bytes as
+// SCM_RIGHTS. Unlike writev_all_fds() it makes a single attempt, so a
+// non-blocking fd that is full fails with EWOULDBLOCK; the fds go with
+// whatever part of the bytes is written.
+static inline ssize_t write_fds(
+    int fd,
+    const char *buf,
+    size_t count,
+    int *fds,
+    int num_fds)
+{
+  struct iovec iov;
+  iov.iov_base = (void*) buf;
+  iov.iov_len = count;
+
+  char control[CMSG_SPACE(num_fds * sizeof(int))];
+  memset(control, 0, sizeof(control));
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+
+  ssize_t length;
+  do {
+    length = sendmsg(fd, &msg, 0);
+  } while (length < 0 && errno == EINTR);
+
+  return length;
+}
+
+
+// read() for a unix socket that also takes in fds passed as SCM_RIGHTS,
+// appending them to fds (up to max_fds; any beyond that are closed).
+static inline ssize_t read_fds(
+    int fd,
+    char *buf,
+    size_t count,
+    int *fds,
+    int *num_fds,
+    int max_fds)
+{
+  char control[CMSG_SPACE(8 * sizeof(int))];
+
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = count;
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t length = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  if (length < 0) {
+    return length;
+  }
+
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+       cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+
+    int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (int i = 0; i < n; i++) {
+      int passed;
+      memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+
+      if (*num_fds < max_fds) {
+        fds[(*num_fds)++] = passed;
+      } else {
+        close(passed);
+      }
+    }
+  }
+
+  return length;
+}
+
+
 static inline int read_all(int fd, char *buf, size_t count)
 {
   size_t offset = 0;
@@ -112,9 +298,12 @@ static inline int read_all(int fd, char *buf, size_t count)
       if (errno == EINTR) {
         continue;
       }
-      if (errno == EWOULDBLOCK) {
+      if (errno == EWOULDBLOCK && offset > 0) {
         return offset;
       }
+      if (errno == EWOULDBLOCK) {
+        return length; // Callers tell this apart from EOF by errno.
+      }
       if (errno == EIO && isatty(fd)) {
         return offset;
       }
@@ -158,4 +347,63 @@ static inline int read_then_write(int infd, int outfd, int bufsize)
   return n;
 }
 
+
+// Connects to the unix socket at 'path': a control master's, or the
+// server's for a client on the same host.
+static inline int unix_connect(const char *path)
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return fd;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    close(fd);
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+
+// Makes way for a unix socket to be bound at 'path' by removing a stale
+// one, which nothing listens on anymore. Fails with EADDRINUSE if
+// something still does, and with EEXIST if 'path' is not a socket.
+static inline int unix_remove_stale(const char *path)
+{
+  struct stat st;
+  if (lstat(path, &st) < 0) {
+    return errno == ENOENT ? 0 : -1;
+  }
+
+  if (!S_ISSOCK(st.st_mode)) {
+    errno = EEXIST;
+    return -1;
+  }
+
+  int fd = unix_connect(path);
+  if (fd >= 0) {
+    close(fd);
+    errno = EADDRINUSE;
+    return -1;
+  }
+
+  if (errno != ECONNREFUSED) {
+    return -1;
+  }
+
+  return unlink(path);
+}
+
 #endif // COMMON_H
@@ -0,0 +1,199 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stdint.h>
+
+#include "common.h"
+#include "pool.h"
+
+// Frames sent to several connections at once. A run of frames is put
+// into a refcounted shared_frame once, taken from a buffer pool, and
+// each connection's fanout_queue only holds a reference to it, so it
+// is neither copied per connection nor kept any longer than the
+// slowest of them needs it.
+//
+// A queue with more than FANOUT_MAX_LAG bytes or FANOUT_LAG_FRAMES
+// frames in it is lagging. The owner then stops adding output to it and
+// catches it up some other way once it has drained, rather than have
+// one slow connection hold on to ever more output or the others wait
+// for it. A queue at most half that full is ready for more, and output
+// should only be produced while some queue is; that way the fastest
+// connection never lags.
+
+#define FANOUT_MAX_FRAMES 2048
+#define FANOUT_LAG_FRAMES (FANOUT_MAX_FRAMES / 2)
+#define FANOUT_MAX_LAG (1024 * 1024)
+
+#define FANOUT_MAX_IOV 64
+
+struct shared_frame
+{
+  int refs;
+  size_t size;
+  char data[];
+};
+
+struct fanout_queue
+{
+  struct buf_pool *pool;
+  struct shared_frame *frames[FANOUT_MAX_FRAMES];
+  int start;
+  int count;
+
+  // How much of the first frame has been written, and how much of all
+  // of them is left.
+  size_t offset;
+  size_t bytes;
+};
+
+
+static inline size_t shared_frame_capacity(struct buf_pool *pool)
+{
+  return pool->buf_size - sizeof(struct shared_frame);
+}
+
+
+// Returns an empty frame with one reference, the caller's.
+static inline struct shared_frame *shared_frame_get(struct buf_pool *pool)
+{
+  struct shared_frame *frame = (struct shared_frame*) pool_get(pool);
+  if (frame == NULL) {
+    return NULL;
+  }
+
+  frame->refs = 1;
+  frame->size = 0;
+  return frame;
+}
+
+
+static inline void shared_frame_put(
+    struct buf_pool *pool,
+    struct shared_frame *frame)
+{
+  if (--frame->refs == 0) {
+    pool_put(pool, (char*) frame);
+  }
+}
+
+
+static inline void fanout_queue_init(
+    struct fanout_queue *q,
+    struct buf_pool *pool)
+{
+  q->pool = pool;
+  q->start = 0;
+  q->count = 0;
+  q->offset = 0;
+  q->bytes = 0;
+}
+
+
+static inline bool fanout_queue_empty(struct fanout_queue *q)
+{
+  return q->count == 0;
+}
+
+
+static inline bool fanout_queue_lagging(struct fanout_queue *q)
+{
+  return q->bytes > FANOUT_MAX_LAG || q->count > FANOUT_LAG_FRAMES;
+}
+
+
+static inline bool fanout_queue_ready(struct fanout_queue *q)
+{
+  return q->bytes <= FANOUT_MAX_LAG / 2 && q->count <= FANOUT_LAG_FRAMES / 2;
+}
+
+
+// Queues a reference to 'frame'. Returns -1 with errno set to ENOBUFS
+// if the queue is full.
+static inline int fanout_queue_push(
+    struct fanout_queue *q,
+    struct shared_frame *frame)
+{
+  if (q->count == FANOUT_MAX_FRAMES) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  frame->refs++;
+  q->frames[(q->start + q->count) % FANOUT_MAX_FRAMES] = frame;
+  q->count++;
+  q->bytes += frame->size;
+  return 0;
+}
+
+
+static inline void fanout_queue_pop(struct fanout_queue *q)
+{
+  shared_frame_put(q->pool, q->frames[q->start]);
+  q->start = (q->start + 1) % FANOUT_MAX_FRAMES;
+  q->count--;
+  q->offset = 0;
+}
+
+
+static inline void fanout_queue_clear(struct fanout_queue *q)
+{
+  while (q->count > 0) {
+    fanout_queue_pop(q);
+  }
+
+  q->bytes = 0;
+}
+
+
+// Writes as much of the queue as the fd takes. Returns the number of
+// bytes written or -1 with errno set; EWOULDBLOCK is not an error.
+static inline ssize_t fanout_queue_flush(struct fanout_queue *q, int fd)
+{
+  ssize_t total = 0;
+
+  while (q->count > 0) {
+    struct iovec iov[FANOUT_MAX_IOV];
+    int iovcnt = 0;
+
+    for (int i = 0; i < q->count && iovcnt < FANOUT_MAX_IOV; i++) {
+      struct shared_frame *frame =
+        q->frames[(q->start + i) % FANOUT_MAX_FRAMES];
+      size_t skip = i == 0 ? q->offset : 0;
+
+      iov[iovcnt].iov_base = frame->data + skip;
+      iov[iovcnt].iov_len = frame->size - skip;
+      iovcnt++;
+    }
+
+    ssize_t length = writev(fd, iov, iovcnt);
+
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EWOULDBLOCK) {
+        break;
+      }
+      return -1;
+    }
+
+    total += length;
+    q->bytes -= length;
+
+    while (length > 0) {
+      size_t left = q->frames[q->start]->size - q->offset;
+
+      if ((size_t) length < left) {
+        q->offset += length;
+        break;
+      }
+
+      length -= left;
+      fanout_queue_pop(q);
+    }
+  }
+
+  return total;
+}
+
+#endif // FANOUT_H
@@ -0,0 +1,164 @@
+#ifndef FLUSH_H
+#define FLUSH_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "common.h"
+
+// When frames written to a connection actually leave. Everything
+// interactive (tty output, exit status, credit, window sizes) is
+// pushed at once: connections run with TCP_NODELAY. Bulk output may
+// be corked with TCP_CORK for up to 'budget_ms', so that it goes out
+// in full segments instead of one short segment per read. Corked data
+// is pushed once the budget has run out, or earlier by the next
+// interactive frame.
+//
+// TCP_NOTSENT_LOWAT keeps the kernel from taking more than
+// 'notsent_lowat' bytes that it has not sent yet. The rest stays
+// queued in user space, where it cannot delay whatever is written
+// after it by more than that.
+
+#define FLUSH_DEFAULT_BUDGET_MS 5
+#define FLUSH_DEFAULT_NOTSENT_LOWAT (128 * 1024)
+
+struct flush_policy
+{
+  int budget_ms;
+  int notsent_lowat;
+};
+
+struct flush_state
+{
+  bool corked;
+  int64_t deadline;
+};
+
+
+static inline int64_t flush_now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static inline void flush_policy_init(struct flush_policy *p)
+{
+  p->budget_ms = FLUSH_DEFAULT_BUDGET_MS;
+  p->notsent_lowat = FLUSH_DEFAULT_NOTSENT_LOWAT;
+}
+
+
+// Parses the --flush-budget <ms> and --notsent-lowat <bytes> options
+// at argv[*i], advancing *i past them. Returns 1 if one was found, 0
+// if argv[*i] is something else and -1 if its value is missing or bad.
+static inline int flush_policy_option(
+    struct flush_policy *p,
+    int argc,
+    char **argv,
+    int *i)
+{
+  int *value;
+
+  if (strcmp(argv[*i], "--flush-budget") == 0) {
+    value = &p->budget_ms;
+  } else if (strcmp(argv[*i], "--notsent-lowat") == 0) {
+    value = &p->notsent_lowat;
+  } else {
+    return 0;
+  }
+
+  if (*i + 1 >= argc || atoi(argv[*i + 1]) < 0) {
+    return -1;
+  }
+
+  *value = atoi(argv[*i + 1]);
+  *i += 2;
+  return 1;
+}
+
+
+static inline int flush_setup(int fd, const struct flush_policy *p)
+{
+  if (make_nodelay(fd) < 0) {
+    return -1;
+  }
+
+  if (p->notsent_lowat > 0) {
+    return setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                      &p->notsent_lowat, sizeof(p->notsent_lowat));
+  }
+
+  return 0;
+}
+
+
+static inline void flush_state_init(struct flush_state *s)
+{
+  s->corked = false;
+  s->deadline = 0;
+}
+
+
+// Called before bulk output is written. Returns true if this corked
+// the connection, in which case the caller has to see to it that
+// flush_expire() runs once the deadline has passed.
+static inline bool flush_bulk(
+    int fd,
+    struct flush_state *s,
+    const struct flush_policy *p)
+{
+  if (s->corked || p->budget_ms == 0) {
+    return false;
+  }
+
+  int yes = 1;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &yes, sizeof(yes)) < 0) {
+    return false;
+  }
+
+  s->corked = true;
+  s->deadline = flush_now_ms() + p->budget_ms;
+  return true;
+}
+
+
+// Called after an interactive frame has been written; sends whatever
+// is corked right away.
+static inline void flush_push(int fd, struct flush_state *s)
+{
+  if (!s->corked) {
+    return;
+  }
+
+  int no = 0;
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, &no, sizeof(no));
+  s->corked = false;
+}
+
+
+// Milliseconds until the corked data must go, for the event loop's
+// timeout: -1 if nothing is corked.
+static inline int flush_timeout(struct flush_state *s, int64_t now)
+{
+  if (!s->corked) {
+    return -1;
+  }
+
+  return s->deadline > now ? (int) (s->deadline - now) : 0;
+}
+
+
+// Pushes corked data whose budget has run out. Returns whether the
+// connection is still corked.
+static inline bool flush_expire(int fd, struct flush_state *s, int64_t now)
+{
+  if (s->corked && s->deadline <= now) {
+    flush_push(fd, s);
+  }
+
+  return s->corked;
+}
+
+#endif // FLUSH_H
@@ -0,0 +1,281 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+// A small LZ77 codec producing the LZ4 block format: a run of
+// sequences, each a token (literal length in the high nibble, match
+// length - 4 in the low one, 15 meaning more length bytes follow), the
+// literals and a 2 byte little endian match offset. The last sequence
+// holds literals only. Inputs are at most 64KB, so match candidates
+// are kept as 16 bit offsets in a small hash table.
+//
+// Compression is greedy with one candidate per hash slot and skips
+// ahead faster the longer it goes without a match, so incompressible
+// data costs little more than a pass over it.
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+#define LZ_MAX_INPUT 65536
+
+
+static inline uint32_t lz_read32(const char *p)
+{
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+
+static inline uint32_t lz_hash(uint32_t value)
+{
+  return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+
+static inline char *lz_put_length(char *op, size_t length)
+{
+  while (length >= 255) {
+    *op++ = (char) 255;
+    length -= 255;
+  }
+  *op++ = (char) length;
+  return op;
+}
+
+
+static inline char *lz_put_sequence(
+    char *op,
+    char *oend,
+    const char *literals,
+    size_t num_literals,
+    size_t offset,
+    size_t match_length)
+{
+  size_t needed = 1 + num_literals / 255 + 1 + num_literals;
+  if (offset > 0) {
+    needed += 2 + match_length / 255 + 1;
+  }
+  if (needed > (size_t) (oend - op)) {
+    return NULL;
+  }
+
+  char *token = op++;
+  *token = (char) ((num_literals >= 15 ? 15 : num_literals) << 4);
+  if (num_literals >= 15) {
+    op = lz_put_length(op, num_literals - 15);
+  }
+
+  memcpy(op, literals, num_literals);
+  op += num_literals;
+
+  if (offset > 0) {
+    *op++ = (char) (offset & 0xff);
+    *op++ = (char) (offset >> 8);
+
+    *token |= (char) (match_length >= 15 ? 15 : match_length);
+    if (match_length >= 15) {
+      op = lz_put_length(op, match_length - 15);
+    }
+  }
+
+  return op;
+}
+
+
+// Compresses 'size' bytes (at most LZ_MAX_INPUT) into at most
+// 'capacity' bytes. Returns the compressed size, or 0 if it would not
+// fit, which also makes a small 'capacity' a cheap way to give up on
+// data that does not compress well enough to be worth it.
+static inline size_t lz_compress(
+    const char *src,
+    size_t size,
+    char *dst,
+    size_t capacity)
+{
+  uint16_t table[1 << LZ_HASH_BITS];
+  memset(table, 0, sizeof(table));
+
+  const char *ip = src;
+  const char *anchor = src;
+  const char *end = src + size;
+  char *op = dst;
+  char *oend = dst + capacity;
+
+  if (size > LZ_MATCH_LIMIT) {
+    const char *match_limit = end - LZ_MATCH_LIMIT;
+    const char *extend_limit = end - LZ_LAST_LITERALS;
+
+    while (ip < match_limit) {
+      uint32_t sequence = lz_read32(ip);
+      uint32_t h = lz_hash(sequence);
+      const char *ref = src + table[h];
+      table[h] = (uint16_t) (ip - src);
+
+      if (ref >= ip || lz_read32(ref) != sequence) {
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+
+      const char *match_end = ip + LZ_MIN_MATCH;
+      const char *ref_end = ref + LZ_MIN_MATCH;
+      while (match_end < extend_limit && *match_end == *ref_end) {
+        match_end++;
+        ref_end++;
+      }
+
+      op = lz_put_sequence(op, oend, anchor, ip - anchor, ip - ref,
+                           match_end - ip - LZ_MIN_MATCH);
+      if (op == NULL) {
+        return 0;
+      }
+
+      ip = match_end;
+      anchor = ip;
+    }
+  }
+
+  op = lz_put_sequence(op, oend, anchor, end - anchor, 0, 0);
+  if (op == NULL) {
+    return 0;
+  }
+
+  return op - dst;
+}
+
+
+static inline int lz_get_length(
+    const unsigned char **ip,
+    const unsigned char *iend,
+    size_t *length)
+{
+  unsigned char byte;
+  do {
+    if (*ip >= iend) {
+      return -1;
+    }
+    byte = *(*ip)++;
+    *length += byte;
+  } while (byte == 255);
+
+  return 0;
+}
+
+
+// Decompresses into at most 'capacity' bytes. Returns the decompressed
+// size, or -1 if the input is malformed or does not fit.
+static inline ssize_t lz_decompress(
+    const char *src,
+    size_t size,
+    char *dst,
+    size_t capacity)
+{
+  const unsigned char *ip = (const unsigned char*) src;
+  const unsigned char *iend = ip + size;
+  char *op = dst;
+  char *oend = dst + capacity;
+
+  while (ip < iend) {
+    unsigned token = *ip++;
+
+    size_t num_literals = token >> 4;
+    if (num_literals == 15 && lz_get_length(&ip, iend, &num_literals) < 0) {
+      return -1;
+    }
+
+    if (num_literals > (size_t) (iend - ip) ||
+        num_literals > (size_t) (oend - op)) {
+      return -1;
+    }
+
+    memcpy(op, ip, num_literals);
+    op += num_literals;
+    ip += num_literals;
+
+    if (ip == iend) {
+      break;
+    }
+
+    if (iend - ip < 2) {
+      return -1;
+    }
+
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+
+    if (offset == 0 || offset > (size_t) (op - dst)) {
+      return -1;
+    }
+
+    size_t match_length = token & 15;
+    if (match_length == 15 && lz_get_length(&ip, iend, &match_length) < 0) {
+      return -1;
+    }
+    match_length += LZ_MIN_MATCH;
+
+    if (match_length > (size_t) (oend - op)) {
+      return -1;
+    }
+
+    const char *ref = op - offset;
+    if (offset >= match_length) {
+      memcpy(op, ref, match_length);
+    } else {
+      for (size_t i = 0; i < match_length; i++) {
+        op[i] = ref[i];
+      }
+    }
+    op += match_length;
+  }
+
+  return op - dst;
+}
+
+
+// Stops compressing streams that turn out not to compress: after a
+// frame that was not worth compressing, the next 'backoff' frames are
+// sent as they are, the backoff doubling (up to LZ_MAX_BACKOFF) for as
+// long as the stream stays incompressible.
+#define LZ_MAX_BACKOFF 64
+
+struct lz_adapt
+{
+  int skip;
+  int backoff;
+};
+
+
+static inline bool lz_adapt_try(struct lz_adapt *a)
+{
+  if (a->skip > 0) {
+    a->skip--;
+    return false;
+  }
+  return true;
+}
+
+
+static inline void lz_adapt_result(struct lz_adapt *a, bool compressed)
+{
+  if (compressed) {
+    a->backoff = 0;
+    return;
+  }
+
+  a->backoff = a->backoff == 0 ? 1 : a->backoff * 2;
+  if (a->backoff > LZ_MAX_BACKOFF) {
+    a->backoff = LZ_MAX_BACKOFF;
+  }
+  a->skip = a->backoff;
+}
+
+#endif // LZ_H
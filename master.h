@@ -0,0 +1,664 @@
+#ifndef MASTER_H
+#define MASTER_H
+
+#include <stdint.h>
+
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "common.h"
+#include "msgs.h"
+#include "outq.h"
+#include "reactor.h"
+
+// Control master. `client --master <path> <hostname> <port>` keeps one
+// connection to the server open and listens on a unix socket at <path>.
+// `client --control <path> ...` connects there instead of to the server
+// and hands over its stdio fds along with the command (SCM_RIGHTS), so
+// starting a command costs no DNS lookup, TCP handshake or accept on
+// the server. Every such command runs on a channel of the master's
+// connection: the master moves data between the passed fds and the
+// server itself, and reports the exit status to the control client
+// with an EXIT_MSG once all output has been written.
+//
+// Only processes of the user running the master may use it: the socket
+// is created with mode 0600 and peers are checked with SO_PEERCRED.
+
+struct master;
+
+struct master_channel
+{
+  int id;
+  struct master *master;
+  bool busy;
+  bool started;
+  bool closing;
+  bool exited;
+  bool dead;
+  int status;
+  int ctlfd;
+  int fds[3];
+  int num_fds;
+  int saved_flags[3];
+  int stdin_credit;
+  int written[3];
+  struct reactor_watch ctl_watch;
+  struct reactor_watch in_watch;
+  struct reactor_watch out_watches[2];
+  struct out_queue out_queues[2];
+  struct msg_recv_buffer ctl_rx;
+};
+
+struct master
+{
+  int sockfd;
+  int listenfd;
+  struct reactor reactor;
+  struct reactor_watch sock_watch;
+  struct reactor_watch listen_watch;
+  struct buf_pool buffers;
+  struct msg_recv_buffer rx;
+  struct master_channel **channels;
+  int num_channels;
+  int zio_frame[(IO_MSG_HEADER_SIZE + MSG_MAX_IO_SIZE) / sizeof(int)];
+};
+
+
+static inline void on_master_control(struct reactor_watch *w, int events);
+static inline void on_master_input(struct reactor_watch *w, int events);
+static inline void on_master_output(struct reactor_watch *w, int events);
+
+
+static inline struct master_channel *master_channel_alloc(struct master *m)
+{
+  int id = 0;
+  while (id < m->num_channels &&
+         (m->channels[id]->busy || m->channels[id]->dead)) {
+    id++;
+  }
+
+  if (id == m->num_channels) {
+    int capacity = m->num_channels == 0 ? 16 : m->num_channels * 2;
+
+    struct master_channel **channels = (struct master_channel**) realloc(
+        m->channels, capacity * sizeof(struct master_channel*));
+    if (channels == NULL) {
+      return NULL;
+    }
+    m->channels = channels;
+
+    for (int i = m->num_channels; i < capacity; i++) {
+      m->channels[i] = (struct master_channel*) calloc(
+          1, sizeof(struct master_channel));
+      if (m->channels[i] == NULL) {
+        return NULL;
+      }
+      m->channels[i]->id = i;
+      m->channels[i]->master = m;
+      m->num_channels = i + 1;
+    }
+  }
+
+  struct master_channel *c = m->channels[id];
+
+  c->busy = true;
+  c->started = false;
+  c->closing = false;
+  c->exited = false;
+  c->status = 0;
+  c->ctlfd = -1;
+  c->num_fds = 0;
+  c->stdin_credit = MSG_CREDIT_WINDOW;
+  memset(c->written, 0, sizeof(c->written));
+  c->ctl_watch.fd = -1;
+  c->in_watch.fd = -1;
+  c->out_watches[0].fd = -1;
+  c->out_watches[1].fd = -1;
+  out_queue_init(&c->out_queues[0], &m->buffers);
+  out_queue_init(&c->out_queues[1], &m->buffers);
+  msg_recv_buffer_init(&c->ctl_rx, &m->buffers);
+
+  return c;
+}
+
+
+static inline void master_close_control(struct master_channel *c)
+{
+  if (c->ctlfd < 0) {
+    return;
+  }
+
+  reactor_del(&c->master->reactor, &c->ctl_watch);
+  msg_recv_buffer_destroy(&c->ctl_rx);
+  close(c->ctlfd);
+  c->ctlfd = -1;
+}
+
+
+// Gives the passed fds back in the state they came in and frees the
+// channel once the current reactor batch is over.
+static inline void master_channel_release(struct master_channel *c)
+{
+  struct master *m = c->master;
+
+  master_close_control(c);
+
+  reactor_del(&m->reactor, &c->in_watch);
+  reactor_del(&m->reactor, &c->out_watches[0]);
+  reactor_del(&m->reactor, &c->out_watches[1]);
+
+  out_queue_clear(&c->out_queues[0]);
+  out_queue_clear(&c->out_queues[1]);
+
+  for (int i = 0; i < c->num_fds; i++) {
+    if (c->started) {
+      fcntl(c->fds[i], F_SETFL, c->saved_flags[i]);
+    }
+    close(c->fds[i]);
+  }
+  c->num_fds = 0;
+
+  c->busy = false;
+  c->dead = true;
+}
+
+
+// Tells the server the control client has gone away; the channel is
+// released once the server confirms with an EXIT_MSG.
+static inline void master_channel_abandon(struct master_channel *c)
+{
+  if (c->closing) {
+    return;
+  }
+
+  c->closing = true;
+
+  if (send_close_msg(c->master->sockfd, c->id) < 0) {
+    error("ERROR writing to sockfd");
+  }
+}
+
+
+static inline void master_channel_check(struct master_channel *c)
+{
+  if (!c->busy || !c->exited ||
+      !out_queue_empty(&c->out_queues[0]) ||
+      !out_queue_empty(&c->out_queues[1])) {
+    return;
+  }
+
+  if (c->ctlfd >= 0) {
+    struct msg_wrapper message;
+    message.type = EXIT_MSG;
+    message.channel = 0;
+    message.msg.exit.status = c->status;
+
+    // Nothing to be done if the control client is gone already.
+    send_fixed_msg(c->ctlfd, &message, sizeof(struct exit_msg));
+  }
+
+  master_channel_release(c);
+}
+
+
+static inline void master_update_watches(struct master_channel *c)
+{
+  struct master *m = c->master;
+  int result = 0;
+
+  if (c->in_watch.fd >= 0) {
+    int events = c->stdin_credit > 0 ? REACTOR_READ : 0;
+    result |= reactor_update(&m->reactor, &c->in_watch, events);
+  }
+
+  for (int i = 0; i < 2; i++) {
+    if (c->out_watches[i].fd >= 0) {
+      int events = out_queue_empty(&c->out_queues[i]) ? 0 : REACTOR_WRITE;
+      result |= reactor_update(&m->reactor, &c->out_watches[i], events);
+    }
+  }
+
+  if (result < 0) {
+    error("ERROR updating watches");
+  }
+}
+
+
+// Credit for output is handed back once it has been written to the
+// fd the control client passed, just like the client does for its own.
+static inline void master_output_written(
+    struct master_channel *c,
+    int stream,
+    ssize_t n)
+{
+  if (n < 0) {
+    out_queue_clear(&c->out_queues[stream - 1]);
+    master_channel_abandon(c);
+    return;
+  }
+
+  c->written[stream] += n;
+
+  if (c->written[stream] >= MSG_CREDIT_THRESHOLD) {
+    int result = send_credit_msg(
+        c->master->sockfd,
+        c->id,
+        stream,
+        c->written[stream]);
+
+    if (result < 0) {
+      error("ERROR writing to sockfd");
+    }
+    c->written[stream] = 0;
+  }
+}
+
+
+static inline int master_channel_start(
+    struct master_channel *c,
+    struct msg_wrapper *message)
+{
+  struct master *m = c->master;
+
+  if (c->num_fds != 3) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  for (int i = 0; i < 3; i++) {
+    c->saved_flags[i] = fcntl(c->fds[i], F_GETFL, 0);
+    if (c->saved_flags[i] < 0) {
+      return -1;
+    }
+  }
+
+  // The frame goes out as it came in, apart from the channel id.
+  message->channel = c->id;
+
+  struct iovec iov;
+  iov.iov_base = message;
+  iov.iov_len = msg_frame_size((char*) message, SIZE_MAX);
+
+  if (writev_all(m->sockfd, &iov, 1) < 0) {
+    error("ERROR writing to sockfd");
+  }
+
+  c->started = true;
+
+  for (int i = 0; i < 3; i++) {
+    if (make_non_blocking(c->fds[i]) < 0) {
+      return -1;
+    }
+  }
+
+  if (reactor_add(&m->reactor, &c->in_watch, c->fds[0], REACTOR_READ,
+                  on_master_input, c) < 0) {
+    return -1;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    if (reactor_add(&m->reactor, &c->out_watches[i], c->fds[i + 1], 0,
+                    on_master_output, c) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+static inline int master_read_control(void *ctx, char *buf, size_t count)
+{
+  struct master_channel *c = (struct master_channel*) ctx;
+
+  while (true) {
+    ssize_t n = read_fds(c->ctlfd, buf, count, c->fds, &c->num_fds, 3);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    return n;
+  }
+}
+
+
+static inline void on_master_control(struct reactor_watch *w, int events)
+{
+  struct master_channel *c = (struct master_channel*) w->data;
+  struct master *m = c->master;
+
+  while (c->ctlfd >= 0) {
+    struct msg_wrapper *message;
+    int n = msg_recv_buffer_next(&c->ctl_rx, &message);
+
+    if (n > 0) {
+      if (message->type == CMD_MSG && !c->started) {
+        if (master_channel_start(c, message) < 0) {
+          perror("ERROR starting command");
+          master_close_control(c);
+
+          if (c->started) {
+            master_channel_abandon(c);
+          } else {
+            master_channel_release(c);
+          }
+        }
+      } else if (message->type == WINSIZE_MSG && c->started) {
+        if (send_winsize_msg(m->sockfd, c->id,
+                             &message->msg.winsize.winsize) < 0) {
+          error("ERROR writing to sockfd");
+        }
+      }
+      continue;
+    }
+
+    if (n == 0) {
+      n = msg_recv_buffer_fill(&c->ctl_rx, master_read_control, c);
+
+      if (n < 0 && errno == EWOULDBLOCK) {
+        break;
+      }
+    }
+
+    // The control client went away (or spoke nonsense).
+    if (n <= 0) {
+      master_close_control(c);
+
+      if (c->started) {
+        master_channel_abandon(c);
+      } else {
+        master_channel_release(c);
+      }
+    }
+  }
+}
+
+
+static inline void on_master_input(struct reactor_watch *w, int events)
+{
+  struct master_channel *c = (struct master_channel*) w->data;
+  struct master *m = c->master;
+
+  while (c->in_watch.fd >= 0 && c->stdin_credit > 0 && !c->closing) {
+    char buffer[MSG_MAX_IO_SIZE];
+
+    int size = c->stdin_credit < MSG_MAX_IO_SIZE ?
+      c->stdin_credit : MSG_MAX_IO_SIZE;
+
+    int n = read_all(c->fds[0], buffer, size);
+    if (n < 0 && errno == EWOULDBLOCK) {
+      break;
+    }
+
+    // Input has ended (or failed); the command keeps running.
+    if (n <= 0) {
+      reactor_del(&m->reactor, &c->in_watch);
+
+      if (send_eof_msg(m->sockfd, c->id) < 0) {
+        error("ERROR writing to sockfd");
+      }
+      break;
+    }
+
+    c->stdin_credit -= n;
+
+    if (send_io_msg(m->sockfd, c->id, STDIN_FILENO, buffer, n) < 0) {
+      error("ERROR writing to sockfd");
+    }
+  }
+
+  master_update_watches(c);
+}
+
+
+static inline void on_master_output(struct reactor_watch *w, int events)
+{
+  struct master_channel *c = (struct master_channel*) w->data;
+  int idx = w == &c->out_watches[0] ? 0 : 1;
+
+  master_output_written(
+      c,
+      idx + 1,
+      out_queue_flush(&c->out_queues[idx], c->fds[idx + 1]));
+
+  master_update_watches(c);
+  master_channel_check(c);
+}
+
+
+static inline void master_handle_message(
+    struct master *m,
+    struct msg_wrapper *message)
+{
+  int id = message->channel;
+
+  if (id < 0 || id >= m->num_channels || !m->channels[id]->busy) {
+    errno = EPROTO;
+    error("ERROR parsing message from sockfd");
+  }
+
+  struct master_channel *c = m->channels[id];
+
+  message = msg_expand(message, (struct msg_wrapper*) m->zio_frame);
+  if (message == NULL) {
+    error("ERROR decompressing message from sockfd");
+  }
+
+  switch (message->type) {
+    case IO_MSG: {
+      int stream = message->msg.io.destfd;
+      if (stream != STDOUT_FILENO && stream != STDERR_FILENO) {
+        break;
+      }
+
+      // Output for a channel that is being closed is just credited.
+      if (c->closing) {
+        master_output_written(c, stream, message->msg.io.data_size);
+        break;
+      }
+
+      master_output_written(c, stream, out_queue_write(
+          &c->out_queues[stream - 1],
+          c->fds[stream],
+          message->msg.io.data,
+          message->msg.io.data_size));
+
+      master_update_watches(c);
+      break;
+    }
+    case CREDIT_MSG: {
+      if (message->msg.credit.destfd == STDIN_FILENO) {
+        c->stdin_credit += message->msg.credit.bytes;
+        master_update_watches(c);
+      }
+      break;
+    }
+    case EXIT_MSG: {
+      c->exited = true;
+      c->status = message->msg.exit.status;
+
+      if (c->closing) {
+        out_queue_clear(&c->out_queues[0]);
+        out_queue_clear(&c->out_queues[1]);
+      }
+
+      master_channel_check(c);
+      break;
+    }
+  }
+}
+
+
+static inline int master_read_socket(void *ctx, char *buf, size_t count)
+{
+  return read_all(((struct master*) ctx)->sockfd, buf, count);
+}
+
+
+static inline void on_master_socket(struct reactor_watch *w, int events)
+{
+  struct master *m = (struct master*) w->data;
+
+  while (true) {
+    struct msg_wrapper *message;
+    int n = msg_recv_buffer_next(&m->rx, &message);
+
+    if (n < 0) {
+      error("ERROR parsing message from sockfd");
+    }
+
+    if (n > 0) {
+      master_handle_message(m, message);
+      continue;
+    }
+
+    n = msg_recv_buffer_fill(&m->rx, master_read_socket, m);
+
+    if (n < 0) {
+      if (errno == EWOULDBLOCK) {
+        break;
+      }
+      error("ERROR reading from sockfd");
+    }
+
+    if (n == 0) {
+      errno = ECONNRESET;
+      error("ERROR reading from sockfd");
+    }
+  }
+}
+
+
+static inline void on_master_listen(struct reactor_watch *w, int events)
+{
+  struct master *m = (struct master*) w->data;
+
+  while (true) {
+    int fd = accept(m->listenfd, NULL, NULL);
+
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EWOULDBLOCK) {
+        perror("ERROR on accept");
+      }
+      return;
+    }
+
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+        cred.uid != getuid()) {
+      close(fd);
+      continue;
+    }
+
+    struct master_channel *c = NULL;
+
+    if (make_non_blocking(fd) < 0 ||
+        make_cloexec(fd) < 0 ||
+        (c = master_channel_alloc(m)) == NULL) {
+      perror("ERROR setting up control connection");
+      close(fd);
+      continue;
+    }
+
+    c->ctlfd = fd;
+
+    if (reactor_add(&m->reactor, &c->ctl_watch, fd, REACTOR_READ,
+                    on_master_control, c) < 0) {
+      perror("ERROR watching control connection");
+      master_channel_release(c);
+    }
+  }
+}
+
+
+// Serves control clients over the unix socket at 'path' on the already
+// connected socket 'sockfd'. Only returns if the server goes away.
+static inline int master_run(const char *path, int sockfd)
+{
+  struct master master;
+  struct master *m = &master;
+  memset(m, 0, sizeof(struct master));
+
+  m->sockfd = sockfd;
+
+  m->listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (m->listenfd < 0) {
+    error("ERROR opening control socket");
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    error("ERROR binding control socket");
+  }
+  strcpy(addr.sun_path, path);
+
+  if (unix_remove_stale(path) < 0) {
+    error("ERROR binding control socket");
+  }
+
+  mode_t mask = umask(0077);
+  int result = bind(m->listenfd, (struct sockaddr *) &addr, sizeof(addr));
+  umask(mask);
+
+  if (result < 0) {
+    error("ERROR binding control socket");
+  }
+
+  if (listen(m->listenfd, 128) < 0) {
+    error("ERROR listening on control socket");
+  }
+
+  if (make_non_blocking(m->listenfd) < 0 ||
+      make_cloexec(m->listenfd) < 0 ||
+      make_non_blocking(m->sockfd) < 0 ||
+      make_cloexec(m->sockfd) < 0) {
+    error("ERROR setting up master sockets");
+  }
+
+  // Passed fds may be closed at their other end at any time.
+  signal(SIGPIPE, SIG_IGN);
+
+  pool_init(&m->buffers, MSG_RECV_BUFFER_SIZE, 64);
+  msg_recv_buffer_init(&m->rx, &m->buffers);
+
+  if (reactor_init(&m->reactor, REACTOR_DEFAULT) < 0) {
+    error("ERROR creating reactor");
+  }
+
+  if (reactor_add(&m->reactor, &m->sock_watch, m->sockfd, REACTOR_READ,
+                  on_master_socket, m) < 0) {
+    error("ERROR watching sockfd");
+  }
+
+  if (reactor_add(&m->reactor, &m->listen_watch, m->listenfd, REACTOR_READ,
+                  on_master_listen, m) < 0) {
+    error("ERROR watching control socket");
+  }
+
+  while (true) {
+    result = reactor_run_once(&m->reactor, -1);
+
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error("ERROR waiting on reactor");
+    }
+
+    for (int i = 0; i < m->num_channels; i++) {
+      m->channels[i]->dead = false;
+    }
+  }
+
+  return 0;
+}
+
+#endif // MASTER_H
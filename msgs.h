@@ -1,21 +1,79 @@
 #ifndef MSGS_H
 #define MSGS_H
 
+#include <stddef.h>
+
 #include <sys/ioctl.h>
 
 #include "common.h"
-
+#include "lz.h"
+#include "pool.h"
+#include "resume.h"
+
+// Every frame starts with its type and the channel it belongs to. A
+// connection carries any number of channels, each running one command:
+// the client opens a channel with a CMD_MSG, the server ends it with an
+// EXIT_MSG once the command has exited and its output has been sent,
+// after which the channel id may be reused. A client that is no longer
+// interested in a channel closes it with a CLOSE_MSG and still waits
+// for the EXIT_MSG. The end of a channel's stdin is passed on with an
+// EOF_MSG, after which the command's output keeps flowing until it
+// exits.
+//
+// A client that asks for it in its CMD_MSG may get the command's output
+// as ZIO_MSG frames, which are laid out like IO_MSG frames but carry an
+// lz.h compressed payload of at most MSG_MAX_IO_SIZE bytes.
+//
+// A tty command may instead be run synchronized: its output is fed to
+// a terminal emulator on the server (term.h) and the client is sent
+// SCREEN_MSG frames that bring its copy of the screen up to date, no
+// more often than every few milliseconds. The changes for one update
+// may take several frames; the last one is flagged SCREEN_FINAL and
+// carries the cursor. Screen frames need no credit.
+//
+// A client that wants its session to survive a broken connection
+// starts with a SESSION_MSG instead and is answered with one; see
+// resume.h. Both sides then ack what they receive with ACK_MSG frames.
+//
+// A tty command may be started detached, in a session that outlives
+// its clients. The server answers its CMD_MSG with an ATTACH_MSG that
+// names the session. Any number of clients may then attach to it at
+// once, each starting with an ATTACH_MSG of that id: all of them are
+// sent the command's output, and all but the ones that attach read only
+// (ATTACH_READ_ONLY) type into it and size its tty.
+//
+// A client on the same host, connected over the server's unix socket,
+// may ask for the command's fds instead of its output (pass_fds). The
+// server answers with an FDS_MSG that carries them as SCM_RIGHTS: the
+// pty master of a tty command, or else the pipes to its stdin, stdout
+// and stderr, in that order. From then on the client reads and writes
+// them itself, and the channel only ends with the EXIT_MSG.
 enum msg_type
 {
   CMD_MSG,
   IO_MSG,
   WINSIZE_MSG,
+  CREDIT_MSG,
+  EXIT_MSG,
+  CLOSE_MSG,
+  EOF_MSG,
+  ZIO_MSG,
+  SCREEN_MSG,
+  SESSION_MSG,
+  ACK_MSG,
+  ATTACH_MSG,
+  FDS_MSG,
 };
 
 
 struct cmd_msg
 {
   bool tty;
+  bool null_stdin;
+  bool compress;
+  bool sync;
+  bool detach;
+  bool pass_fds;
   struct winsize winsize;
   int num_cmd_strings;
   int strtab_size;
@@ -37,84 +95,275 @@ struct winsize_msg
 };
 
 
+// Flow control. Each stream (identified by the fd it is written to on
+// the receiving side) may have at most MSG_CREDIT_WINDOW payload bytes
+// in flight. The receiver hands credit back once it has actually
+// written the data out, so a slow consumer stalls the producer instead
+// of letting queues grow.
+struct credit_msg
+{
+  int destfd;
+  int bytes;
+};
+
+#define MSG_CREDIT_WINDOW (256 * 1024)
+
+// Credit is handed back in lumps of at least this many bytes.
+#define MSG_CREDIT_THRESHOLD (MSG_CREDIT_WINDOW / 4)
+
+
+// Changes to the screen of a synchronized tty, encoded as in term.h.
+// A frame flagged SCREEN_RESET starts over from a blank screen of the
+// given size. 'echo_ack' counts the bytes of stdin that the screen
+// reflects, for local echo (predict.h).
+struct screen_msg
+{
+  int data_size;
+  unsigned short rows;
+  unsigned short cols;
+  unsigned short cursor_row;
+  unsigned short cursor_col;
+  int flags;
+  unsigned int echo_ack;
+  char data[];
+};
+
+#define SCREEN_FINAL 0x1
+#define SCREEN_RESET 0x2
+#define SCREEN_CURSOR_VISIBLE 0x4
+
+
+// Opens a resumable session (all zero token) or resumes the one with
+// the token, and tells how much of the other side's frames have been
+// received and how big the sender's resume log is. The server answers
+// with the token of the session, or an all zero one if it has none
+// for the client.
+struct session_msg
+{
+  char token[RESUME_TOKEN_SIZE];
+  unsigned int received;
+  int log_size;
+};
+
+
+struct ack_msg
+{
+  unsigned int received;
+};
+
+
+// The id of a detached session; the server answers an unknown one with
+// an id of 0.
+struct attach_msg
+{
+  unsigned int id;
+  int flags;
+};
+
+// Set by the server if the session's tty is synchronized, and by a
+// client that only watches.
+#define ATTACH_SYNC 0x1
+#define ATTACH_READ_ONLY 0x2
+
+
+// How many fds came along with the frame.
+struct fds_msg
+{
+  int num_fds;
+};
+
+
+// The wait status of the command, as returned by waitpid().
+struct exit_msg
+{
+  int status;
+};
+
+
 struct msg_wrapper
 {
   int type;
+  int channel;
   union {
     struct cmd_msg cmd;
     struct io_msg io;
     struct winsize_msg winsize;
+    struct credit_msg credit;
+    struct exit_msg exit;
+    struct screen_msg screen;
+    struct session_msg session;
+    struct ack_msg ack;
+    struct attach_msg attach;
+    struct fds_msg fds;
   } msg;
 };
 
 
+// Frames are laid out on the wire exactly like a struct msg_wrapper
+// holding the message, so fixed size frames are sent straight from one.
+#define MSG_HEADER_SIZE (offsetof(struct msg_wrapper, msg))
+
+// Size of the fixed part of an IO_MSG frame on the wire.
+#define IO_MSG_HEADER_SIZE (MSG_HEADER_SIZE + sizeof(struct io_msg))
+
+// Size of the fixed part of a SCREEN_MSG frame on the wire.
+#define SCREEN_MSG_HEADER_SIZE (MSG_HEADER_SIZE + sizeof(struct screen_msg))
+
+// Frames are zero padded on the wire to a multiple of MSG_ALIGN bytes,
+// so that each one starts suitably aligned in a receive buffer and can
+// be used in place.
+#define MSG_ALIGN 4
+#define MSG_ALIGNED(size) (((size) + MSG_ALIGN - 1) & ~(size_t)(MSG_ALIGN - 1))
+
+static const char msg_padding[MSG_ALIGN] = {0};
+
+// Largest payload put into a single IO_MSG, so that output frames
+// always fit in a receive buffer without growing it.
+#define MSG_MAX_IO_SIZE (32 * 1024)
+
+
+// Frames written to 'msg_log_fd' are kept in 'msg_log' until the peer
+// acks them (resume.h). Should the connection break they are sent again
+// over the next one, so failing to write them only marks the log
+// broken. Returns -1 with errno set to ENOBUFS if the log is full.
+static struct resume_log *msg_log = NULL;
+static int msg_log_fd = -1;
+
+static inline int msg_writev(
+    int fd,
+    struct iovec *iov,
+    int iovcnt,
+    int *fds,
+    int num_fds)
+{
+  if (msg_log == NULL || fd != msg_log_fd) {
+    return writev_all_fds(fd, iov, iovcnt, fds, num_fds);
+  }
+
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+
+  if (total > resume_log_room(msg_log)) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  for (int i = 0; i < iovcnt; i++) {
+    resume_log_append(msg_log, (char*) iov[i].iov_base, iov[i].iov_len);
+  }
+
+  if (!msg_log->broken &&
+      writev_all_fds(fd, iov, iovcnt, fds, num_fds) < 0) {
+    msg_log->broken = true;
+  }
+
+  return total;
+}
+
+
+// Over a unix socket 'fds' may carry the stdio fds for the command.
 static inline int send_cmd_msg(
     int fd,
+    int channel,
     char **cmd,
     int num_elements,
     bool tty,
-    struct winsize *winsize)
+    bool null_stdin,
+    bool compress,
+    bool sync,
+    bool detach,
+    bool pass_fds,
+    struct winsize *winsize,
+    int *fds,
+    int num_fds)
 {
-  struct cmd_msg message = {0};
-  int string_lengths[num_elements];
+  struct msg_wrapper message;
+  memset(&message, 0, sizeof(message));
+
+  struct iovec iov[num_elements + 2];
 
-  message.tty = tty;
+  message.type = CMD_MSG;
+  message.channel = channel;
+  message.msg.cmd.tty = tty;
+  message.msg.cmd.null_stdin = null_stdin;
+  message.msg.cmd.compress = compress;
+  message.msg.cmd.sync = sync;
+  message.msg.cmd.detach = detach;
+  message.msg.cmd.pass_fds = pass_fds;
 
   if (winsize != NULL) {
-    message.winsize = *winsize;
+    message.msg.cmd.winsize = *winsize;
   }
 
-  message.num_cmd_strings = num_elements;
+  message.msg.cmd.num_cmd_strings = num_elements;
 
   for (int i = 0; i < num_elements; i++) {
-    string_lengths[i] = strlen(cmd[i]) + 1;
-    message.strtab_size += string_lengths[i];
+    iov[i + 1].iov_base = cmd[i];
+    iov[i + 1].iov_len = strlen(cmd[i]) + 1;
+    message.msg.cmd.strtab_size += iov[i + 1].iov_len;
   }
 
-  int type = CMD_MSG;
-  int n = write_all(fd, (char *)&type, sizeof(int));
-  if (n < 0) {
-    return n;
-  }
+  iov[0].iov_base = &message;
+  iov[0].iov_len = MSG_HEADER_SIZE + sizeof(struct cmd_msg);
 
-  if (n < sizeof(type)) {
-    return -1;
-  }
+  size_t frame_size = iov[0].iov_len + message.msg.cmd.strtab_size;
+  iov[num_elements + 1].iov_base = (void*) msg_padding;
+  iov[num_elements + 1].iov_len = MSG_ALIGNED(frame_size) - frame_size;
 
-  n = write_all(fd, (char *)&message, sizeof(cmd_msg));
+  int n = msg_writev(fd, iov, num_elements + 2, fds, num_fds);
   if (n < 0) {
     return n;
   }
 
-  for (int i = 0; i < num_elements; i++) {
-    int n = write_all(fd, cmd[i], string_lengths[i]);
-    if (n < 0) {
-      return n;
-    }
-  }
-
   return 0;
 }
 
 
-static inline int send_io_msg(int fd, int destfd, char *buffer, int size)
+static inline int send_io_msg(
+    int fd,
+    int channel,
+    int destfd,
+    char *buffer,
+    int size)
 {
   struct msg_wrapper message;
   message.type = IO_MSG;
+  message.channel = channel;
   message.msg.io.destfd = destfd;
   message.msg.io.data_size = size;
 
-  int n = write_all(fd, (char*)&message, sizeof(message.type));
-  if (n < 0) {
-    return n;
-  }
+  struct iovec iov[3];
+  iov[0].iov_base = &message;
+  iov[0].iov_len = IO_MSG_HEADER_SIZE;
+  iov[1].iov_base = buffer;
+  iov[1].iov_len = size;
+  iov[2].iov_base = (void*) msg_padding;
+  iov[2].iov_len = MSG_ALIGNED(IO_MSG_HEADER_SIZE + size) -
+                   (IO_MSG_HEADER_SIZE + size);
 
-  n = write_all(fd, (char*)&message.msg.io, sizeof(struct io_msg));
+  int n = msg_writev(fd, iov, 3, NULL, 0);
   if (n < 0) {
     return n;
   }
 
-  n = write_all(fd, buffer, size);
+  return 0;
+}
+
+
+// Sends a frame without payload; 'size' is the size of its message,
+// which for all of these is a multiple of MSG_ALIGN already.
+static inline int send_fixed_msg(
+    int fd,
+    struct msg_wrapper *message,
+    size_t size)
+{
+  struct iovec iov;
+  iov.iov_base = message;
+  iov.iov_len = MSG_HEADER_SIZE + size;
+
+  int n = msg_writev(fd, &iov, 1, NULL, 0);
   if (n < 0) {
     return n;
   }
@@ -123,212 +372,499 @@ static inline int send_io_msg(int fd, int destfd, char *buffer, int size)
 }
 
 
-static inline int send_winsize_msg(int fd, struct winsize *winsize)
+static inline int send_winsize_msg(
+    int fd,
+    int channel,
+    struct winsize *winsize)
 {
   struct msg_wrapper message;
   message.type = WINSIZE_MSG;
+  message.channel = channel;
   message.msg.winsize.winsize = *winsize;
 
-  int n = write_all(fd, (char*)&message, sizeof(message.type));
-  if (n < 0) {
-    return n;
-  }
+  return send_fixed_msg(fd, &message, sizeof(struct winsize_msg));
+}
 
-  n = write_all(fd, (char*)&message.msg.winsize, sizeof(struct winsize_msg));
-  if (n < 0) {
-    return n;
-  }
 
-  return 0;
+static inline int send_credit_msg(int fd, int channel, int destfd, int bytes)
+{
+  struct msg_wrapper message;
+  message.type = CREDIT_MSG;
+  message.channel = channel;
+  message.msg.credit.destfd = destfd;
+  message.msg.credit.bytes = bytes;
+
+  return send_fixed_msg(fd, &message, sizeof(struct credit_msg));
 }
 
 
-static inline int recv_cmd_msg(int fd, struct msg_wrapper **message)
+static inline int send_close_msg(int fd, int channel)
 {
-  struct cmd_msg cmd_msg;
+  struct msg_wrapper message;
+  message.type = CLOSE_MSG;
+  message.channel = channel;
 
-  int n = read_all(fd, (char *)&cmd_msg, sizeof(struct cmd_msg));
-  if (n < 0) {
-    return n;
-  }
+  return send_fixed_msg(fd, &message, 0);
+}
 
-  if (n < sizeof(cmd_msg)) {
-    return -1;
+
+static inline int send_eof_msg(int fd, int channel)
+{
+  struct msg_wrapper message;
+  message.type = EOF_MSG;
+  message.channel = channel;
+
+  return send_fixed_msg(fd, &message, 0);
+}
+
+
+static inline int send_session_msg(
+    int fd,
+    const char *token,
+    unsigned int received,
+    int log_size)
+{
+  struct msg_wrapper message;
+  message.type = SESSION_MSG;
+  message.channel = 0;
+  memcpy(message.msg.session.token, token, RESUME_TOKEN_SIZE);
+  message.msg.session.received = received;
+  message.msg.session.log_size = log_size;
+
+  return send_fixed_msg(fd, &message, sizeof(struct session_msg));
+}
+
+
+static inline int send_attach_msg(int fd, unsigned int id, int flags)
+{
+  struct msg_wrapper message;
+  message.type = ATTACH_MSG;
+  message.channel = 0;
+  message.msg.attach.id = id;
+  message.msg.attach.flags = flags;
+
+  return send_fixed_msg(fd, &message, sizeof(struct attach_msg));
+}
+
+
+static inline int send_ack_msg(int fd, unsigned int received)
+{
+  struct msg_wrapper message;
+  message.type = ACK_MSG;
+  message.channel = 0;
+  message.msg.ack.received = received;
+
+  return send_fixed_msg(fd, &message, sizeof(struct ack_msg));
+}
+
+
+// A run of IO_MSG frames laid out back to back in one buffer, so that
+// any number of them is handed to the socket at once. Payloads are read
+// straight into place with msg_batch_payload()/msg_batch_commit_io().
+#define MSG_BATCH_SIZE (256 * 1024)
+
+struct msg_batch
+{
+  size_t len;
+  char buf[MSG_BATCH_SIZE];
+};
+
+
+static inline size_t msg_batch_room(struct msg_batch *batch)
+{
+  size_t left = MSG_BATCH_SIZE - batch->len;
+  size_t overhead = IO_MSG_HEADER_SIZE + MSG_ALIGN - 1;
+
+  if (left <= overhead) {
+    return 0;
   }
 
-  *message = (struct msg_wrapper*) malloc(
-      sizeof(struct msg_wrapper) + cmd_msg.strtab_size);
+  left -= overhead;
+  return left < MSG_MAX_IO_SIZE ? left : MSG_MAX_IO_SIZE;
+}
 
-  (*message)->msg.cmd = cmd_msg;
 
-  n = read_all(
-    fd,
-    (*message)->msg.cmd.strtab,
-    (*message)->msg.cmd.strtab_size);
+static inline char *msg_batch_payload(struct msg_batch *batch)
+{
+  return batch->buf + batch->len + IO_MSG_HEADER_SIZE;
+}
 
-  if (n < 0) {
-    return n;
+
+// Fills in the header and padding of an IO_MSG or ZIO_MSG frame at
+// 'frame' whose payload of 'size' bytes is in place after it. Returns
+// the padded size of the frame.
+static inline size_t msg_frame_io(
+    char *frame,
+    int type,
+    int channel,
+    int destfd,
+    int size)
+{
+  struct msg_wrapper header;
+  header.type = type;
+  header.channel = channel;
+  header.msg.io.destfd = destfd;
+  header.msg.io.data_size = size;
+
+  memcpy(frame, &header, IO_MSG_HEADER_SIZE);
+
+  size_t frame_size = IO_MSG_HEADER_SIZE + size;
+  memset(frame + frame_size, 0, MSG_ALIGNED(frame_size) - frame_size);
+
+  return MSG_ALIGNED(frame_size);
+}
+
+
+static inline void msg_batch_commit_frame(
+    struct msg_batch *batch,
+    int type,
+    int channel,
+    int destfd,
+    int size)
+{
+  batch->len += msg_frame_io(batch->buf + batch->len, type, channel,
+                             destfd, size);
+}
+
+
+static inline void msg_batch_commit_io(
+    struct msg_batch *batch,
+    int channel,
+    int destfd,
+    int size)
+{
+  msg_batch_commit_frame(batch, IO_MSG, channel, destfd, size);
+}
+
+
+// Like msg_batch_commit_io(), but the payload goes out compressed as a
+// ZIO_MSG if that saves at least an eighth of it. Returns whether it
+// did.
+static inline bool msg_batch_commit_zio(
+    struct msg_batch *batch,
+    int channel,
+    int destfd,
+    int size)
+{
+  static __thread char compressed[MSG_MAX_IO_SIZE];
+
+  char *payload = msg_batch_payload(batch);
+  size_t compressed_size = lz_compress(
+      payload, size, compressed, size - size / 8);
+
+  if (compressed_size == 0) {
+    msg_batch_commit_io(batch, channel, destfd, size);
+    return false;
   }
 
-  if (n < ((*message)->msg.cmd.strtab_size)) {
-    return -1;
+  memcpy(payload, compressed, compressed_size);
+  msg_batch_commit_frame(batch, ZIO_MSG, channel, destfd, compressed_size);
+  return true;
+}
+
+
+// Returns a ZIO_MSG frame decompressed into 'frame' as the IO_MSG it
+// stands for; 'frame' must have room for IO_MSG_HEADER_SIZE +
+// MSG_MAX_IO_SIZE bytes. Any other frame is returned as it is. Returns
+// NULL with errno set to EPROTO if the payload does not decompress.
+static inline struct msg_wrapper *msg_expand(
+    struct msg_wrapper *message,
+    struct msg_wrapper *frame)
+{
+  if (message->type != ZIO_MSG) {
+    return message;
   }
 
-  return 0;
+  ssize_t size = lz_decompress(
+      message->msg.io.data,
+      message->msg.io.data_size,
+      frame->msg.io.data,
+      MSG_MAX_IO_SIZE);
+
+  if (size < 0) {
+    errno = EPROTO;
+    return NULL;
+  }
+
+  frame->type = IO_MSG;
+  frame->channel = message->channel;
+  frame->msg.io.destfd = message->msg.io.destfd;
+  frame->msg.io.data_size = size;
+
+  return frame;
 }
 
 
-static inline int recv_msg(int fd, struct msg_wrapper **message)
+// Source of bytes for msg_recv_buffer_fill(), with read_all() semantics.
+typedef int (*msg_reader)(void *ctx, char *buf, size_t count);
+
+
+static inline int msg_read_fd(void *ctx, char *buf, size_t count)
 {
-  int type;
+  return read_all(*(int*)ctx, buf, count);
+}
 
-  int n = read_all(fd, (char *)&type, sizeof(type));
-  if (n < 0) {
-    return n;
+
+// Per-connection receive buffer. Each fill takes in as much as the
+// connection has and every complete frame is then parsed in place, so
+// a stream of small messages costs one read for many of them. A partial
+// frame at the end is carried over to the next fill.
+//
+// Storage comes from a pool of MSG_RECV_BUFFER_SIZE buffers and goes
+// back to it whenever the connection has been drained with nothing
+// pending, so idle connections hold no buffer and the steady state does
+// no heap allocation. Only a frame too big for a pooled buffer (a huge
+// command line) gets a buffer of its own.
+#define MSG_RECV_BUFFER_SIZE (64 * 1024)
+
+// Upper bound on any one frame, so a corrupt length is caught instead
+// of growing the buffer without limit.
+#define MSG_MAX_FRAME_SIZE (16 * 1024 * 1024)
+
+struct msg_recv_buffer
+{
+  struct buf_pool *pool;
+  char *buf;
+  size_t size;
+  size_t start;
+  size_t end;
+};
+
+
+static inline void msg_recv_buffer_init(
+    struct msg_recv_buffer *rb,
+    struct buf_pool *pool)
+{
+  rb->pool = pool;
+  rb->buf = NULL;
+  rb->size = 0;
+  rb->start = 0;
+  rb->end = 0;
+}
+
+
+static inline void msg_recv_buffer_release(struct msg_recv_buffer *rb)
+{
+  if (rb->size == rb->pool->buf_size) {
+    pool_put(rb->pool, rb->buf);
+  } else {
+    free(rb->buf);
   }
 
-  if (n < sizeof(type)) {
-    return -1;
+  rb->buf = NULL;
+  rb->size = 0;
+  rb->start = 0;
+  rb->end = 0;
+}
+
+
+static inline void msg_recv_buffer_destroy(struct msg_recv_buffer *rb)
+{
+  msg_recv_buffer_release(rb);
+}
+
+
+// Returns the padded size of the frame at 'frame', the number of bytes
+// needed to tell its size if fewer than that are available, or -1 with
+// errno set to EPROTO if the frame is malformed.
+static inline ssize_t msg_frame_size(const char *frame, size_t available)
+{
+  if (available < MSG_HEADER_SIZE) {
+    return MSG_HEADER_SIZE;
   }
 
-  switch (type) {
-    case CMD_MSG:
-      return recv_cmd_msg(fd, message);
+  const struct msg_wrapper *message = (const struct msg_wrapper*) frame;
+
+  size_t header = MSG_HEADER_SIZE;
+  int payload = 0;
+
+  switch (message->type) {
+    case CMD_MSG: {
+      header += sizeof(struct cmd_msg);
+      if (available < header) {
+        return header;
+      }
+      payload = message->msg.cmd.strtab_size;
+      break;
+    }
     case IO_MSG:
+    case ZIO_MSG: {
+      header += sizeof(struct io_msg);
+      if (available < header) {
+        return header;
+      }
+      payload = message->msg.io.data_size;
       break;
+    }
     case WINSIZE_MSG:
+      header += sizeof(struct winsize_msg);
+      break;
+    case CREDIT_MSG:
+      header += sizeof(struct credit_msg);
+      break;
+    case EXIT_MSG:
+      header += sizeof(struct exit_msg);
+      break;
+    case SCREEN_MSG: {
+      header += sizeof(struct screen_msg);
+      if (available < header) {
+        return header;
+      }
+      payload = message->msg.screen.data_size;
+      break;
+    }
+    case SESSION_MSG:
+      header += sizeof(struct session_msg);
+      break;
+    case ACK_MSG:
+      header += sizeof(struct ack_msg);
       break;
+    case ATTACH_MSG:
+      header += sizeof(struct attach_msg);
+      break;
+    case FDS_MSG:
+      header += sizeof(struct fds_msg);
+      break;
+    case CLOSE_MSG:
+    case EOF_MSG:
+      break;
+    default:
+      errno = EPROTO;
+      return -1;
   }
 
-  assert(0);
+  if (payload < 0 || header + payload > MSG_MAX_FRAME_SIZE) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  return MSG_ALIGNED(header + payload);
 }
 
 
-struct async_msg_state
+// Hands out the next complete frame in the buffer. Returns 1 and points
+// 'message' into the buffer (valid until the next fill), 0 if more bytes
+// are needed, or -1 with errno set if the stream is malformed.
+static inline int msg_recv_buffer_next(
+    struct msg_recv_buffer *rb,
+    struct msg_wrapper **message)
 {
-  int type;
-  int phase;
-  int phase_total;
-  int msg_total;
-  bool finished;
-  struct msg_wrapper *message;
-  char buffer[sizeof((struct msg_wrapper*)0)->msg];
-};
+  if (rb->buf == NULL) {
+    return 0;
+  }
 
+  size_t available = rb->end - rb->start;
+  char *frame = rb->buf + rb->start;
 
-int recv_msg_async(
-    int fd,
-    struct async_msg_state *state)
-{
-  int phase_size = 0;
-  char *phase_dst = NULL;
-
-  while (true) {
-    switch (state->phase) {
-      case 0:
-        phase_size = sizeof(state->type);
-        phase_dst = state->buffer;
-        break;
-      case 1:
-        state->type = *((int*)state->buffer);
-
-        if (state->type == CMD_MSG) {
-          phase_size = sizeof(struct cmd_msg);
-        }
-        if (state->type == IO_MSG) {
-          phase_size = sizeof(struct io_msg);
-        }
-        if (state->type == WINSIZE_MSG) {
-          phase_size = sizeof(struct winsize_msg);
-        }
-
-        phase_dst = state->buffer;
-
-        break;
-      case 2:
-        if (state->type == CMD_MSG) {
-          phase_size = ((struct cmd_msg*)state->buffer)->strtab_size;
-
-          if (state->phase_total == 0) {
-            state->message = (struct msg_wrapper*) malloc(
-                sizeof(struct msg_wrapper) + phase_size);
-
-            state->message->type = state->type;
-            state->message->msg.cmd =
-              *((struct cmd_msg*)state->buffer);
-          }
-
-          phase_dst = (char*) state->message->msg.cmd.strtab;
-        }
-        if (state->type == IO_MSG) {
-          phase_size = ((struct io_msg*)state->buffer)->data_size;
-
-          if (state->phase_total == 0) {
-            state->message = (struct msg_wrapper*) malloc(
-                sizeof(struct msg_wrapper) + phase_size);
-
-            state->message->type = state->type;
-            state->message->msg.io =
-              *((struct io_msg*)state->buffer);
-          }
-
-          phase_dst = (char*) state->message->msg.io.data;
-        }
-        if (state->type == WINSIZE_MSG) {
-          if (state->phase_total == 0) {
-            state->message = (struct msg_wrapper*) malloc(
-                sizeof(struct msg_wrapper));
-
-            state->message->type = state->type;
-            state->message->msg.winsize =
-              *((struct winsize_msg*)state->buffer);
-
-            state->finished = true;
-            return state->msg_total;
-          }
-        }
-        break;
-      case 3:
-        state->finished = true;
-        return state->msg_total;
-    }
+  ssize_t size = msg_frame_size(frame, available);
+  if (size < 0) {
+    return -1;
+  }
 
-    int n = read_all(
-      fd,
-      phase_dst + state->phase_total,
-      phase_size - state->phase_total);
+  if (available < (size_t) size) {
+    return 0;
+  }
 
-    if (n < 0) {
-      return n;
-    }
+  *message = (struct msg_wrapper*) frame;
+  rb->start += size;
+
+  return 1;
+}
+
+
+// Reads as much as fits after the pending partial frame, if any.
+// Returns the number of bytes read, 0 on EOF, or -1 with errno set;
+// EWOULDBLOCK means the source has been drained.
+static inline int msg_recv_buffer_fill(
+    struct msg_recv_buffer *rb,
+    msg_reader reader,
+    void *ctx)
+{
+  size_t pending = rb->end - rb->start;
+
+  // Swap an oversized buffer back for a pooled one once it is empty.
+  if (pending == 0 && rb->buf != NULL && rb->size != rb->pool->buf_size) {
+    msg_recv_buffer_release(rb);
+  }
 
-    if (n == 0) {
-      return state->msg_total;
+  if (rb->buf == NULL) {
+    rb->buf = pool_get(rb->pool);
+    if (rb->buf == NULL) {
+      return -1;
     }
+    rb->size = rb->pool->buf_size;
+  }
+
+  if (rb->start > 0) {
+    memmove(rb->buf, rb->buf + rb->start, pending);
+    rb->start = 0;
+    rb->end = pending;
+  }
 
-    state->phase_total += n;
-    state->msg_total += n;
+  ssize_t needed = msg_frame_size(rb->buf, pending);
+  if (needed < 0) {
+    return -1;
+  }
 
-    if (state->phase_total < phase_size) {
-      return state->msg_total;
+  if ((size_t) needed > rb->size) {
+    char *buf = (char*) malloc(needed);
+    if (buf == NULL) {
+      return -1;
     }
+    memcpy(buf, rb->buf, pending);
+    msg_recv_buffer_release(rb);
+    rb->buf = buf;
+    rb->size = needed;
+    rb->end = pending;
+  }
 
-    assert(state->phase_total == phase_size);
+  int n = reader(ctx, rb->buf + rb->end, rb->size - rb->end);
+  if (n > 0) {
+    rb->end += n;
+  }
 
-    state->phase_total = 0;
-    state->phase++;
+  if (n < 0 && rb->end == 0) {
+    int saved_errno = errno;
+    msg_recv_buffer_release(rb);
+    errno = saved_errno;
   }
+
+  return n;
 }
 
 
+// Returns a malloc'd, NULL terminated argv pointing into the message's
+// string table, or NULL (with errno set) if the table does not hold the
+// strings the message claims it does.
 static inline char **build_cmd_array(struct cmd_msg *message)
 {
-  char **cmd = (char **)malloc(message->num_cmd_strings + 1);
+  // Every string takes at least its terminating NUL, so a count beyond
+  // the size of the table is a lie, and must not size the allocation.
+  if (message->num_cmd_strings < 1 ||
+      message->num_cmd_strings > message->strtab_size) {
+    errno = EPROTO;
+    return NULL;
+  }
+
+  char **cmd = (char **)malloc(
+      (message->num_cmd_strings + 1) * sizeof(char *));
+  if (cmd == NULL) {
+    return NULL;
+  }
+
   char *strtab_ptr = message->strtab;
+  char *strtab_end = message->strtab + message->strtab_size;
 
   for (int i = 0; i < message->num_cmd_strings; i++) {
+    char *end = (char *)memchr(strtab_ptr, '\0', strtab_end - strtab_ptr);
+    if (end == NULL) {
+      free(cmd);
+      errno = EPROTO;
+      return NULL;
+    }
+
     cmd[i] = strtab_ptr;
-    strtab_ptr += strlen(strtab_ptr) + 1;
+    strtab_ptr = end + 1;
   }
   cmd[message->num_cmd_strings] = NULL;
 
@@ -339,6 +875,7 @@ static inline char **build_cmd_array(struct cmd_msg *message)
 static inline void dump_cmd_msg(struct cmd_msg *message)
 {
   printf("tty: %s\n", message->tty ? "true" : "false");
+  printf("compress: %s\n", message->compress ? "true" : "false");
   printf("num_cmd_strings: %d\n", message->num_cmd_strings);
   printf("strtab_size: %d\n", message->strtab_size);
 
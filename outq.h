@@ -0,0 +1,254 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stdint.h>
+
+#include "common.h"
+#include "pool.h"
+
+// Bytes waiting to be written to a non-blocking fd. Writes go straight
+// to the fd while nothing is queued; whatever the fd does not take is
+// copied into chunks from a buffer pool, in order, and written out by
+// out_queue_flush() once the fd is writable again. The owner watches
+// the fd for REACTOR_WRITE while out_queue_empty() is false.
+
+#define OUT_QUEUE_MAX_IOV 64
+
+struct out_chunk
+{
+  struct out_chunk *next;
+  size_t start;
+  size_t end;
+  char data[];
+};
+
+struct out_queue
+{
+  struct buf_pool *pool;
+  struct out_chunk *head;
+  struct out_chunk *tail;
+  size_t bytes;
+};
+
+
+static inline void out_queue_init(struct out_queue *q, struct buf_pool *pool)
+{
+  q->pool = pool;
+  q->head = NULL;
+  q->tail = NULL;
+  q->bytes = 0;
+}
+
+
+static inline bool out_queue_empty(struct out_queue *q)
+{
+  return q->bytes == 0;
+}
+
+
+static inline size_t out_chunk_capacity(struct out_queue *q)
+{
+  return q->pool->buf_size - sizeof(struct out_chunk);
+}
+
+
+static inline void out_queue_clear(struct out_queue *q)
+{
+  while (q->head != NULL) {
+    struct out_chunk *chunk = q->head;
+    q->head = chunk->next;
+    pool_put(q->pool, (char*) chunk);
+  }
+
+  q->tail = NULL;
+  q->bytes = 0;
+}
+
+
+static inline int out_queue_append(
+    struct out_queue *q,
+    const char *buf,
+    size_t count)
+{
+  while (count > 0) {
+    struct out_chunk *chunk = q->tail;
+
+    if (chunk == NULL || chunk->end == out_chunk_capacity(q)) {
+      chunk = (struct out_chunk*) pool_get(q->pool);
+      if (chunk == NULL) {
+        return -1;
+      }
+
+      chunk->next = NULL;
+      chunk->start = 0;
+      chunk->end = 0;
+
+      if (q->tail != NULL) {
+        q->tail->next = chunk;
+      } else {
+        q->head = chunk;
+      }
+      q->tail = chunk;
+    }
+
+    size_t length = out_chunk_capacity(q) - chunk->end;
+    if (length > count) {
+      length = count;
+    }
+
+    memcpy(chunk->data + chunk->end, buf, length);
+    chunk->end += length;
+    q->bytes += length;
+
+    buf += length;
+    count -= length;
+  }
+
+  return 0;
+}
+
+
+// Copies up to 'count' bytes, starting 'offset' bytes into the queue,
+// to 'buf'. Returns the number of bytes copied.
+static inline size_t out_queue_peek(
+    struct out_queue *q,
+    size_t offset,
+    char *buf,
+    size_t count)
+{
+  size_t copied = 0;
+
+  for (struct out_chunk *chunk = q->head;
+       chunk != NULL && copied < count;
+       chunk = chunk->next) {
+    size_t used = chunk->end - chunk->start;
+
+    if (offset >= used) {
+      offset -= used;
+      continue;
+    }
+
+    size_t length = used - offset;
+    if (length > count - copied) {
+      length = count - copied;
+    }
+
+    memcpy(buf + copied, chunk->data + chunk->start + offset, length);
+    copied += length;
+    offset = 0;
+  }
+
+  return copied;
+}
+
+
+// Writes as much of the first 'limit' bytes of the queue as the fd
+// takes. Returns the number of bytes written or -1 with errno set;
+// EWOULDBLOCK is not an error.
+static inline ssize_t out_queue_flush_some(
+    struct out_queue *q,
+    int fd,
+    size_t limit)
+{
+  ssize_t total = 0;
+
+  while (q->head != NULL && (size_t) total < limit) {
+    struct iovec iov[OUT_QUEUE_MAX_IOV];
+    int iovcnt = 0;
+    size_t left = limit - total;
+
+    for (struct out_chunk *chunk = q->head;
+         chunk != NULL && iovcnt < OUT_QUEUE_MAX_IOV && left > 0;
+         chunk = chunk->next) {
+      size_t used = chunk->end - chunk->start;
+      if (used > left) {
+        used = left;
+      }
+
+      iov[iovcnt].iov_base = chunk->data + chunk->start;
+      iov[iovcnt].iov_len = used;
+      iovcnt++;
+      left -= used;
+    }
+
+    ssize_t length = writev(fd, iov, iovcnt);
+
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EWOULDBLOCK) {
+        break;
+      }
+      return -1;
+    }
+
+    total += length;
+    q->bytes -= length;
+
+    while (length > 0) {
+      struct out_chunk *chunk = q->head;
+      size_t used = chunk->end - chunk->start;
+
+      if ((size_t) length < used) {
+        chunk->start += length;
+        break;
+      }
+
+      length -= used;
+      q->head = chunk->next;
+      pool_put(q->pool, (char*) chunk);
+    }
+
+    if (q->head == NULL) {
+      q->tail = NULL;
+    }
+  }
+
+  return total;
+}
+
+
+// Writes as much of the queue as the fd takes. Returns the number of
+// bytes written or -1 with errno set; EWOULDBLOCK is not an error.
+static inline ssize_t out_queue_flush(struct out_queue *q, int fd)
+{
+  return out_queue_flush_some(q, fd, SIZE_MAX);
+}
+
+
+// Writes to the fd directly if nothing is queued and queues whatever it
+// does not take. Returns the number of bytes written to the fd (not
+// counting the ones queued) or -1 with errno set.
+static inline ssize_t out_queue_write(
+    struct out_queue *q,
+    int fd,
+    const char *buf,
+    size_t count)
+{
+  size_t offset = 0;
+
+  while (q->head == NULL && offset < count) {
+    ssize_t length = write(fd, buf + offset, count - offset);
+
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EWOULDBLOCK) {
+        break;
+      }
+      return -1;
+    }
+
+    offset += length;
+  }
+
+  if (out_queue_append(q, buf + offset, count - offset) < 0) {
+    return -1;
+  }
+
+  return offset;
+}
+
+#endif // OUTQ_H
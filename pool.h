@@ -0,0 +1,94 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdlib.h>
+
+// A free list of equally sized buffers. Buffers handed back with
+// pool_put() are kept for the next pool_get() instead of being freed,
+// so once a pool has warmed up the forwarding paths do no heap
+// allocation at all. At most 'max_free' idle buffers are kept around.
+//
+// Pools are not thread safe; each event loop owns its own. Buffers of
+// the same size may go back to another pool than they came from, as
+// they do when a session moves to another event loop.
+
+struct pool_buf
+{
+  struct pool_buf *next;
+};
+
+struct buf_pool
+{
+  size_t buf_size;
+  int max_free;
+  int num_free;
+  int num_out;
+  struct pool_buf *free_list;
+};
+
+
+static inline void pool_init(
+    struct buf_pool *pool,
+    size_t buf_size,
+    int max_free)
+{
+  pool->buf_size = buf_size;
+  pool->max_free = max_free;
+  pool->num_free = 0;
+  pool->num_out = 0;
+  pool->free_list = NULL;
+}
+
+
+static inline char *pool_get(struct buf_pool *pool)
+{
+  struct pool_buf *buf = pool->free_list;
+
+  if (buf != NULL) {
+    pool->free_list = buf->next;
+    pool->num_free--;
+  } else {
+    buf = (struct pool_buf*) malloc(pool->buf_size);
+    if (buf == NULL) {
+      return NULL;
+    }
+  }
+
+  pool->num_out++;
+
+  return (char*) buf;
+}
+
+
+static inline void pool_put(struct buf_pool *pool, char *ptr)
+{
+  if (ptr == NULL) {
+    return;
+  }
+
+  pool->num_out--;
+
+  if (pool->num_free >= pool->max_free) {
+    free(ptr);
+    return;
+  }
+
+  struct pool_buf *buf = (struct pool_buf*) ptr;
+  buf->next = pool->free_list;
+  pool->free_list = buf;
+  pool->num_free++;
+}
+
+
+static inline void pool_destroy(struct buf_pool *pool)
+{
+  while (pool->free_list != NULL) {
+    struct pool_buf *buf = pool->free_list;
+    pool->free_list = buf->next;
+    free(buf);
+  }
+
+  pool->num_free = 0;
+}
+
+#endif // POOL_H
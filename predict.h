@@ -0,0 +1,394 @@
+#ifndef PREDICT_H
+#define PREDICT_H
+
+#include <stdint.h>
+
+#include "term.h"
+
+// Local echo for synchronized ttys. The client guesses what a keystroke
+// will do to the screen and shows that right away, underlined, instead
+// of waiting a round trip for the server's next screen. Each guess is
+// checked against the screens the server sends: once the cell shows
+// the predicted character the guess was right and is dropped, and once
+// the server says it has had the keystroke for a while and the cell
+// still shows something else it was wrong, and all guesses are dropped.
+//
+// For the latter the server tells in every SCREEN_MSG how many bytes of
+// stdin have been written to the tty at least PREDICT_ECHO_MS ago; a
+// program that echoes is expected to have done so by then.
+//
+// Only printable ASCII typed on one line and backspacing over it is
+// predicted. Anything else, like a newline or an escape sequence,
+// leaves the cursor somewhere unknown, and nothing more is predicted
+// until the server's screen has caught up with it. Guesses are made in
+// epochs: a new one starts with every such keystroke and every wrong
+// guess, and its guesses are only shown once one of them has turned
+// out right. Typing at a password prompt thus shows nothing.
+//
+// Guesses are only shown while the smoothed time it takes the server
+// to echo is above PREDICT_SHOW_MS, so a fast link never shows any.
+
+#define PREDICT_ECHO_MS 50
+#define PREDICT_SHOW_MS 30
+#define PREDICT_HIDE_MS 20
+
+#define PREDICT_MAX 256
+#define PREDICT_ECHO_LOG 16
+
+// Server side: when bytes of stdin were written to the tty.
+struct echo_mark
+{
+  uint32_t offset;
+  int64_t time;
+};
+
+struct echo_log
+{
+  struct echo_mark marks[PREDICT_ECHO_LOG];
+  int start;
+  int count;
+  uint32_t written;
+  uint32_t acked;
+  uint32_t sent;
+};
+
+// Client side. A guess with a negative row was typed while the cursor
+// was lost; it is placed once the server's screen has caught up.
+struct prediction
+{
+  int row;
+  int col;
+  char ch;
+  bool was_there;
+  uint32_t offset;
+  int epoch;
+  int64_t time;
+};
+
+struct predictor
+{
+  struct prediction guesses[PREDICT_MAX];
+  int count;
+
+  // Where the next character goes, unless the cursor is lost until the
+  // server has acked 'lost_until' bytes of stdin.
+  int row;
+  int col;
+  bool lost;
+  uint32_t lost_until;
+
+  uint32_t sent;
+  uint32_t acked;
+
+  int epoch;
+  int confirmed_epoch;
+
+  int srtt_ms;
+  bool showing;
+};
+
+
+// Whether offset 'a' of a stream is at or past 'b', allowing for the
+// counters to wrap.
+static inline bool predict_reached(uint32_t a, uint32_t b)
+{
+  return (int32_t) (a - b) >= 0;
+}
+
+
+static inline void echo_log_init(struct echo_log *log)
+{
+  log->start = 0;
+  log->count = 0;
+  log->written = 0;
+  log->acked = 0;
+  log->sent = 0;
+}
+
+
+// Records that 'n' more bytes of stdin have been written to the tty.
+// When the log is full the newest mark takes them, which only delays
+// its ack a little.
+static inline void echo_log_written(struct echo_log *log, size_t n, int64_t now)
+{
+  log->written += (uint32_t) n;
+
+  if (log->count == PREDICT_ECHO_LOG) {
+    int last = (log->start + log->count - 1) % PREDICT_ECHO_LOG;
+    log->marks[last].offset = log->written;
+    log->marks[last].time = now;
+    return;
+  }
+
+  struct echo_mark *mark =
+    &log->marks[(log->start + log->count) % PREDICT_ECHO_LOG];
+  mark->offset = log->written;
+  mark->time = now;
+  log->count++;
+}
+
+
+// Advances the ack past marks old enough. Returns when the next one
+// will be, or 0 if there is none.
+static inline int64_t echo_log_expire(struct echo_log *log, int64_t now)
+{
+  while (log->count > 0) {
+    struct echo_mark *mark = &log->marks[log->start];
+    if (mark->time + PREDICT_ECHO_MS > now) {
+      return mark->time + PREDICT_ECHO_MS;
+    }
+
+    log->acked = mark->offset;
+    log->start = (log->start + 1) % PREDICT_ECHO_LOG;
+    log->count--;
+  }
+
+  return 0;
+}
+
+
+static inline void predictor_init(struct predictor *p)
+{
+  p->count = 0;
+  p->row = 0;
+  p->col = 0;
+  p->lost = true;
+  p->lost_until = 0;
+  p->sent = 0;
+  p->acked = 0;
+  p->epoch = 0;
+  p->confirmed_epoch = -1;
+  p->srtt_ms = 0;
+  p->showing = false;
+}
+
+
+// Forgets where the cursor is, until the server has seen all of stdin
+// so far, and starts a new epoch.
+static inline void predictor_lose(struct predictor *p)
+{
+  p->lost = true;
+  p->lost_until = p->sent;
+  p->epoch++;
+}
+
+
+// Drops every guess.
+static inline void predictor_reset(struct predictor *p)
+{
+  p->count = 0;
+  predictor_lose(p);
+}
+
+
+static inline void predictor_guess(
+    struct predictor *p,
+    struct term_screen *screen,
+    struct prediction *guess)
+{
+  guess->row = p->row;
+  guess->col = p->col++;
+  guess->was_there =
+    term_cell_at(screen, guess->row, guess->col)->ch == (uint32_t) guess->ch;
+}
+
+
+// Whether the next character may be guessed at the cursor: not in the
+// last column, where it may wrap, nor over double width characters.
+static inline bool predictor_fits(
+    struct predictor *p,
+    struct term_screen *screen)
+{
+  return p->row < screen->rows &&
+         p->col < screen->cols - 1 &&
+         term_cell_at(screen, p->row, p->col)->ch != 0 &&
+         term_cell_at(screen, p->row, p->col + 1)->ch != 0;
+}
+
+
+// Called with stdin before it is sent to the server.
+static inline void predictor_input(
+    struct predictor *p,
+    struct term_screen *screen,
+    const char *buf,
+    size_t count,
+    int64_t now)
+{
+  for (size_t i = 0; i < count; i++) {
+    char c = buf[i];
+    p->sent++;
+
+    // With nothing guessed the server's cursor is as good as any.
+    if (!p->lost && p->count == 0) {
+      p->row = screen->cursor_row;
+      p->col = screen->cursor_col;
+    }
+
+    if (c >= 0x20 && c < 0x7f && p->count < PREDICT_MAX &&
+        (p->lost || predictor_fits(p, screen))) {
+      struct prediction *guess = &p->guesses[p->count++];
+      guess->row = -1;
+      guess->ch = c;
+      guess->offset = p->sent;
+      guess->epoch = p->epoch;
+      guess->time = now;
+
+      if (!p->lost) {
+        predictor_guess(p, screen, guess);
+      }
+    } else if ((c == 0x7f || c == 0x08) && p->count > 0 &&
+               (p->guesses[p->count - 1].row < 0) == p->lost) {
+      p->count--;
+      if (!p->lost) {
+        p->col--;
+      }
+    } else {
+      predictor_lose(p);
+    }
+  }
+}
+
+
+// Finds the cursor again once the server's screen has caught up with
+// the keystroke that lost it. Guesses typed since may show already,
+// just before the cursor; the others go after it.
+static inline void predictor_place(
+    struct predictor *p,
+    struct term_screen *screen)
+{
+  p->lost = false;
+  p->row = screen->cursor_row;
+  p->col = screen->cursor_col;
+
+  int shown = p->count < p->col ? p->count : p->col;
+  for (; shown > 0; shown--) {
+    bool match = true;
+    for (int i = 0; i < shown && match; i++) {
+      match = term_cell_at(screen, p->row, p->col - shown + i)->ch ==
+              (uint32_t) p->guesses[i].ch;
+    }
+    if (match) {
+      break;
+    }
+  }
+
+  int count = p->count;
+  p->count = 0;
+
+  for (int i = shown; i < count; i++) {
+    if (!predictor_fits(p, screen)) {
+      predictor_reset(p);
+      return;
+    }
+    p->guesses[p->count] = p->guesses[i];
+    predictor_guess(p, screen, &p->guesses[p->count++]);
+  }
+}
+
+
+// Checks the guesses against a screen the server has sent, along with
+// how much of stdin it acks.
+static inline void predictor_check(
+    struct predictor *p,
+    struct term_screen *screen,
+    uint32_t acked,
+    int64_t now)
+{
+  p->acked = acked;
+
+  int kept = 0;
+  for (int i = 0; i < p->count; i++) {
+    struct prediction *guess = &p->guesses[i];
+
+    if (guess->row < 0) {
+      if (!predict_reached(acked, guess->offset)) {
+        p->guesses[kept++] = *guess;
+      }
+      continue;
+    }
+
+    if (guess->row >= screen->rows || guess->col >= screen->cols) {
+      predictor_reset(p);
+      return;
+    }
+
+    bool shows = term_cell_at(screen, guess->row, guess->col)->ch ==
+                 (uint32_t) guess->ch;
+
+    // A character that was there before proves nothing until acked.
+    if (shows && guess->was_there) {
+      if (!predict_reached(acked, guess->offset)) {
+        p->guesses[kept++] = *guess;
+      }
+      continue;
+    }
+
+    if (shows) {
+      if (guess->epoch > p->confirmed_epoch) {
+        p->confirmed_epoch = guess->epoch;
+      }
+
+      int sample = (int) (now - guess->time);
+      p->srtt_ms = p->srtt_ms == 0 ? sample : (7 * p->srtt_ms + sample) / 8;
+      continue;
+    }
+
+    if (predict_reached(acked, guess->offset)) {
+      predictor_reset(p);
+      return;
+    }
+
+    p->guesses[kept++] = *guess;
+  }
+  p->count = kept;
+
+  if (p->lost && predict_reached(acked, p->lost_until)) {
+    predictor_place(p, screen);
+  }
+
+  if (p->srtt_ms > PREDICT_SHOW_MS) {
+    p->showing = true;
+  } else if (p->srtt_ms < PREDICT_HIDE_MS) {
+    p->showing = false;
+  }
+}
+
+
+// Copies 'screen' to 'display' with the guesses that may be shown drawn
+// over it. Returns whether there were any.
+static inline bool predictor_overlay(
+    struct predictor *p,
+    struct term_screen *screen,
+    struct term_screen *display)
+{
+  if (!p->showing) {
+    return false;
+  }
+
+  bool any = false;
+  for (int i = 0; i < p->count; i++) {
+    struct prediction *guess = &p->guesses[i];
+
+    if (guess->row < 0 || guess->epoch > p->confirmed_epoch) {
+      continue;
+    }
+
+    if (!any) {
+      memcpy(display->cells, screen->cells,
+             (size_t) screen->rows * screen->cols * sizeof(struct term_cell));
+      display->cursor_visible = screen->cursor_visible;
+      any = true;
+    }
+
+    struct term_cell *cell = term_cell_at(display, guess->row, guess->col);
+    cell->ch = (uint32_t) guess->ch;
+    cell->attrs |= TERM_UNDERLINE;
+
+    display->cursor_row = guess->row;
+    display->cursor_col = guess->col + 1;
+  }
+
+  return any;
+}
+
+#endif // PREDICT_H
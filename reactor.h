@@ -0,0 +1,1020 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <poll.h>
+
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include "common.h"
+#include "uring.h"
+
+// A small event loop shared by the client and the server.
+//
+// Watches are edge-triggered: a handler is called when its fd becomes
+// ready for one of the events it is interested in, and it must keep
+// reading (or writing) until the fd returns EWOULDBLOCK before it will
+// be called again. Changing the interest of a watch with
+// reactor_update() re-arms it, so a handler that stops early (e.g. for
+// backpressure) only has to drop the event and add it back later.
+//
+// The epoll backend is the default on Linux. The poll backend is level
+// triggered under the hood, which is compatible with handlers written
+// for edge-triggered delivery as long as interest is kept accurate.
+//
+// Fds that cannot be watched (regular files, /dev/null) are treated as
+// always ready, just like select() and poll() do.
+//
+// The io_uring backend arms a multishot poll per watch, and for watches
+// added with REACTOR_RECV it also arms a multishot recv (or read) into a
+// ring of provided buffers, so data for many fds is moved by a single
+// io_uring_enter(). Handlers of such watches get their data through
+// reactor_read(), which works the same way with every backend. A watch
+// holds at most REACTOR_URING_WATCH_BUFFERS of the buffers before its
+// recv is stopped until the handler has read them, so watches whose
+// handler has stopped reading cannot starve the others.
+
+enum reactor_backend
+{
+  REACTOR_DEFAULT,
+  REACTOR_EPOLL,
+  REACTOR_POLL,
+  REACTOR_URING,
+};
+
+#define REACTOR_READ  0x1
+#define REACTOR_WRITE 0x2
+#define REACTOR_HUP   0x4
+#define REACTOR_RECV  0x8
+
+#define REACTOR_URING_ENTRIES 1024
+#define REACTOR_URING_BUFFERS 512
+#define REACTOR_URING_BUFFER_SIZE 16384
+#define REACTOR_URING_WATCH_BUFFERS 8
+
+#define REACTOR_MAX_EVENTS 256
+
+struct reactor_watch;
+
+typedef void (*reactor_handler)(struct reactor_watch *watch, int events);
+
+struct reactor_watch
+{
+  int fd;
+  int events;
+  int slot;
+  bool always_ready;
+  reactor_handler handler;
+  void *data;
+
+  // io_uring backend state.
+  bool recv_mode;
+  bool recv_socket;
+  bool recv_eof;
+  int recv_error;
+  int uring_id;
+  int uring_poll_events;
+  bool uring_recv_armed;
+  bool uring_starved;
+  unsigned uring_parity;
+  int uring_ready;
+  int pending_head;
+  int pending_tail;
+  int pending_off;
+  int pending_count;
+  bool uring_full;
+  bool uring_deferred;
+  struct reactor_watch *uring_next_deferred;
+};
+
+struct reactor
+{
+  int backend;
+  int epfd;
+  int num_watches;
+  int capacity;
+  struct pollfd *pollfds;
+  struct reactor_watch **watches;
+  int num_always_ready;
+  struct reactor_watch *ready[REACTOR_MAX_EVENTS];
+  int ready_events[REACTOR_MAX_EVENTS];
+
+#ifdef __linux__
+  struct uring uring;
+  struct reactor_watch **uring_slots;
+  unsigned *uring_gens;
+  int uring_capacity;
+  int uring_next_id;
+  int *uring_free_ids;
+  int uring_num_free;
+  int *buf_next;
+  int *buf_len;
+  int uring_num_starved;
+  bool uring_recycled;
+  struct reactor_watch *uring_deferred;
+#endif
+};
+
+
+static inline int reactor_init(struct reactor *r, int backend)
+{
+  memset(r, 0, sizeof(struct reactor));
+  r->epfd = -1;
+
+  if (backend == REACTOR_DEFAULT) {
+#ifdef __linux__
+    backend = REACTOR_EPOLL;
+#else
+    backend = REACTOR_POLL;
+#endif
+  }
+
+  r->backend = backend;
+
+#ifdef __linux__
+  r->uring.fd = -1;
+
+  if (backend == REACTOR_EPOLL) {
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd < 0) {
+      return r->epfd;
+    }
+  }
+
+  if (backend == REACTOR_URING) {
+    int result = uring_init(
+        &r->uring,
+        REACTOR_URING_ENTRIES,
+        REACTOR_URING_BUFFERS,
+        REACTOR_URING_BUFFER_SIZE);
+
+    if (result < 0) {
+      return result;
+    }
+
+    r->buf_next = (int*) malloc(REACTOR_URING_BUFFERS * sizeof(int));
+    r->buf_len = (int*) malloc(REACTOR_URING_BUFFERS * sizeof(int));
+    if (r->buf_next == NULL || r->buf_len == NULL) {
+      return -1;
+    }
+  }
+#else
+  if (backend == REACTOR_EPOLL || backend == REACTOR_URING) {
+    errno = ENOSYS;
+    return -1;
+  }
+#endif
+
+  return 0;
+}
+
+
+static inline void reactor_destroy(struct reactor *r)
+{
+  if (r->epfd >= 0) {
+    close(r->epfd);
+  }
+
+  free(r->pollfds);
+  free(r->watches);
+
+#ifdef __linux__
+  if (r->backend == REACTOR_URING) {
+    uring_destroy(&r->uring);
+  }
+
+  free(r->uring_slots);
+  free(r->uring_gens);
+  free(r->uring_free_ids);
+  free(r->buf_next);
+  free(r->buf_len);
+#endif
+
+  memset(r, 0, sizeof(struct reactor));
+  r->epfd = -1;
+}
+
+
+static inline int reactor_slot_add(struct reactor *r, struct reactor_watch *w)
+{
+  if (r->num_watches == r->capacity) {
+    int capacity = r->capacity == 0 ? 64 : r->capacity * 2;
+
+    struct pollfd *pollfds = (struct pollfd*) realloc(
+        r->pollfds, capacity * sizeof(struct pollfd));
+    if (pollfds == NULL) {
+      return -1;
+    }
+    r->pollfds = pollfds;
+
+    struct reactor_watch **watches = (struct reactor_watch**) realloc(
+        r->watches, capacity * sizeof(struct reactor_watch*));
+    if (watches == NULL) {
+      return -1;
+    }
+    r->watches = watches;
+
+    r->capacity = capacity;
+  }
+
+  w->slot = r->num_watches++;
+  r->watches[w->slot] = w;
+  r->pollfds[w->slot].fd = w->fd;
+  r->pollfds[w->slot].events = 0;
+  r->pollfds[w->slot].revents = 0;
+
+  return 0;
+}
+
+
+// A watch without interest is left out of poll() altogether, since
+// poll() would keep reporting POLLHUP/POLLERR for it regardless.
+static inline void reactor_slot_set_events(
+    struct reactor *r,
+    struct reactor_watch *w,
+    int events)
+{
+  r->pollfds[w->slot].fd = events != 0 ? w->fd : -1;
+  r->pollfds[w->slot].events =
+    ((events & REACTOR_READ) ? POLLIN : 0) |
+    ((events & REACTOR_WRITE) ? POLLOUT : 0);
+}
+
+
+static inline void reactor_slot_del(struct reactor *r, struct reactor_watch *w)
+{
+  int last = --r->num_watches;
+
+  if (w->slot != last) {
+    r->watches[w->slot] = r->watches[last];
+    r->pollfds[w->slot] = r->pollfds[last];
+    r->watches[w->slot]->slot = w->slot;
+  }
+
+  w->slot = -1;
+}
+
+
+#ifdef __linux__
+
+// user_data of io_uring requests: generation of the watch id in the high
+// 32 bits so completions of deleted watches can be told apart, then the
+// id, one parity bit to tell successive arms apart, and the kind.
+#define URING_KIND_POLL 0
+#define URING_KIND_RECV 1
+#define URING_KIND_INTERNAL 3
+
+static inline uint64_t reactor_uring_data(
+    struct reactor *r,
+    struct reactor_watch *w,
+    int kind)
+{
+  uint64_t parity = (w->uring_parity >> kind) & 1;
+
+  return ((uint64_t) r->uring_gens[w->uring_id] << 32) |
+         ((uint64_t) w->uring_id << 3) |
+         (parity << 2) |
+         kind;
+}
+
+
+static inline int reactor_uring_alloc_id(
+    struct reactor *r,
+    struct reactor_watch *w)
+{
+  int id;
+
+  if (r->uring_num_free > 0) {
+    id = r->uring_free_ids[--r->uring_num_free];
+  } else {
+    if (r->uring_next_id == r->uring_capacity) {
+      int capacity = r->uring_capacity == 0 ? 64 : r->uring_capacity * 2;
+
+      struct reactor_watch **slots = (struct reactor_watch**) realloc(
+          r->uring_slots, capacity * sizeof(struct reactor_watch*));
+      if (slots == NULL) {
+        return -1;
+      }
+      r->uring_slots = slots;
+
+      unsigned *gens = (unsigned*) realloc(
+          r->uring_gens, capacity * sizeof(unsigned));
+      if (gens == NULL) {
+        return -1;
+      }
+      r->uring_gens = gens;
+
+      int *free_ids = (int*) realloc(
+          r->uring_free_ids, capacity * sizeof(int));
+      if (free_ids == NULL) {
+        return -1;
+      }
+      r->uring_free_ids = free_ids;
+
+      for (int i = r->uring_capacity; i < capacity; i++) {
+        r->uring_gens[i] = 0;
+      }
+
+      r->uring_capacity = capacity;
+    }
+
+    id = r->uring_next_id++;
+  }
+
+  r->uring_slots[id] = w;
+  w->uring_id = id;
+
+  return 0;
+}
+
+
+static inline void reactor_uring_cancel(struct reactor *r, uint64_t target)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&r->uring);
+  if (sqe == NULL) {
+    return;
+  }
+
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->user_data = URING_KIND_INTERNAL;
+}
+
+
+// Brings the requests armed in the kernel in line with the interest of
+// the watch. Everything is only queued here; it goes out with the next
+// io_uring_enter() together with everything else.
+static inline int reactor_uring_arm(
+    struct reactor *r,
+    struct reactor_watch *w)
+{
+  int want_poll = w->events &
+    (w->recv_mode ? REACTOR_WRITE : (REACTOR_READ | REACTOR_WRITE));
+
+  bool want_recv = w->recv_mode &&
+                   (w->events & REACTOR_READ) &&
+                   !w->recv_eof &&
+                   w->recv_error == 0 &&
+                   !w->uring_starved &&
+                   !w->uring_full;
+
+  if (want_poll != w->uring_poll_events) {
+    if (w->uring_poll_events != 0) {
+      reactor_uring_cancel(r, reactor_uring_data(r, w, URING_KIND_POLL));
+    }
+
+    w->uring_poll_events = want_poll;
+
+    if (want_poll != 0) {
+      w->uring_parity ^= 1 << URING_KIND_POLL;
+
+      struct io_uring_sqe *sqe = uring_get_sqe(&r->uring);
+      if (sqe == NULL) {
+        w->uring_poll_events = 0;
+        return -1;
+      }
+
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = w->fd;
+      sqe->len = IORING_POLL_ADD_MULTI;
+      sqe->poll32_events = EPOLLRDHUP;
+      sqe->poll32_events |= (want_poll & REACTOR_READ) ? EPOLLIN : 0;
+      sqe->poll32_events |= (want_poll & REACTOR_WRITE) ? EPOLLOUT : 0;
+      sqe->user_data = reactor_uring_data(r, w, URING_KIND_POLL);
+    }
+  }
+
+  if (want_recv != w->uring_recv_armed) {
+    if (w->uring_recv_armed) {
+      reactor_uring_cancel(r, reactor_uring_data(r, w, URING_KIND_RECV));
+    }
+
+    w->uring_recv_armed = want_recv;
+
+    if (want_recv) {
+      w->uring_parity ^= 1 << URING_KIND_RECV;
+
+      struct io_uring_sqe *sqe = uring_get_sqe(&r->uring);
+      if (sqe == NULL) {
+        w->uring_recv_armed = false;
+        return -1;
+      }
+
+      if (w->recv_socket) {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+      } else {
+        sqe->opcode = URING_OP_READ_MULTISHOT;
+      }
+
+      sqe->fd = w->fd;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = URING_BUFFER_GROUP;
+      sqe->user_data = reactor_uring_data(r, w, URING_KIND_RECV);
+    }
+  }
+
+  return 0;
+}
+
+
+static inline void reactor_uring_recycle(struct reactor *r, int bid)
+{
+  uring_recycle_buffer(&r->uring, bid);
+  r->uring_recycled = true;
+}
+
+
+static inline void reactor_uring_defer(
+    struct reactor *r,
+    struct reactor_watch *w)
+{
+  if (w->uring_deferred) {
+    return;
+  }
+
+  w->uring_deferred = true;
+  w->uring_next_deferred = r->uring_deferred;
+  r->uring_deferred = w;
+}
+
+
+static inline void reactor_uring_undefer(
+    struct reactor *r,
+    struct reactor_watch *w)
+{
+  if (!w->uring_deferred) {
+    return;
+  }
+
+  struct reactor_watch **link = &r->uring_deferred;
+  while (*link != w) {
+    link = &(*link)->uring_next_deferred;
+  }
+  *link = w->uring_next_deferred;
+
+  w->uring_deferred = false;
+  w->uring_next_deferred = NULL;
+}
+
+
+static inline int reactor_uring_queue(
+    struct reactor *r,
+    int n,
+    struct reactor_watch *w,
+    int events)
+{
+  if (w->uring_ready >= 0) {
+    r->ready_events[w->uring_ready] |= events;
+    return n;
+  }
+
+  w->uring_ready = n;
+  r->ready[n] = w;
+  r->ready_events[n] = events;
+
+  return n + 1;
+}
+
+
+// Turns completions into ready events, at most one per watch.
+static inline int reactor_uring_reap(struct reactor *r, int n)
+{
+  struct io_uring_cqe *cqe;
+
+  while (n < REACTOR_MAX_EVENTS &&
+         (cqe = uring_peek_cqe(&r->uring)) != NULL) {
+    uint64_t user_data = cqe->user_data;
+    int res = cqe->res;
+    unsigned flags = cqe->flags;
+
+    uring_cqe_seen(&r->uring);
+
+    int kind = user_data & 3;
+    if (kind == URING_KIND_INTERNAL) {
+      continue;
+    }
+
+    unsigned parity = (user_data >> 2) & 1;
+    int id = (int) ((user_data >> 3) & 0x1fffffff);
+    unsigned gen = (unsigned) (user_data >> 32);
+
+    struct reactor_watch *w = NULL;
+    if (id < r->uring_capacity && r->uring_gens[id] == gen) {
+      w = r->uring_slots[id];
+    }
+
+    int events = 0;
+
+    if (kind == URING_KIND_RECV) {
+      if (flags & IORING_CQE_F_BUFFER) {
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (w != NULL && res > 0) {
+          r->buf_len[bid] = res;
+          r->buf_next[bid] = -1;
+          if (w->pending_tail >= 0) {
+            r->buf_next[w->pending_tail] = bid;
+          } else {
+            w->pending_head = bid;
+          }
+          w->pending_tail = bid;
+
+          if (++w->pending_count >= REACTOR_URING_WATCH_BUFFERS &&
+              !w->uring_full) {
+            w->uring_full = true;
+            reactor_uring_arm(r, w);
+          }
+        } else {
+          reactor_uring_recycle(r, bid);
+        }
+      }
+
+      if (w == NULL) {
+        continue;
+      }
+
+      bool current = parity == ((w->uring_parity >> URING_KIND_RECV) & 1);
+
+      if (!(flags & IORING_CQE_F_MORE) && current) {
+        w->uring_recv_armed = false;
+
+        if (res == 0) {
+          w->recv_eof = true;
+        } else if (res == -ENOBUFS) {
+          w->uring_starved = true;
+          r->uring_num_starved++;
+        } else if (res < 0 && res != -ECANCELED) {
+          w->recv_error = -res;
+        } else if (res > 0) {
+          reactor_uring_arm(r, w);
+        }
+      }
+
+      if (res > 0 || w->recv_eof || w->recv_error != 0) {
+        events = REACTOR_READ;
+        events |= (w->recv_eof || w->recv_error != 0) ? REACTOR_HUP : 0;
+      }
+    } else {
+      if (w == NULL) {
+        continue;
+      }
+
+      bool current = parity == ((w->uring_parity >> URING_KIND_POLL) & 1);
+
+      if (!(flags & IORING_CQE_F_MORE) && current) {
+        w->uring_poll_events = 0;
+        if (res != -ECANCELED) {
+          reactor_uring_arm(r, w);
+        }
+      }
+
+      if (res > 0) {
+        events |= (res & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) ?
+          REACTOR_READ : 0;
+        events |= (res & (EPOLLOUT | EPOLLERR)) ? REACTOR_WRITE : 0;
+        events |= (res & (EPOLLHUP | EPOLLERR)) ? REACTOR_HUP : 0;
+      } else if (res < 0 && res != -ECANCELED) {
+        events = REACTOR_READ | REACTOR_WRITE | REACTOR_HUP;
+      }
+    }
+
+    if (events != 0) {
+      n = reactor_uring_queue(r, n, w, events);
+    }
+  }
+
+  return n;
+}
+
+
+static inline int reactor_uring_run(struct reactor *r, int timeout_ms)
+{
+  int n = 0;
+
+  while (r->uring_deferred != NULL && n < REACTOR_MAX_EVENTS) {
+    struct reactor_watch *w = r->uring_deferred;
+    reactor_uring_undefer(r, w);
+    n = reactor_uring_queue(r, n, w, REACTOR_READ);
+  }
+
+  // Watches that ran out of provided buffers are re-armed once some
+  // buffer has been handed back.
+  if (r->uring_num_starved > 0 && r->uring_recycled) {
+    for (int id = 0; id < r->uring_next_id; id++) {
+      struct reactor_watch *w = r->uring_slots[id];
+      if (w != NULL && w->uring_starved) {
+        w->uring_starved = false;
+        r->uring_num_starved--;
+        reactor_uring_arm(r, w);
+      }
+    }
+  }
+
+  r->uring_recycled = false;
+
+  bool wait = n == 0 && uring_peek_cqe(&r->uring) == NULL;
+
+  if (uring_submit(&r->uring, wait, timeout_ms) < 0) {
+    return -1;
+  }
+
+  return reactor_uring_reap(r, n);
+}
+
+#endif // __linux__
+
+
+
+// Starts watching fd for events (REACTOR_READ and/or REACTOR_WRITE).
+// With REACTOR_RECV, backends that can do so read on the handler's
+// behalf; the handler must then use reactor_read() for this watch.
+static inline int reactor_add(
+    struct reactor *r,
+    struct reactor_watch *w,
+    int fd,
+    int events,
+    reactor_handler handler,
+    void *data)
+{
+  int add_events = events;
+
+  w->fd = fd;
+  w->events = events & (REACTOR_READ | REACTOR_WRITE);
+  w->slot = -1;
+  w->always_ready = false;
+  w->handler = handler;
+  w->data = data;
+  w->recv_mode = false;
+  w->recv_socket = false;
+  w->recv_eof = false;
+  w->recv_error = 0;
+  w->uring_id = -1;
+  w->uring_poll_events = 0;
+  w->uring_recv_armed = false;
+  w->uring_starved = false;
+  w->uring_parity = 0;
+  w->uring_ready = -1;
+  w->pending_head = -1;
+  w->pending_tail = -1;
+  w->pending_off = 0;
+  w->pending_count = 0;
+  w->uring_full = false;
+  w->uring_deferred = false;
+  w->uring_next_deferred = NULL;
+
+  events = w->events;
+
+#ifdef __linux__
+  if (r->backend == REACTOR_URING) {
+    if (reactor_uring_alloc_id(r, w) < 0) {
+      w->fd = -1;
+      return -1;
+    }
+
+    struct stat st;
+    if ((add_events & REACTOR_RECV) && fstat(fd, &st) == 0) {
+      w->recv_socket = S_ISSOCK(st.st_mode);
+      w->recv_mode = w->recv_socket ||
+        (r->uring.read_multishot &&
+         (S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode)));
+    }
+
+    return reactor_uring_arm(r, w);
+  }
+#endif
+
+#ifdef __linux__
+  if (r->backend == REACTOR_EPOLL) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLET | EPOLLRDHUP;
+    event.events |= (events & REACTOR_READ) ? EPOLLIN : 0;
+    event.events |= (events & REACTOR_WRITE) ? EPOLLOUT : 0;
+    event.data.ptr = w;
+
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &event) == 0) {
+      return 0;
+    }
+
+    if (errno != EPERM) {
+      w->fd = -1;
+      return -1;
+    }
+  }
+#endif
+
+  if (r->backend == REACTOR_POLL || r->backend == REACTOR_EPOLL) {
+    if (reactor_slot_add(r, w) < 0) {
+      w->fd = -1;
+      return -1;
+    }
+
+    reactor_slot_set_events(r, w, events);
+  }
+
+  if (r->backend == REACTOR_EPOLL) {
+    w->always_ready = true;
+    r->num_always_ready++;
+  }
+
+  return 0;
+}
+
+
+static inline int reactor_update(
+    struct reactor *r,
+    struct reactor_watch *w,
+    int events)
+{
+  if (w->fd < 0 || w->events == events) {
+    return 0;
+  }
+
+  bool add_read = (events & REACTOR_READ) && !(w->events & REACTOR_READ);
+
+  w->events = events;
+
+#ifdef __linux__
+  if (r->backend == REACTOR_URING) {
+    if (add_read &&
+        (w->pending_head >= 0 || w->recv_eof || w->recv_error != 0)) {
+      reactor_uring_defer(r, w);
+    }
+
+    return reactor_uring_arm(r, w);
+  }
+#endif
+
+  if (w->slot >= 0) {
+    reactor_slot_set_events(r, w, events);
+  }
+
+#ifdef __linux__
+  if (r->backend == REACTOR_EPOLL && !w->always_ready) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLET | EPOLLRDHUP;
+    event.events |= (events & REACTOR_READ) ? EPOLLIN : 0;
+    event.events |= (events & REACTOR_WRITE) ? EPOLLOUT : 0;
+    event.data.ptr = w;
+
+    return epoll_ctl(r->epfd, EPOLL_CTL_MOD, w->fd, &event);
+  }
+#endif
+
+  return 0;
+}
+
+
+// Removes a watch. The memory of the watch must stay valid until the
+// current reactor_run_once() returns, since its events may still be
+// pending in this batch; they are skipped once the fd is cleared.
+static inline int reactor_del(struct reactor *r, struct reactor_watch *w)
+{
+  if (w->fd < 0) {
+    return 0;
+  }
+
+  int result = 0;
+
+#ifdef __linux__
+  if (r->backend == REACTOR_EPOLL && !w->always_ready) {
+    result = epoll_ctl(r->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+  }
+#endif
+
+#ifdef __linux__
+  if (r->backend == REACTOR_URING) {
+    if (w->uring_poll_events != 0) {
+      reactor_uring_cancel(r, reactor_uring_data(r, w, URING_KIND_POLL));
+    }
+    if (w->uring_recv_armed) {
+      reactor_uring_cancel(r, reactor_uring_data(r, w, URING_KIND_RECV));
+    }
+    if (w->uring_starved) {
+      r->uring_num_starved--;
+    }
+
+    while (w->pending_head >= 0) {
+      int bid = w->pending_head;
+      w->pending_head = r->buf_next[bid];
+      reactor_uring_recycle(r, bid);
+    }
+    w->pending_count = 0;
+    w->uring_full = false;
+
+    reactor_uring_undefer(r, w);
+
+    r->uring_slots[w->uring_id] = NULL;
+    r->uring_gens[w->uring_id]++;
+    r->uring_free_ids[r->uring_num_free++] = w->uring_id;
+    w->uring_id = -1;
+  }
+#endif
+
+  if (w->slot >= 0) {
+    reactor_slot_del(r, w);
+  }
+
+  if (w->always_ready) {
+    r->num_always_ready--;
+    w->always_ready = false;
+  }
+
+  w->fd = -1;
+  w->events = 0;
+
+  return result;
+}
+
+
+static inline int reactor_poll_fds(struct reactor *r, int timeout_ms)
+{
+  int result = poll(r->pollfds, r->num_watches, timeout_ms);
+  if (result < 0) {
+    return result;
+  }
+
+  int n = 0;
+  for (int i = 0; i < r->num_watches && n < REACTOR_MAX_EVENTS; i++) {
+    struct reactor_watch *w = r->watches[i];
+    int revents = r->pollfds[i].revents;
+
+    if (revents == 0) {
+      continue;
+    }
+
+    int events = 0;
+    events |= (revents & (POLLIN | POLLHUP | POLLERR)) ? REACTOR_READ : 0;
+    events |= (revents & (POLLOUT | POLLERR)) ? REACTOR_WRITE : 0;
+    events |= (revents & (POLLHUP | POLLERR)) ? REACTOR_HUP : 0;
+
+    r->ready[n] = w;
+    r->ready_events[n++] = events;
+  }
+
+  return n;
+}
+
+
+// Waits up to timeout_ms (-1 for forever) and dispatches every ready
+// watch to its handler. Returns the number of events dispatched.
+static inline int reactor_run_once(struct reactor *r, int timeout_ms)
+{
+  int n = 0;
+
+#ifdef __linux__
+  if (r->backend == REACTOR_EPOLL) {
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    // Always ready fds only keep the loop spinning while something is
+    // interested in them.
+    int wait_ms = timeout_ms;
+    for (int i = 0; i < r->num_watches && r->num_always_ready > 0; i++) {
+      if (r->watches[i]->events != 0) {
+        wait_ms = 0;
+        break;
+      }
+    }
+    int result = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, wait_ms);
+    if (result < 0) {
+      return result;
+    }
+
+    for (int i = 0; i < result; i++) {
+      int ev = 0;
+      ev |= (events[i].events &
+             (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) ? REACTOR_READ : 0;
+      ev |= (events[i].events & (EPOLLOUT | EPOLLERR)) ? REACTOR_WRITE : 0;
+      ev |= (events[i].events & (EPOLLHUP | EPOLLERR)) ? REACTOR_HUP : 0;
+
+      r->ready[n] = (struct reactor_watch*) events[i].data.ptr;
+      r->ready_events[n++] = ev;
+    }
+
+    // Always ready fds live in the poll table and are reported with
+    // whatever interest they currently have.
+    for (int i = 0; i < r->num_watches && n < REACTOR_MAX_EVENTS; i++) {
+      if (r->watches[i]->events != 0) {
+        r->ready[n] = r->watches[i];
+        r->ready_events[n++] = r->watches[i]->events;
+      }
+    }
+  }
+#endif
+
+#ifdef __linux__
+  if (r->backend == REACTOR_URING) {
+    n = reactor_uring_run(r, timeout_ms);
+    if (n < 0) {
+      return n;
+    }
+  }
+#endif
+
+  if (r->backend == REACTOR_POLL) {
+    n = reactor_poll_fds(r, timeout_ms);
+    if (n < 0) {
+      return n;
+    }
+  }
+
+  for (int i = 0; i < n; i++) {
+    struct reactor_watch *w = r->ready[i];
+    int events = r->ready_events[i];
+
+    w->uring_ready = -1;
+
+    if (w->fd < 0) {
+      continue;
+    }
+
+    events &= w->events | REACTOR_HUP;
+    if ((events & ~REACTOR_HUP) == 0) {
+      continue;
+    }
+
+    w->handler(w, events);
+  }
+
+  return n;
+}
+
+// Whether io_uring has received data for the watch that reactor_read()
+// has not handed out yet. Such data is lost with the watch.
+static inline bool reactor_buffered(struct reactor_watch *w)
+{
+  return w->recv_mode && w->pending_head >= 0;
+}
+
+
+// Reads up to count bytes for a watch, with the semantics of read_all():
+// returns the number of bytes read, 0 on EOF, or -1 with errno set,
+// EWOULDBLOCK once everything available has been consumed.
+static inline int reactor_read(
+    struct reactor *r,
+    struct reactor_watch *w,
+    char *buf,
+    size_t count)
+{
+  if (!w->recv_mode) {
+    return read_all(w->fd, buf, count);
+  }
+
+#ifdef __linux__
+  size_t copied = 0;
+
+  while (copied < count && w->pending_head >= 0) {
+    int bid = w->pending_head;
+    size_t available = r->buf_len[bid] - w->pending_off;
+    size_t length = count - copied < available ? count - copied : available;
+
+    memcpy(buf + copied, uring_buffer(&r->uring, bid) + w->pending_off,
+           length);
+
+    copied += length;
+    w->pending_off += length;
+
+    if (w->pending_off == r->buf_len[bid]) {
+      w->pending_head = r->buf_next[bid];
+      if (w->pending_head < 0) {
+        w->pending_tail = -1;
+      }
+      w->pending_off = 0;
+      w->pending_count--;
+      reactor_uring_recycle(r, bid);
+    }
+  }
+
+  if (w->uring_full && w->pending_head < 0) {
+    w->uring_full = false;
+    reactor_uring_arm(r, w);
+  }
+
+  if (copied > 0) {
+    return copied;
+  }
+
+  if (w->recv_error != 0) {
+    if (w->recv_error == EIO && isatty(w->fd)) {
+      return 0;
+    }
+    errno = w->recv_error;
+    return -1;
+  }
+
+  if (w->recv_eof) {
+    return 0;
+  }
+#endif
+
+  errno = EWOULDBLOCK;
+  return -1;
+}
+
+#endif // REACTOR_H
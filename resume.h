@@ -0,0 +1,186 @@
+#ifndef RESUME_H
+#define RESUME_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Resumable sessions. Each side numbers the bytes of the frames it
+// sends over a session, from 0 on, and keeps them in a resume_log until
+// the peer acks them with an ACK_MSG. Should the connection break, the
+// client connects again and sends the session's token along with how
+// much it has received; the server answers with how much it has
+// received, and each side sends again what the other is missing. Only
+// whole frames count as received, so this always starts at a frame.
+//
+// A log is a ring of fixed size, allocated along with the session; that
+// is all a resumable session costs beyond an ordinary one. A side stops
+// writing while its log is full, and the peer acks every quarter of it
+// (the handshake tells how big it is), so that it rarely is. On the
+// wire offsets are sent as their low 32 bits, which is unambiguous as
+// long as a log is smaller than 2GB.
+
+#define RESUME_TOKEN_SIZE 16
+#define RESUME_DEFAULT_SIZE (1024 * 1024)
+#define RESUME_MIN_SIZE (64 * 1024)
+#define RESUME_MAX_SIZE (1024 * 1024 * 1024)
+
+// How long a server keeps a session whose client has gone, and a
+// client keeps trying to get back to it, in seconds.
+#define RESUME_DEFAULT_TIMEOUT 300
+
+struct resume_log
+{
+  char *buf;
+  size_t size;
+
+  // Everything before 'start' has been acked, 'end' is how much has
+  // been sent and 'resend' how much of that has been sent over the
+  // current connection.
+  uint64_t start;
+  uint64_t end;
+  uint64_t resend;
+
+  // How much of the peer's frames have been received, and acked.
+  uint64_t received;
+  uint64_t acked;
+  size_t peer_size;
+
+  // Set by the client once writing to the connection has failed.
+  bool broken;
+};
+
+
+static inline int resume_log_init(struct resume_log *log, size_t size)
+{
+  memset(log, 0, sizeof(struct resume_log));
+
+  log->buf = (char*) malloc(size);
+  if (log->buf == NULL) {
+    return -1;
+  }
+
+  log->size = size;
+  return 0;
+}
+
+
+static inline void resume_log_destroy(struct resume_log *log)
+{
+  free(log->buf);
+  log->buf = NULL;
+}
+
+
+static inline size_t resume_log_room(struct resume_log *log)
+{
+  return log->size - (size_t) (log->end - log->start);
+}
+
+
+// Whether bytes sent over an earlier connection still have to be sent
+// again.
+static inline bool resume_log_resending(struct resume_log *log)
+{
+  return log->resend != log->end;
+}
+
+
+// The offset that the low 32 bits 'wire' stand for, taken to be at most
+// 'end'.
+static inline uint64_t resume_log_offset(struct resume_log *log, uint32_t wire)
+{
+  return log->end - (uint32_t) ((uint32_t) log->end - wire);
+}
+
+
+// Counts 'count' bytes more as sent, which have been put at the end of
+// the ring already.
+static inline void resume_log_commit(struct resume_log *log, size_t count)
+{
+  bool current = !resume_log_resending(log);
+
+  log->end += count;
+  if (current) {
+    log->resend = log->end;
+  }
+}
+
+
+// Keeps 'count' bytes that are sent; there must be room for them.
+static inline void resume_log_append(
+    struct resume_log *log,
+    const char *buf,
+    size_t count)
+{
+  size_t pos = (size_t) (log->end % log->size);
+  size_t first = count < log->size - pos ? count : log->size - pos;
+
+  memcpy(log->buf + pos, buf, first);
+  memcpy(log->buf, buf + first, count - first);
+  resume_log_commit(log, count);
+}
+
+
+// Drops what the peer acks.
+static inline void resume_log_ack(struct resume_log *log, uint32_t wire)
+{
+  uint64_t offset = resume_log_offset(log, wire);
+
+  if (offset > log->start) {
+    log->start = offset;
+  }
+}
+
+
+// Starts sending again from what the peer says it has received over
+// the last connection. Returns -1 if that is no longer kept.
+static inline int resume_log_rewind(struct resume_log *log, uint32_t wire)
+{
+  uint64_t offset = resume_log_offset(log, wire);
+
+  if (offset < log->start) {
+    return -1;
+  }
+
+  log->start = offset;
+  log->resend = offset;
+  return 0;
+}
+
+
+// Points '*data' at the next bytes to send again and returns how many
+// follow in one piece; resume_log_resent() moves past them.
+static inline size_t resume_log_pending(struct resume_log *log, char **data)
+{
+  size_t pos = (size_t) (log->resend % log->size);
+  size_t left = (size_t) (log->end - log->resend);
+
+  *data = log->buf + pos;
+  return left < log->size - pos ? left : log->size - pos;
+}
+
+
+static inline void resume_log_resent(struct resume_log *log, size_t count)
+{
+  log->resend += count;
+}
+
+
+// Counts a frame of 'size' bytes received from the peer. Returns
+// whether it is time to ack.
+static inline bool resume_log_received(struct resume_log *log, size_t size)
+{
+  log->received += size;
+  return log->received - log->acked >= log->peer_size / 4;
+}
+
+
+// Returns what to ack, as sent on the wire, and notes it as acked.
+static inline uint32_t resume_log_acking(struct resume_log *log)
+{
+  log->acked = log->received;
+  return (uint32_t) log->received;
+}
+
+#endif // RESUME_H
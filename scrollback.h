@@ -0,0 +1,124 @@
+#ifndef SCROLLBACK_H
+#define SCROLLBACK_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/uio.h>
+
+// The tail of a tty's output, for clients that attach to it later or
+// fall behind. The tty is read straight into a ring of one power of two
+// sized block while nobody watches, so the child never waits for
+// anybody; whatever no longer fits pushes out the oldest output.
+
+#define SCROLLBACK_DEFAULT_SIZE (64 * 1024)
+#define SCROLLBACK_MIN_SIZE 4096
+
+struct scrollback
+{
+  char *buf;
+  size_t size;
+
+  // How much has been written in all.
+  uint64_t end;
+};
+
+
+// 'size' must be a power of two.
+static inline int scrollback_init(struct scrollback *sb, size_t size)
+{
+  sb->buf = (char*) malloc(size);
+  if (sb->buf == NULL) {
+    return -1;
+  }
+
+  sb->size = size;
+  sb->end = 0;
+  return 0;
+}
+
+
+static inline void scrollback_destroy(struct scrollback *sb)
+{
+  free(sb->buf);
+  sb->buf = NULL;
+  sb->size = 0;
+  sb->end = 0;
+}
+
+
+// Points '*space' at where the next output goes and returns how much
+// may be put there in one piece; scrollback_commit() keeps it.
+static inline size_t scrollback_space(struct scrollback *sb, char **space)
+{
+  size_t pos = (size_t) sb->end & (sb->size - 1);
+
+  *space = sb->buf + pos;
+  return sb->size - pos;
+}
+
+
+static inline void scrollback_commit(struct scrollback *sb, size_t count)
+{
+  sb->end += count;
+}
+
+
+static inline void scrollback_append(
+    struct scrollback *sb,
+    const char *buf,
+    size_t count)
+{
+  while (count > 0) {
+    char *space;
+    size_t size = scrollback_space(sb, &space);
+    if (size > count) {
+      size = count;
+    }
+
+    memcpy(space, buf, size);
+    scrollback_commit(sb, size);
+    buf += size;
+    count -= size;
+  }
+}
+
+
+// Fills 'iov' with what is kept from offset 'from' on, oldest first,
+// and returns how many of its two entries are used. If some of that
+// has been pushed out already the rest likely starts in the middle of a
+// line or an escape sequence, so it starts after the first newline
+// instead.
+static inline int scrollback_tail(
+    struct scrollback *sb,
+    uint64_t from,
+    struct iovec iov[2])
+{
+  uint64_t first_kept = sb->end > sb->size ? sb->end - sb->size : 0;
+  size_t count = (size_t) (sb->end - (from > first_kept ? from : first_kept));
+  size_t start = (size_t) (sb->end - count) & (sb->size - 1);
+
+  if (from < first_kept) {
+    size_t skip = 0;
+    while (skip < count && sb->buf[(start + skip) & (sb->size - 1)] != '\n') {
+      skip++;
+    }
+    if (skip < count) {
+      skip++;
+    }
+    start = (start + skip) & (sb->size - 1);
+    count -= skip;
+  }
+
+  size_t first = count < sb->size - start ? count : sb->size - start;
+
+  iov[0].iov_base = sb->buf + start;
+  iov[0].iov_len = first;
+  iov[1].iov_base = sb->buf;
+  iov[1].iov_len = count - first;
+
+  return count - first > 0 ? 2 : 1;
+}
+
+#endif // SCROLLBACK_H
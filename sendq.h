@@ -0,0 +1,401 @@
+#ifndef SENDQ_H
+#define SENDQ_H
+
+#include <stdint.h>
+
+#include "msgs.h"
+#include "outq.h"
+#include "resume.h"
+
+// Frames waiting to be written to a connection, in two classes: urgent
+// ones (credit, exit status, small interactive output) and bulk ones.
+// Frames go out whole and one class at a time, so whenever a frame is
+// finished any urgent frames queued meanwhile are written before the
+// next bulk frame starts. An urgent frame thus waits for at most the
+// rest of one bulk frame (MSG_MAX_IO_SIZE) instead of everything queued
+// ahead of it.
+//
+// Frames of one stream must stay in order, so the sender only makes a
+// frame urgent while none of its earlier frames are still queued as
+// bulk; send_queue_bulk_mark() and send_queue_bulk_pending() tell.
+//
+// A queue of a resumable session has a resume log: everything written
+// to the fd is kept in it, nothing is written while it is full, and
+// after a reconnect what the peer is missing goes out before anything
+// else.
+//
+// The answer to the frame a connection starts with is not part of the
+// session, so it is kept aside as the queue's hello: it goes out ahead
+// of everything else, resent output included, and is never logged.
+
+#define SEND_URGENT 0
+#define SEND_BULK 1
+#define SEND_NUM_CLASSES 2
+
+// Output at most this large may overtake bulk output.
+#define SEND_INTERACTIVE_MAX 512
+
+// How much one write takes from a class at most.
+#define SEND_MAX_FRAMES 64
+#define SEND_BURST (64 * 1024)
+
+struct send_queue
+{
+  struct out_queue classes[SEND_NUM_CLASSES];
+  int current;
+  size_t frame_left;
+  uint64_t bulk_queued;
+  uint64_t bulk_written;
+  struct resume_log *log;
+  char hello[sizeof(struct msg_wrapper)];
+  size_t hello_size;
+  size_t hello_sent;
+};
+
+
+static inline void send_queue_init(struct send_queue *q, struct buf_pool *pool)
+{
+  for (int i = 0; i < SEND_NUM_CLASSES; i++) {
+    out_queue_init(&q->classes[i], pool);
+  }
+
+  q->current = -1;
+  q->frame_left = 0;
+  q->bulk_queued = 0;
+  q->bulk_written = 0;
+  q->log = NULL;
+  q->hello_size = 0;
+  q->hello_sent = 0;
+}
+
+
+// Has the queue take its buffers from 'pool' from now on. The buffers
+// it already holds stay queued and go back to 'pool' once sent, which
+// pool.h allows since they are of the same size.
+static inline void send_queue_set_pool(
+    struct send_queue *q,
+    struct buf_pool *pool)
+{
+  for (int i = 0; i < SEND_NUM_CLASSES; i++) {
+    assert(q->classes[i].pool->buf_size == pool->buf_size);
+    q->classes[i].pool = pool;
+  }
+}
+
+
+static inline bool send_queue_empty(struct send_queue *q)
+{
+  if (q->hello_sent < q->hello_size) {
+    return false;
+  }
+
+  if (q->log != NULL && resume_log_resending(q->log)) {
+    return false;
+  }
+
+  for (int i = 0; i < SEND_NUM_CLASSES; i++) {
+    if (!out_queue_empty(&q->classes[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+static inline void send_queue_clear(struct send_queue *q)
+{
+  for (int i = 0; i < SEND_NUM_CLASSES; i++) {
+    out_queue_clear(&q->classes[i]);
+  }
+
+  q->current = -1;
+  q->frame_left = 0;
+  q->bulk_written = q->bulk_queued;
+  q->hello_size = 0;
+  q->hello_sent = 0;
+}
+
+
+// Queues the hello for the connection, replacing any left over from a
+// previous one. Use size 0 to drop it.
+static inline void send_queue_hello(
+    struct send_queue *q,
+    const char *buf,
+    size_t size)
+{
+  assert(size <= sizeof(q->hello));
+
+  if (size > 0) {
+    memcpy(q->hello, buf, size);
+  }
+  q->hello_size = size;
+  q->hello_sent = 0;
+}
+
+
+// Whether nothing can be written before the peer acks some of the log.
+static inline bool send_queue_blocked(struct send_queue *q)
+{
+  return q->log != NULL &&
+         q->hello_sent == q->hello_size &&
+         !resume_log_resending(q->log) &&
+         resume_log_room(q->log) == 0;
+}
+
+
+// How much may be written to the fd at most.
+static inline size_t send_queue_room(struct send_queue *q)
+{
+  return q->log != NULL ? resume_log_room(q->log) : SIZE_MAX;
+}
+
+
+// The position just past all bulk bytes queued so far.
+static inline uint64_t send_queue_bulk_mark(struct send_queue *q)
+{
+  return q->bulk_queued;
+}
+
+
+// Whether bytes queued as bulk before 'mark' are still waiting.
+static inline bool send_queue_bulk_pending(struct send_queue *q, uint64_t mark)
+{
+  return mark > q->bulk_written;
+}
+
+
+// Records that 'sent' bytes of a frame of 'size' bytes in class 'cls'
+// were written to the fd directly; the rest of it must be appended
+// with send_queue_append() before anything else is queued. Not for
+// queues with a log.
+static inline void send_queue_wrote(
+    struct send_queue *q,
+    int cls,
+    size_t size,
+    size_t sent)
+{
+  if (cls == SEND_BULK) {
+    q->bulk_queued += size;
+    q->bulk_written += sent;
+  }
+
+  if (sent < size) {
+    q->current = cls;
+    q->frame_left = size - sent;
+  }
+}
+
+
+static inline int send_queue_append(
+    struct send_queue *q,
+    int cls,
+    const char *buf,
+    size_t count)
+{
+  return out_queue_append(&q->classes[cls], buf, count);
+}
+
+
+// Writes whole frames from 'buf' to the fd directly if nothing is
+// queued and queues whatever it does not take in class 'cls'; without
+// an fd (-1) everything is queued. Returns the number of bytes written
+// to the fd or -1 with errno set.
+static inline ssize_t send_queue_write(
+    struct send_queue *q,
+    int fd,
+    int cls,
+    const char *buf,
+    size_t count)
+{
+  size_t offset = 0;
+
+  while (fd >= 0 && send_queue_empty(q) && offset < count) {
+    size_t room = send_queue_room(q);
+    if (room == 0) {
+      break;
+    }
+
+    size_t size = count - offset < room ? count - offset : room;
+    ssize_t length = write(fd, buf + offset, size);
+
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EWOULDBLOCK) {
+        break;
+      }
+      return -1;
+    }
+
+    if (q->log != NULL) {
+      resume_log_append(q->log, buf + offset, length);
+    }
+    offset += length;
+  }
+
+  if (cls == SEND_BULK) {
+    q->bulk_queued += count;
+    q->bulk_written += offset;
+  }
+
+  if (offset == count) {
+    return offset;
+  }
+
+  // The first frame not written whole is finished before anything else.
+  if (offset > 0) {
+    size_t start = 0;
+    while (true) {
+      ssize_t size = msg_frame_size(buf + start, count - start);
+      if (size < 0) {
+        return -1;
+      }
+      if (start + size > offset) {
+        q->current = cls;
+        q->frame_left = start + size - offset;
+        break;
+      }
+      start += size;
+    }
+  }
+
+  if (send_queue_append(q, cls, buf + offset, count - offset) < 0) {
+    return -1;
+  }
+
+  return offset;
+}
+
+
+// Writes as much of the queue as the fd takes, urgent frames first.
+// Returns the number of bytes written or -1 with errno set; EWOULDBLOCK
+// is not an error.
+static inline ssize_t send_queue_flush(struct send_queue *q, int fd)
+{
+  ssize_t total = 0;
+
+  while (q->hello_sent < q->hello_size) {
+    ssize_t length = write(fd, q->hello + q->hello_sent,
+                           q->hello_size - q->hello_sent);
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EWOULDBLOCK ? total : -1;
+    }
+
+    q->hello_sent += length;
+    total += length;
+  }
+
+  while (q->log != NULL && resume_log_resending(q->log)) {
+    char *data;
+    size_t size = resume_log_pending(q->log, &data);
+
+    ssize_t length = write(fd, data, size);
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EWOULDBLOCK ? total : -1;
+    }
+
+    resume_log_resent(q->log, length);
+    total += length;
+  }
+
+  while (true) {
+    if (q->frame_left == 0) {
+      q->current = -1;
+      for (int i = 0; i < SEND_NUM_CLASSES && q->current < 0; i++) {
+        if (!out_queue_empty(&q->classes[i])) {
+          q->current = i;
+        }
+      }
+      if (q->current < 0) {
+        break;
+      }
+    }
+
+    struct out_queue *oq = &q->classes[q->current];
+
+    // The rest of a partly written frame first, then whole frames for
+    // as long as nothing more urgent waits.
+    size_t ends[SEND_MAX_FRAMES];
+    int num_ends = 0;
+    size_t limit = q->frame_left;
+
+    if (limit > 0) {
+      ends[num_ends++] = limit;
+    }
+
+    bool more = q->current == SEND_URGENT ||
+                out_queue_empty(&q->classes[SEND_URGENT]);
+
+    while (more &&
+           num_ends < SEND_MAX_FRAMES &&
+           limit < SEND_BURST &&
+           limit < oq->bytes) {
+      char header[sizeof(struct msg_wrapper)];
+      size_t n = out_queue_peek(oq, limit, header, sizeof(header));
+
+      ssize_t size = msg_frame_size(header, n);
+      if (size < 0 || limit + size > oq->bytes) {
+        errno = EPROTO;
+        return -1;
+      }
+
+      limit += size;
+      ends[num_ends++] = limit;
+    }
+
+    // What is written has to be in the log, so it is copied there first
+    // and only counted once written.
+    if (q->log != NULL) {
+      size_t room = resume_log_room(q->log);
+      if (room == 0) {
+        break;
+      }
+      if (limit > room) {
+        limit = room;
+      }
+
+      size_t pos = (size_t) (q->log->end % q->log->size);
+      size_t first = limit < q->log->size - pos ? limit : q->log->size - pos;
+
+      out_queue_peek(oq, 0, q->log->buf + pos, first);
+      out_queue_peek(oq, first, q->log->buf, limit - first);
+    }
+
+    ssize_t length = out_queue_flush_some(oq, fd, limit);
+    if (length < 0) {
+      return -1;
+    }
+
+    if (q->log != NULL) {
+      resume_log_commit(q->log, length);
+    }
+
+    total += length;
+    if (q->current == SEND_BULK) {
+      q->bulk_written += length;
+    }
+
+    q->frame_left = 0;
+    for (int i = 0; i < num_ends; i++) {
+      if (ends[i] > (size_t) length) {
+        q->frame_left = ends[i] - length;
+        break;
+      }
+    }
+
+    if ((size_t) length < limit) {
+      break;
+    }
+  }
+
+  return total;
+}
+
+#endif // SENDQ_H
@@ -1,9 +1,5 @@
-#ifdef __linux__
-#include <pty.h>
-#else
-#include <util.h>
-#endif
-
+#include <locale.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,331 +7,3456 @@
 
 #include <netinet/in.h>
 
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "common.h"
+#include "fanout.h"
+#include "flush.h"
+#include "msgs.h"
+#include "outq.h"
+#include "predict.h"
+#include "reactor.h"
+#include "scrollback.h"
+#include "sendq.h"
+#include "spawn.h"
+#include "term.h"
+
+struct session;
+
+// A command running on one channel of a session. A channel owns the
+// fds of its child, a pidfd that turns readable once the child has
+// exited, a queue for whatever the child's stdin has not taken yet and
+// the credit the client has granted for its output.
+//
+// Output of the child is only read while the client has granted credit
+// for it, so a slow client stalls its child instead of the server.
+struct channel
+{
+  int id;
+  struct session *session;
+  int pid;
+  int pidfd;
+  int infd;
+  int outfds[2];
+  int status;
+  bool child_done;
+  bool dead;
+  struct reactor_watch child_watch;
+  struct reactor_watch out_watches[2];
+  struct reactor_watch in_watch;
+  struct out_queue in_queue;
+  int credits[3];
+  int stdin_written;
+  bool stdin_eof;
+  bool tty;
+  bool splice;
+  bool compress;
+  // Fds waiting to be passed to the client (channel_pass_fds).
+  int pass_fds[3];
+  int num_pass_fds;
+  struct lz_adapt lz[2];
+  uint64_t bulk_mark;
+  struct term *term;
+  struct term_screen shown;
+  bool sync_reset;
+  struct echo_log echo;
+  struct scrollback scrollback;
+  int64_t sync_last;
+  int64_t sync_deadline;
+  struct channel *sync_prev;
+  struct channel *sync_next;
+  struct channel *prev;
+  struct channel *next;
+};
+
+// Every accepted connection becomes a session. A session owns the
+// socket, the receive buffer for it, a queue for whatever the socket
+// has not taken yet and the channels opened over it, so any number of
+// them can make progress from one event loop without ever blocking it.
+struct session
+{
+  int sockfd;
+  bool sock_done;
+  // Nothing more is read from the connection, which is closed once
+  // everything queued for it has been written.
+  bool sock_closing;
+  bool dead;
+  struct reactor_watch sock_watch;
+  struct msg_recv_buffer rx;
+  struct send_queue sock_queue;
+  struct flush_state flush;
+  struct channel *channels;
+  struct session *prev;
+  struct session *next;
+  struct session *cork_prev;
+  struct session *cork_next;
+
+  // Whether the client came in over the unix socket, from this host, and
+  // may be passed the fds of its commands; 'passing_fds' counts the
+  // channels whose fds still wait to go out.
+  bool local;
+  int passing_fds;
+
+  // A resumable session keeps its channels running for a while after
+  // its connection broke (detached, with a deadline), until the client
+  // comes back with the token; see resume.h.
+  bool resumable;
+  char token[RESUME_TOKEN_SIZE];
+  struct resume_log resume;
+  int64_t detach_deadline;
+  struct session *detach_prev;
+  struct session *detach_next;
+
+  // A session started detached has an id and no client of its own: it
+  // keeps its tty running, with the tail of the output in a scrollback
+  // ring or the screen if synchronized, for its viewers.
+  unsigned int id;
+  struct session *viewers;
+
+  // A client that attaches to such a session gets a session of its own
+  // for its connection, a viewer of the other one ('viewing', until
+  // that ends). Everything a viewer is sent goes through its fanout
+  // queue, so that all viewers share the output; one that lags behind
+  // is skipped, and caught up from 'lag_pos' on once it has drained.
+  // Stdin is credited to a viewer as it arrives.
+  bool viewer;
+  bool read_only;
+  bool lagging;
+  uint64_t lag_pos;
+  int stdin_received;
+  struct session *viewing;
+  struct fanout_queue *fanout;
+  struct session *viewer_prev;
+  struct session *viewer_next;
+
+  // How much the session has sent lately, halved every
+  // BALANCE_INTERVAL_MS.
+  uint64_t load;
+
+  // What is left of its share of output for loop turn 'sched_turn', the
+  // tokens it has for --rate-limit, and whether it is paused until
+  // 'resume_at' for having used up either.
+  int64_t deficit;
+  uint64_t sched_turn;
+  int64_t tokens;
+  int64_t tokens_at;
+  bool paused;
+  int64_t resume_at;
+  struct session *pause_prev;
+  struct session *pause_next;
+};
+
+// A parked worker for --tty commands: a process that already runs in a
+// session of its own with a fresh pty as its controlling terminal and
+// waits on a pipe for the command to exec. Taking one skips the pty
+// setup and the spawn on the way to the first prompt. A zygote that dies
+// while parked is reaped through its pidfd and its slot freed; a free
+// slot has a pid of 0.
+struct zygote
+{
+  int pid;
+  int pidfd;
+  int ttyfd;
+  int cmdfd;
+  struct reactor_watch watch;
+};
+
+// The pool is refilled once the loop has been idle for ZYGOTE_IDLE_MS.
+// A zygote that fails to start (out of fds or ptys, say) is retried
+// after a backoff that doubles up to ZYGOTE_MAX_BACKOFF_MS.
+#define ZYGOTE_IDLE_MS 20
+#define ZYGOTE_MAX_BACKOFF_MS 5000
+
+// Stdout of a non-tty command is spliced straight from its pipe into
+// the socket once at least this much of it is waiting; less than that
+// is cheaper to copy and batch with other output.
+#define SPLICE_MIN_SIZE (16 * 1024)
+
+// Output smaller than this, like the echo of a keystroke, is not worth
+// compressing.
+#define COMPRESS_MIN_SIZE 64
+
+// A synchronized tty is sent an update of its screen at most once every
+// SYNC_FRAME_MS, and output is collected for SYNC_DELAY_MS before that
+// so that a burst of it makes a single update.
+#define SYNC_FRAME_MS 20
+#define SYNC_DELAY_MS 2
+#define SYNC_MAX_READ (256 * 1024)
+
+// A tty of a session started detached is read this much at a time, for
+// the same reason.
+#define SCROLLBACK_MAX_READ (256 * 1024)
+
+// Output is scheduled by deficit round robin: in each turn of the event
+// loop a session forwards at most a quantum of output, across all of its
+// channels. A session that has used up its share is paused, its output
+// watches dropping read interest, and resumes at the next turn, so that
+// one firehose cannot hold up the echo of every other session for long.
+// A session may also be limited to --rate-limit bytes a second, with a
+// burst of up to RATE_BURST_MS worth of it.
+#define SCHED_DEFAULT_QUANTUM (64 * 1024)
+#define SCHED_MIN_QUANTUM 4096
+#define RATE_BURST_MS 100
+
+// The server runs a number of workers, each a thread with an event loop
+// and a listening socket of its own, all bound to the same port with
+// SO_REUSEPORT so that the kernel spreads connections across them. A
+// session stays with the worker that accepted it, and everything a
+// worker owns below is thread local, so workers share nothing but the
+// settings. A connection that asks for a session of another worker,
+// to resume or attach to it, is handed over to that worker; the id or
+// token of a session tells which one it is.
+//
+// Connections are spread evenly, but the load is not: a few sessions
+// sending bulk output can leave one worker busy and the rest idle, and
+// the interactive sessions of the busy one waiting on them. So workers
+// compare their loads (bytes sent lately) every BALANCE_INTERVAL_MS,
+// and one with less than half the load of the busiest asks that one to
+// give it a session. The busy worker moves over its busiest session,
+// fds, queues, parser state and all, if that evens out the two of them.
+// --no-balance keeps every session with the worker that accepted it.
+struct handoff
+{
+  // Either a connection, or a session moved as a whole.
+  int sockfd;
+  struct session *session;
+  struct handoff *next;
+
+  // The message it has sent so far, fixed size and not a CMD_MSG, and
+  // whatever it has sent after it that has been received already.
+  struct msg_recv_buffer rx;
+  struct msg_wrapper message;
+};
+
+struct worker
+{
+  int index;
+  pthread_t thread;
+  int listenfd;
+
+  // Handoffs queued for the worker, which is woken through 'wakefd'.
+  pthread_mutex_t lock;
+  struct handoff *inbox;
+  int wakefd;
+
+  // Read by the other workers: its load as of the last balance, and the
+  // index of a worker that asks it for a session, or -1.
+  uint64_t load;
+  int steal_to;
+};
+
+#define MAX_WORKERS 256
+
+#define BALANCE_INTERVAL_MS 100
+#define BALANCE_MIN_LOAD (1024 * 1024)
+
+struct worker *workers = NULL;
+int num_workers = 1;
+bool balance = true;
+__thread struct worker *self;
+__thread int64_t next_balance = 0;
+
+// The unix socket for clients on the same host, if any. SO_REUSEPORT
+// does not spread unix connections, so only worker 0 listens on it.
+int unix_listenfd = -1;
+
+__thread struct reactor reactor;
+__thread struct session *sessions = NULL;
+__thread struct session *dead_sessions = NULL;
+__thread struct channel *dead_channels = NULL;
+__thread struct msg_batch out_batch;
+__thread struct buf_pool buffers;
+__thread int num_sessions = 0;
+int backend = REACTOR_DEFAULT;
+struct flush_policy flush_policy;
+
+// Corked sessions, in the order their flush budgets run out.
+__thread struct session *corked_head = NULL;
+__thread struct session *corked_tail = NULL;
+
+// Resumable sessions: how big their logs are (0 for none at all), how
+// long they wait for their clients, and the detached ones in the order
+// their time runs out.
+size_t resume_size = RESUME_DEFAULT_SIZE;
+int resume_timeout = RESUME_DEFAULT_TIMEOUT;
+__thread struct session *detached_head = NULL;
+__thread struct session *detached_tail = NULL;
+
+// Sessions started detached: the id of the next one, and how much of a
+// tty's output is kept for viewers that attach or catch up. A viewer is
+// sent all of it at once, so it is at most one credit window. Workers
+// take turns with ids, so that the worker with session 'id' is the one
+// at index (id - 1) % num_workers.
+__thread unsigned int next_session_id;
+size_t scrollback_size = SCROLLBACK_DEFAULT_SIZE;
+
+// Synchronized channels with an update of their screen due.
+__thread struct channel *syncing = NULL;
+__thread int screen_frame[(SCREEN_MSG_HEADER_SIZE + MSG_MAX_IO_SIZE) /
+                          sizeof(int)];
+
+// Output scheduling: the quantum, the rate limit (0 for none), the turn
+// of the event loop, and the sessions that are paused.
+int64_t sched_quantum = SCHED_DEFAULT_QUANTUM;
+int64_t rate_limit = 0;
+__thread uint64_t sched_turn = 0;
+__thread struct session *paused = NULL;
+
+// Each worker has a pty pool of its own, of up to max_zygotes.
+__thread struct zygote *zygotes = NULL;
+__thread int num_zygotes = 0;
+__thread int zygote_backoff_ms = 0;
+__thread int64_t zygote_retry_at = 0;
+int max_zygotes = 0;
+
+void on_socket(struct reactor_watch *w, int events);
+void on_output(struct reactor_watch *w, int events);
+void on_input(struct reactor_watch *w, int events);
+void on_child(struct reactor_watch *w, int events);
+
+
+void usage(char *cmd)
+{
+  fprintf(stderr,
+          "Usage: %s <port> [--backend epoll|poll|io_uring] "
+          "[--threads <n>] [--pty-pool <n>]\n"
+          "           [--flush-budget <ms>] [--notsent-lowat <bytes>]\n"
+          "           [--resume-buffer <bytes>] [--resume-timeout <s>]\n"
+          "           [--scrollback <bytes>] [--quantum <bytes>] "
+          "[--rate-limit <bytes/s>]\n"
+          "           [--unix <path>] [--no-balance]\n",
+          cmd);
+  exit(1);
+}
+
+
+void session_unlink(struct session *s)
+{
+  if (s->prev != NULL) {
+    s->prev->next = s->next;
+  } else {
+    sessions = s->next;
+  }
+  if (s->next != NULL) {
+    s->next->prev = s->prev;
+  }
+  s->prev = NULL;
+  s->next = NULL;
+  num_sessions--;
+}
+
+
+void session_link(struct session *s)
+{
+  s->next = sessions;
+  if (sessions != NULL) {
+    sessions->prev = s;
+  }
+  sessions = s;
+  num_sessions++;
+}
+
+
+int64_t rate_burst()
+{
+  int64_t burst = rate_limit * RATE_BURST_MS / 1000;
+  return burst > SCHED_MIN_QUANTUM ? burst : SCHED_MIN_QUANTUM;
+}
+
+
+// Returns how much output the session may still forward in this turn.
+// A session is given its quantum, and its tokens, once a turn, when it
+// first asks.
+int64_t session_budget(struct session *s)
+{
+  if (s->sched_turn != sched_turn) {
+    s->sched_turn = sched_turn;
+    s->deficit = (s->deficit < 0 ? s->deficit : 0) + sched_quantum;
+
+    if (rate_limit > 0) {
+      int64_t now = flush_now_ms();
+      s->tokens += (now - s->tokens_at) * rate_limit / 1000;
+      s->tokens_at = now;
+      if (s->tokens > rate_burst()) {
+        s->tokens = rate_burst();
+      }
+    }
+  }
+
+  if (rate_limit > 0 && s->tokens < s->deficit) {
+    return s->tokens;
+  }
+  return s->deficit;
+}
+
+
+void session_charge(struct session *s, size_t count)
+{
+  s->deficit -= count;
+  s->tokens -= count;
+}
+
+
+struct session *session_create(int sockfd)
+{
+  struct session *s = (struct session*) malloc(sizeof(struct session));
+  if (s == NULL) {
+    return NULL;
+  }
+  memset(s, 0, sizeof(struct session));
+
+  s->sockfd = sockfd;
+  s->sock_watch.fd = -1;
+
+  msg_recv_buffer_init(&s->rx, &buffers);
+  send_queue_init(&s->sock_queue, &buffers);
+  flush_state_init(&s->flush);
+
+  s->tokens = rate_burst();
+  s->tokens_at = flush_now_ms();
+
+  if (reactor_add(&reactor, &s->sock_watch, sockfd,
+                  REACTOR_READ | REACTOR_RECV, on_socket, s) < 0) {
+    free(s);
+    return NULL;
+  }
+
+  session_link(s);
+
+  return s;
+}
+
+
+// Unlinks a session. Its watches may still have events pending in the
+// current reactor batch, so it is only freed once the batch is over.
+void session_destroy(struct session *s)
+{
+  session_unlink(s);
+
+  s->dead = true;
+  s->prev = NULL;
+  s->next = dead_sessions;
+  dead_sessions = s;
+}
+
+
+struct channel *channel_create(struct session *s, int id)
+{
+  struct channel *c = (struct channel*) malloc(sizeof(struct channel));
+  if (c == NULL) {
+    return NULL;
+  }
+  memset(c, 0, sizeof(struct channel));
+
+  c->id = id;
+  c->session = s;
+  c->pid = -1;
+  c->pidfd = -1;
+  c->infd = -1;
+  c->outfds[0] = -1;
+  c->outfds[1] = -1;
+  c->out_watches[0].fd = -1;
+  c->out_watches[1].fd = -1;
+  c->in_watch.fd = -1;
+  c->child_watch.fd = -1;
+  c->credits[STDOUT_FILENO] = MSG_CREDIT_WINDOW;
+  c->credits[STDERR_FILENO] = MSG_CREDIT_WINDOW;
+
+  out_queue_init(&c->in_queue, &buffers);
+
+  c->next = s->channels;
+  if (s->channels != NULL) {
+    s->channels->prev = c;
+  }
+  s->channels = c;
+
+  return c;
+}
+
+
+// Unlinks a channel; it is freed once the reactor batch is over, just
+// like a session.
+void channel_sync_unlink(struct channel *c);
+
+void channel_destroy(struct channel *c)
+{
+  struct session *s = c->session;
+
+  channel_sync_unlink(c);
+
+  if (c->prev != NULL) {
+    c->prev->next = c->next;
+  } else {
+    s->channels = c->next;
+  }
+  if (c->next != NULL) {
+    c->next->prev = c->prev;
+  }
+
+  c->dead = true;
+  c->prev = NULL;
+  c->next = dead_channels;
+  dead_channels = c;
+}
+
+
+struct channel *channel_find(struct session *s, int id)
+{
+  for (struct channel *c = s->channels; c != NULL; c = c->next) {
+    if (c->id == id) {
+      return c;
+    }
+  }
+
+  return NULL;
+}
+
+
+void free_dead_sessions()
+{
+  while (dead_channels != NULL) {
+    struct channel *c = dead_channels;
+    dead_channels = c->next;
+
+    if (c->term != NULL) {
+      term_destroy(c->term);
+      term_screen_destroy(&c->shown);
+      free(c->term);
+    }
+    scrollback_destroy(&c->scrollback);
+    free(c);
+  }
+
+  while (dead_sessions != NULL) {
+    struct session *s = dead_sessions;
+    dead_sessions = s->next;
+
+    msg_recv_buffer_destroy(&s->rx);
+    resume_log_destroy(&s->resume);
+    free(s->fanout);
+    free(s);
+  }
+}
+
+
+void channel_close_fds(struct channel *c)
+{
+  reactor_del(&reactor, &c->out_watches[0]);
+  reactor_del(&reactor, &c->out_watches[1]);
+  reactor_del(&reactor, &c->in_watch);
+
+  out_queue_clear(&c->in_queue);
+
+  // For tty channels infd and outfds[0] are the same ttyfd.
+  if (c->infd >= 0 && c->infd != c->outfds[0]) {
+    close(c->infd);
+  }
+  c->infd = -1;
+
+  for (int i = 0; i < 2; i++) {
+    if (c->outfds[i] >= 0) {
+      close(c->outfds[i]);
+      c->outfds[i] = -1;
+    }
+  }
+
+  if (c->num_pass_fds > 0) {
+    for (int i = 0; i < c->num_pass_fds; i++) {
+      close(c->pass_fds[i]);
+    }
+    c->num_pass_fds = 0;
+    c->session->passing_fds--;
+  }
+}
+
+
+// Errors on one channel must not take down the others, so they are
+// reported and the channel is torn down instead of raising SIGTERM.
+void channel_error(struct channel *c, const char *msg)
+{
+  perror(msg);
+  channel_close_fds(c);
+}
+
+
+void session_uncork(struct session *s)
+{
+  if (!s->flush.corked) {
+    return;
+  }
+
+  if (s->sockfd >= 0) {
+    flush_push(s->sockfd, &s->flush);
+  }
+  s->flush.corked = false;
+
+  if (s->cork_prev != NULL) {
+    s->cork_prev->cork_next = s->cork_next;
+  } else {
+    corked_head = s->cork_next;
+  }
+  if (s->cork_next != NULL) {
+    s->cork_next->cork_prev = s->cork_prev;
+  } else {
+    corked_tail = s->cork_prev;
+  }
+  s->cork_prev = NULL;
+  s->cork_next = NULL;
+}
+
+
+// Bulk output about to be written may be held back for up to the flush
+// budget, so that it leaves in full segments.
+void session_cork(struct session *s)
+{
+  if (s->sockfd < 0 || !flush_bulk(s->sockfd, &s->flush, &flush_policy)) {
+    return;
+  }
+
+  s->cork_prev = corked_tail;
+  if (corked_tail != NULL) {
+    corked_tail->cork_next = s;
+  } else {
+    corked_head = s;
+  }
+  corked_tail = s;
+}
+
+
+void expire_corked_sessions()
+{
+  int64_t now = flush_now_ms();
+
+  while (corked_head != NULL && corked_head->flush.deadline <= now) {
+    session_uncork(corked_head);
+  }
+}
+
+
+void channel_update_watches(struct channel *c);
+
+void session_unpause(struct session *s)
+{
+  if (!s->paused) {
+    return;
+  }
+
+  if (s->pause_prev != NULL) {
+    s->pause_prev->pause_next = s->pause_next;
+  } else {
+    paused = s->pause_next;
+  }
+  if (s->pause_next != NULL) {
+    s->pause_next->pause_prev = s->pause_prev;
+  }
+  s->pause_prev = NULL;
+  s->pause_next = NULL;
+  s->paused = false;
+}
+
+
+// Stops reading the output of a session that has used up its share:
+// until the next turn for its quantum, or until it has the tokens for
+// another quantum again.
+void session_pause(struct session *s)
+{
+  if (s->paused) {
+    return;
+  }
+
+  s->paused = true;
+  s->resume_at = 0;
+
+  if (rate_limit > 0 && s->tokens <= 0) {
+    int64_t wanted = sched_quantum < rate_burst() ? sched_quantum : rate_burst();
+    s->resume_at = s->tokens_at + (wanted - s->tokens) * 1000 / rate_limit;
+  }
+
+  s->pause_prev = NULL;
+  s->pause_next = paused;
+  if (paused != NULL) {
+    paused->pause_prev = s;
+  }
+  paused = s;
+
+  for (struct channel *c = s->channels; c != NULL; c = c->next) {
+    channel_update_watches(c);
+  }
+}
+
+
+// Resumes the sessions whose turn has come again. Returns the time until
+// the next one is due, or -1 if none is paused.
+int resume_sessions()
+{
+  int64_t now = flush_now_ms();
+  int64_t next = -1;
+
+  struct session *s = paused;
+  while (s != NULL) {
+    struct session *following = s->pause_next;
+
+    if (s->resume_at <= now) {
+      session_unpause(s);
+      for (struct channel *c = s->channels; c != NULL; c = c->next) {
+        channel_update_watches(c);
+      }
+    } else if (next < 0 || s->resume_at < next) {
+      next = s->resume_at;
+    }
+
+    s = following;
+  }
+
+  return next < 0 ? -1 : (int) (next - now);
+}
+
+
+void session_unlink_detached(struct session *s)
+{
+  if (s->detach_deadline == 0) {
+    return;
+  }
+
+  if (s->detach_prev != NULL) {
+    s->detach_prev->detach_next = s->detach_next;
+  } else {
+    detached_head = s->detach_next;
+  }
+  if (s->detach_next != NULL) {
+    s->detach_next->detach_prev = s->detach_prev;
+  } else {
+    detached_tail = s->detach_prev;
+  }
+  s->detach_prev = NULL;
+  s->detach_next = NULL;
+  s->detach_deadline = 0;
+}
+
+
+void viewer_unlink(struct session *v)
+{
+  struct session *s = v->viewing;
+  if (s == NULL) {
+    return;
+  }
+
+  if (v->viewer_prev != NULL) {
+    v->viewer_prev->viewer_next = v->viewer_next;
+  } else {
+    s->viewers = v->viewer_next;
+  }
+  if (v->viewer_next != NULL) {
+    v->viewer_next->viewer_prev = v->viewer_prev;
+  }
+  v->viewer_prev = NULL;
+  v->viewer_next = NULL;
+  v->viewing = NULL;
+}
+
+
+void session_close(struct session *s)
+{
+  session_uncork(s);
+  session_unpause(s);
+  session_unlink_detached(s);
+
+  reactor_del(&reactor, &s->sock_watch);
+
+  send_queue_clear(&s->sock_queue);
+
+  // The tty may have been waiting for this viewer.
+  if (s->viewer) {
+    struct session *owner = s->viewing;
+
+    viewer_unlink(s);
+    fanout_queue_clear(s->fanout);
+
+    for (struct channel *c = owner != NULL ? owner->channels : NULL;
+         c != NULL; c = c->next) {
+      channel_update_watches(c);
+    }
+  }
+
+  // Viewers still get to send what they have queued, exit status
+  // included.
+  while (s->viewers != NULL) {
+    viewer_unlink(s->viewers);
+  }
+
+  if (s->sockfd >= 0) {
+    close(s->sockfd);
+    s->sockfd = -1;
+  }
+
+  for (struct channel *c = s->channels; c != NULL; c = c->next) {
+    channel_close_fds(c);
+  }
+
+  s->sock_done = true;
+}
+
+
+// Errors on one session must not take down the others, so they are
+// reported and the session is torn down instead of raising SIGTERM,
+// together with all of its channels.
+void session_error(struct session *s, const char *msg)
+{
+  perror(msg);
+  session_close(s);
+}
+
+
+// Lets go of the connection of a session that outlives it. A resumable
+// session keeps whatever it has still to send, for its client to come
+// back to; frames received only in part are dropped, and the client
+// sends them again. A session started detached drops it instead and
+// keeps its tty going for its viewers.
+void session_detach(struct session *s)
+{
+  session_uncork(s);
+
+  reactor_del(&reactor, &s->sock_watch);
+  close(s->sockfd);
+  s->sockfd = -1;
+  msg_recv_buffer_release(&s->rx);
+
+  if (!s->resumable) {
+    send_queue_clear(&s->sock_queue);
+    return;
+  }
+
+  // An answer the old connection did not get in full is of no use to
+  // the next one.
+  send_queue_hello(&s->sock_queue, NULL, 0);
+
+  s->detach_deadline = flush_now_ms() + (int64_t) resume_timeout * 1000;
+  s->detach_prev = detached_tail;
+  if (detached_tail != NULL) {
+    detached_tail->detach_next = s;
+  } else {
+    detached_head = s;
+  }
+  detached_tail = s;
+}
+
+
+// The connection of a session broke. Unless the session is resumable
+// or started detached that is the end of it.
+void session_lost(struct session *s, const char *msg)
+{
+  if (!s->resumable && s->id == 0) {
+    session_error(s, msg);
+    return;
+  }
+
+  perror(msg);
+  session_detach(s);
+}
+
+
+void session_check(struct session *s);
+
+// Closes detached sessions whose clients have not come back in time.
+void expire_detached_sessions()
+{
+  int64_t now = flush_now_ms();
+
+  while (detached_head != NULL && detached_head->detach_deadline <= now) {
+    struct session *s = detached_head;
+    session_close(s);
+    session_check(s);
+  }
+}
+
+
+// Called whenever something happened to a session that may have ended
+// it. A session lasts until the client closes the connection, and then
+// until the children of all its channels have been reaped. A session
+// started detached lasts as long as its command.
+void session_check(struct session *s)
+{
+  if (s->id != 0 && s->channels == NULL) {
+    s->sock_done = true;
+  }
+
+  if (s->dead || !s->sock_done) {
+    return;
+  }
+
+  session_close(s);
+
+  if (s->channels == NULL) {
+    session_destroy(s);
+  }
+}
+
+
+void session_update_watch(struct session *s);
+
+// Queues a frame for a viewer; the first one goes out at once, just like
+// with send_queue_write().
+void viewer_push(struct session *v, struct shared_frame *frame)
+{
+  if (v->sockfd < 0) {
+    return;
+  }
+
+  bool idle = fanout_queue_empty(v->fanout);
+
+  if (fanout_queue_push(v->fanout, frame) < 0) {
+    session_error(v, "ERROR queueing output for viewer");
+    return;
+  }
+
+  if (idle && fanout_queue_flush(v->fanout, v->sockfd) < 0) {
+    session_lost(v, "ERROR writing to newsockfd");
+  }
+}
+
+
+// Hands a frame of a session started detached to all of its viewers,
+// but those that lag behind; see viewer_catch_up().
+void session_broadcast(struct session *s, struct shared_frame *frame)
+{
+  struct session *v = s->viewers;
+
+  while (v != NULL) {
+    struct session *next = v->viewer_next;
+
+    if (!v->lagging) {
+      viewer_push(v, frame);
+
+      if (fanout_queue_lagging(v->fanout)) {
+        v->lagging = true;
+        v->lag_pos = s->channels != NULL ? s->channels->scrollback.end : 0;
+      }
+
+      session_update_watch(v);
+      session_check(v);
+    }
+
+    v = next;
+  }
+}
+
+
+// Puts frames into shared frames, as many whole ones into each as fit,
+// for a viewer or, from a session started detached, for all of its
+// viewers.
+void session_share(struct session *s, const char *buf, size_t count)
+{
+  size_t capacity = shared_frame_capacity(&buffers);
+
+  while (count > 0) {
+    size_t size = 0;
+    while (size < count) {
+      ssize_t n = msg_frame_size(buf + size, count - size);
+      if (n < 0 || size + n > count || size + n > capacity) {
+        break;
+      }
+      size += n;
+    }
+
+    if (size == 0) {
+      errno = EPROTO;
+      perror("ERROR sharing frame");
+      return;
+    }
+
+    struct shared_frame *frame = shared_frame_get(&buffers);
+    if (frame == NULL) {
+      perror("ERROR allocating frame");
+      return;
+    }
+
+    memcpy(frame->data, buf, size);
+    frame->size = size;
+
+    if (s->viewer) {
+      viewer_push(s, frame);
+    } else {
+      session_broadcast(s, frame);
+    }
+    shared_frame_put(&buffers, frame);
+
+    buf += size;
+    count -= size;
+  }
+}
+
+
+// Hands frames to the client socket. Whatever it does not take right
+// away is queued in class 'cls' and written once it becomes writable.
+// A detached session queues everything for its client to come back.
+void session_send(struct session *s, int cls, const char *buf, size_t count)
+{
+  s->load += count;
+
+  if (s->viewer || s->id != 0) {
+    session_share(s, buf, count);
+    return;
+  }
+
+  if ((s->sockfd < 0 && s->detach_deadline == 0) || count == 0) {
+    return;
+  }
+
+  if (send_queue_write(&s->sock_queue, s->sockfd, cls, buf, count) < 0) {
+    session_lost(s, "ERROR writing to newsockfd");
+  }
+}
+
+
+// Frames of a channel are urgent while they are small and none of its
+// earlier frames are still queued as bulk, so that they may overtake
+// the bulk output of other channels but never its own.
+void channel_send(struct channel *c, const char *buf, size_t count)
+{
+  struct send_queue *q = &c->session->sock_queue;
+
+  if (count <= SEND_INTERACTIVE_MAX && !send_queue_bulk_pending(q, c->bulk_mark)) {
+    session_send(c->session, SEND_URGENT, buf, count);
+    return;
+  }
+
+  session_send(c->session, SEND_BULK, buf, count);
+  c->bulk_mark = send_queue_bulk_mark(q);
+}
+
+
+void session_update_watch(struct session *s)
+{
+  if (s->sockfd < 0) {
+    return;
+  }
+
+  int events = REACTOR_READ;
+  if (s->viewer ? !fanout_queue_empty(s->fanout) :
+                  (!send_queue_empty(&s->sock_queue) &&
+                   !send_queue_blocked(&s->sock_queue)) ||
+                  s->passing_fds > 0) {
+    events |= REACTOR_WRITE;
+  }
+
+  if (reactor_update(&reactor, &s->sock_watch, events) < 0) {
+    session_error(s, "ERROR updating newsockfd watch");
+  }
+}
+
+
+// Makes sure the client is sent an update no later than 'deadline'.
+void channel_sync_schedule_at(struct channel *c, int64_t deadline)
+{
+  if (c->sync_deadline != 0) {
+    if (deadline < c->sync_deadline) {
+      c->sync_deadline = deadline;
+    }
+    return;
+  }
+
+  c->sync_deadline = deadline;
+  c->sync_prev = NULL;
+  c->sync_next = syncing;
+  if (syncing != NULL) {
+    syncing->sync_prev = c;
+  }
+  syncing = c;
+}
+
+
+// Output of a synchronized tty only changes the screen of its terminal.
+// The client is brought up to date with the screen as it is by then a
+// little later, which skips whatever came and went in between.
+void channel_sync_schedule(struct channel *c)
+{
+  int64_t now = flush_now_ms();
+  int64_t deadline = c->sync_last + SYNC_FRAME_MS;
+  if (deadline < now + SYNC_DELAY_MS) {
+    deadline = now + SYNC_DELAY_MS;
+  }
+
+  channel_sync_schedule_at(c, deadline);
+}
+
+
+void channel_sync_unlink(struct channel *c)
+{
+  if (c->sync_deadline == 0) {
+    return;
+  }
+
+  if (c->sync_prev != NULL) {
+    c->sync_prev->sync_next = c->sync_next;
+  } else {
+    syncing = c->sync_next;
+  }
+  if (c->sync_next != NULL) {
+    c->sync_next->sync_prev = c->sync_prev;
+  }
+
+  c->sync_prev = NULL;
+  c->sync_next = NULL;
+  c->sync_deadline = 0;
+}
+
+
+// An update is held back while the last one is still queued, so that
+// a slow link gets fewer of them rather than a backlog.
+bool channel_sync_blocked(struct channel *c)
+{
+  return send_queue_bulk_pending(&c->session->sock_queue, c->bulk_mark);
+}
+
+
+void channel_send_screen(
+    struct channel *c,
+    struct term_screen *from,
+    bool reset,
+    struct session *v);
+
+// Sends the client the changes to the screen since the last update,
+// and how much of its input the screen is sure to reflect; see
+// predict.h. The latter changes over time on its own, so the update
+// is sent without changes to the screen as well.
+void channel_sync(struct channel *c)
+{
+  channel_sync_unlink(c);
+
+  struct term *t = c->term;
+  int64_t now = flush_now_ms();
+  int64_t next_ack = echo_log_expire(&c->echo, now);
+
+  if (next_ack != 0) {
+    channel_sync_schedule_at(c, next_ack);
+  }
+
+  if (!t->dirty && c->echo.acked == c->echo.sent) {
+    return;
+  }
+
+  // Only changes to the screen count against the frame rate; an ack on
+  // its own is tiny.
+  if (t->dirty) {
+    c->sync_last = now;
+  }
+  t->dirty = false;
+  c->echo.sent = c->echo.acked;
+
+  if (c->shown.rows != t->screen.rows || c->shown.cols != t->screen.cols) {
+    term_screen_destroy(&c->shown);
+    if (term_screen_init(&c->shown, t->screen.rows, t->screen.cols) < 0) {
+      channel_error(c, "ERROR allocating screen");
+      return;
+    }
+    c->sync_reset = true;
+  }
+
+  channel_send_screen(c, &c->shown, c->sync_reset, NULL);
+  c->sync_reset = false;
+
+  session_uncork(c->session);
+}
+
+
+// Sends the changes that bring 'from' up to the screen of the terminal
+// (and applies them to it), to viewer 'v' or, if NULL, to the session.
+void channel_send_screen(
+    struct channel *c,
+    struct term_screen *from,
+    bool reset,
+    struct session *v)
+{
+  struct term *t = c->term;
+  struct msg_wrapper *message = (struct msg_wrapper*) screen_frame;
+  bool done = false;
+
+  while (!done) {
+    size_t size = term_diff(from, &t->screen, message->msg.screen.data,
+                            MSG_MAX_IO_SIZE, &done);
+
+    message->type = SCREEN_MSG;
+    message->channel = c->id;
+    message->msg.screen.data_size = size;
+    message->msg.screen.rows = t->screen.rows;
+    message->msg.screen.cols = t->screen.cols;
+    message->msg.screen.cursor_row = t->screen.cursor_row;
+    message->msg.screen.cursor_col = t->screen.cursor_col;
+    message->msg.screen.echo_ack = c->echo.acked;
+    message->msg.screen.flags =
+      (done ? SCREEN_FINAL : 0) |
+      (reset ? SCREEN_RESET : 0) |
+      (t->screen.cursor_visible ? SCREEN_CURSOR_VISIBLE : 0);
+    reset = false;
+
+    size_t frame_size = SCREEN_MSG_HEADER_SIZE + size;
+    memset((char*) message + frame_size, 0,
+           MSG_ALIGNED(frame_size) - frame_size);
+
+    if (v != NULL) {
+      session_send(v, SEND_BULK, (char*) message, MSG_ALIGNED(frame_size));
+    } else {
+      channel_send(c, (char*) message, MSG_ALIGNED(frame_size));
+    }
+  }
+}
+
+
+// Sends the updates that are due. Returns how many milliseconds until
+// the next one is, or -1 if none is.
+int run_syncs()
+{
+  int64_t now = flush_now_ms();
+  int timeout = -1;
+
+  struct channel *c = syncing;
+  while (c != NULL) {
+    struct channel *next = c->sync_next;
+
+    if (!channel_sync_blocked(c)) {
+      if (c->sync_deadline <= now) {
+        channel_sync(c);
+        session_update_watch(c->session);
+      } else if (timeout < 0 || c->sync_deadline - now < timeout) {
+        timeout = (int) (c->sync_deadline - now);
+      }
+    }
+
+    c = next;
+  }
+
+  return timeout;
+}
+
+
+void channel_catch_up(struct channel *c, struct session *v);
+void channel_reap(struct channel *c, int options);
+
+// Once its child has been reaped and all of its output sent, a channel
+// is ended with an EXIT_MSG and its id becomes free again.
+void channel_check(struct channel *c)
+{
+  struct session *s = c->session;
+
+  // A session started detached keeps the exit status for a viewer.
+  if (c->dead ||
+      !c->child_done ||
+      c->outfds[0] >= 0 ||
+      c->outfds[1] >= 0 ||
+      c->num_pass_fds > 0 ||
+      (s->id != 0 && s->viewers == NULL)) {
+    return;
+  }
+
+  channel_close_fds(c);
+
+  // The last screen goes out before the exit status, however soon
+  // after the one before, and viewers that lag behind catch up first.
+  if (c->term != NULL) {
+    channel_sync(c);
+  }
+
+  struct session *v = s->viewers;
+  while (v != NULL) {
+    struct session *next = v->viewer_next;
+    if (v->lagging) {
+      v->lagging = false;
+      channel_catch_up(c, v);
+    }
+    v = next;
+  }
+
+  struct msg_wrapper message;
+  message.type = EXIT_MSG;
+  message.channel = c->id;
+  message.msg.exit.status = c->status;
+
+  channel_send(c, (char*) &message, MSG_HEADER_SIZE + sizeof(struct exit_msg));
+  session_uncork(s);
+
+  channel_destroy(c);
+  session_update_watch(s);
+  session_check(s);
+}
+
+
+// Adds the watches for whichever fds of a channel are still open.
+int channel_add_watches(struct channel *c)
+{
+  if (c->pidfd >= 0 &&
+      reactor_add(&reactor, &c->child_watch, c->pidfd, REACTOR_READ,
+                  on_child, c) < 0) {
+    return -1;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    if (c->outfds[i] < 0) {
+      continue;
+    }
+
+    // The reactor must not read a pipe that is spliced from.
+    int events = REACTOR_READ;
+    if (i != 0 || !c->splice) {
+      events |= REACTOR_RECV;
+    }
+
+    int result = reactor_add(
+        &reactor,
+        &c->out_watches[i],
+        c->outfds[i],
+        events,
+        on_output,
+        c);
+
+    if (result < 0) {
+      return result;
+    }
+  }
+
+  // A tty is read and written through the same fd, and so the same
+  // watch; a stdin pipe gets a watch of its own, armed while its queue
+  // is not empty.
+  if (c->infd >= 0 && c->infd != c->outfds[0]) {
+    int result = reactor_add(&reactor, &c->in_watch, c->infd, 0,
+                             on_input, c);
+    if (result < 0) {
+      return result;
+    }
+  }
+
+  return 0;
+}
+
+
+int channel_watch_child(struct channel *c)
+{
+  c->pidfd = open_pidfd(c->pid);
+  if (c->pidfd < 0) {
+    return -1;
+  }
+
+  return channel_add_watches(c);
+}
+
+
+// Whether a session started detached may read more output: while
+// nobody watches, or one of its viewers is ready for it. Those that are
+// not fall behind the others and catch up later, but the tty waits for
+// the fastest one like it would for a single client.
+bool session_viewers_ready(struct session *s)
+{
+  for (struct session *v = s->viewers; v != NULL; v = v->viewer_next) {
+    if (!v->lagging && fanout_queue_ready(v->fanout)) {
+      return true;
+    }
+  }
+
+  return s->viewers == NULL;
+}
+
+
+// Brings the interest of the watches of a channel in line with its
+// queue and credits.
+void channel_update_watches(struct channel *c)
+{
+  int result = 0;
+
+  for (int i = 0; i < 2; i++) {
+    if (c->outfds[i] < 0) {
+      continue;
+    }
+
+    // A synchronized tty is always read: its output only ever changes
+    // the screen, which takes no credit to send.
+    bool ready = c->scrollback.buf != NULL ?
+                 session_viewers_ready(c->session) :
+                 c->credits[i + 1] > 0;
+    int events = ready || c->term != NULL ? REACTOR_READ : 0;
+
+    if (c->session->paused) {
+      events = 0;
+    }
+
+    // Spliced output stays in its pipe while the socket is backed up,
+    // so that it can still go out without being copied once it drains.
+    if (i == 0 && c->splice && !send_queue_empty(&c->session->sock_queue)) {
+      events = 0;
+    }
+
+    if (c->outfds[i] == c->infd && !out_queue_empty(&c->in_queue)) {
+      events |= REACTOR_WRITE;
+    }
+    result |= reactor_update(&reactor, &c->out_watches[i], events);
+  }
+
+  if (c->infd >= 0 && c->infd != c->outfds[0]) {
+    int events = out_queue_empty(&c->in_queue) ? 0 : REACTOR_WRITE;
+    result |= reactor_update(&reactor, &c->in_watch, events);
+  }
+
+  if (result < 0) {
+    channel_error(c, "ERROR updating watches");
+  }
+}
+
+
+// Brings viewer 'v' up to date: a synchronized tty by sending it the
+// whole screen, after everybody else has been sent the last changes,
+// any other by sending it what the scrollback has kept of the output
+// from where it fell behind on, or all of it when it has just attached.
+void channel_catch_up(struct channel *c, struct session *v)
+{
+  if (c->term != NULL) {
+    channel_sync(c);
+
+    struct term_screen blank;
+    if (term_screen_init(&blank, c->term->screen.rows,
+                         c->term->screen.cols) < 0) {
+      channel_error(c, "ERROR allocating screen");
+      return;
+    }
+    channel_send_screen(c, &blank, true, v);
+    term_screen_destroy(&blank);
+    return;
+  }
+
+  if (c->scrollback.buf == NULL) {
+    return;
+  }
+
+  struct iovec iov[2];
+  int num_iov = scrollback_tail(&c->scrollback, v->lag_pos, iov);
+  size_t room = shared_frame_capacity(&buffers) - IO_MSG_HEADER_SIZE -
+                (MSG_ALIGN - 1);
+  if (room > MSG_MAX_IO_SIZE) {
+    room = MSG_MAX_IO_SIZE;
+  }
+
+  for (int i = 0; i < num_iov; i++) {
+    char *data = (char*) iov[i].iov_base;
+    size_t left = iov[i].iov_len;
+
+    while (left > 0) {
+      struct shared_frame *frame = shared_frame_get(&buffers);
+      if (frame == NULL) {
+        session_error(v, "ERROR allocating frame");
+        return;
+      }
+
+      size_t size = left < room ? left : room;
+      memcpy(frame->data + IO_MSG_HEADER_SIZE, data, size);
+      frame->size = msg_frame_io(frame->data, IO_MSG, c->id,
+                                 STDOUT_FILENO, size);
+
+      viewer_push(v, frame);
+      shared_frame_put(&buffers, frame);
+      data += size;
+      left -= size;
+    }
+  }
+}
+
+
+// Catches up a viewer that has been skipped while it lagged behind, once
+// it has sent everything it had queued.
+void viewer_catch_up(struct session *v)
+{
+  v->lagging = false;
+
+  if (v->viewing == NULL) {
+    return;
+  }
+
+  for (struct channel *c = v->viewing->channels; c != NULL; c = c->next) {
+    channel_catch_up(c, v);
+  }
+}
+
+
+void session_send_credit(struct session *s, int channel, int destfd, int bytes)
+{
+  struct msg_wrapper message;
+  message.type = CREDIT_MSG;
+  message.channel = channel;
+  message.msg.credit.destfd = destfd;
+  message.msg.credit.bytes = bytes;
+
+  session_send(
+      s,
+      SEND_URGENT,
+      (char*) &message,
+      MSG_HEADER_SIZE + sizeof(struct credit_msg));
+  session_uncork(s);
+}
+
+
+void channel_send_credit(struct channel *c, int destfd, int bytes)
+{
+  session_send_credit(c->session, c->id, destfd, bytes);
+}
+
+
+// Credit for the child's stdin is handed back once the child has
+// actually been given the bytes.
+void channel_input_written(struct channel *c, ssize_t n)
+{
+  if (n < 0) {
+    channel_error(c, "ERROR writing to child stdin");
+    return;
+  }
+
+  c->stdin_written += n;
+
+  if (c->term != NULL && n > 0) {
+    int64_t now = flush_now_ms();
+    echo_log_written(&c->echo, n, now);
+    channel_sync_schedule_at(c, now + PREDICT_ECHO_MS);
+  }
+
+  // Viewers are credited as their input arrives instead.
+  if (c->stdin_written >= MSG_CREDIT_THRESHOLD) {
+    if (c->session->id == 0) {
+      channel_send_credit(c, STDIN_FILENO, c->stdin_written);
+    }
+    c->stdin_written = 0;
+  }
+}
+
+
+// Once the client's stdin has ended and everything it sent has been
+// written, the child's stdin pipe is closed so that it sees EOF. A tty
+// cannot be closed for input only, so there the EOF goes no further.
+void channel_check_input(struct channel *c)
+{
+  if (!c->stdin_eof ||
+      c->infd < 0 ||
+      c->infd == c->outfds[0] ||
+      !out_queue_empty(&c->in_queue)) {
+    return;
+  }
+
+  reactor_del(&reactor, &c->in_watch);
+  close(c->infd);
+  c->infd = -1;
+}
+
+
+void channel_flush_input(struct channel *c)
+{
+  if (c->infd >= 0 && !out_queue_empty(&c->in_queue)) {
+    channel_input_written(c, out_queue_flush(&c->in_queue, c->infd));
+  }
+
+  channel_check_input(c);
+}
+
+
+// Runs in a zygote: waits for a cmd_msg and its string table on fd 3
+// and execs the command on the pty it was started with.
+int zygote_main()
+{
+  struct cmd_msg header;
+  if (read_all(3, (char*) &header, sizeof(header)) != sizeof(header) ||
+      header.strtab_size < 0) {
+    _exit(0); // The server has gone away.
+  }
+
+  struct cmd_msg *message = (struct cmd_msg*) malloc(
+      sizeof(header) + header.strtab_size);
+  if (message == NULL) {
+    _exit(1);
+  }
+
+  *message = header;
+
+  if (read_all(3, message->strtab, header.strtab_size) !=
+      header.strtab_size) {
+    _exit(0);
+  }
+
+  close(3);
+
+  char **cmd = build_cmd_array(message);
+  if (cmd == NULL) {
+    perror("ERROR reading cmd");
+    _exit(1);
+  }
+
+  execvp(cmd[0], cmd);
+
+  perror("ERROR execing cmd");
+  _exit(1);
+}
+
+
+int zygote_spawn(struct zygote *z)
+{
+  static char *argv[] = {
+    (char*) "/proc/self/exe",
+    (char*) "--zygote",
+    NULL
+  };
+
+  struct winsize winsize;
+  memset(&winsize, 0, sizeof(winsize));
+
+  char tty_name[256];
+  int ttyfd = open_pty(tty_name, sizeof(tty_name), &winsize);
+  if (ttyfd < 0) {
+    return -1;
+  }
+
+  int cmd_pipe[2];
+  if (pipe2(cmd_pipe, O_CLOEXEC) < 0) {
+    close(ttyfd);
+    return -1;
+  }
+
+  int pid = spawn_cmd(argv, NULL, tty_name, cmd_pipe[0]);
+  int saved_errno = errno;
+
+  close(cmd_pipe[0]);
+
+  if (pid < 0 || make_non_blocking(ttyfd) < 0) {
+    saved_errno = pid < 0 ? saved_errno : errno;
+    close(ttyfd);
+    close(cmd_pipe[1]);
+    if (pid >= 0) {
+      waitpid(pid, NULL, 0); // It exits as soon as it sees the pipe close.
+    }
+    errno = saved_errno;
+    return -1;
+  }
+
+  z->pid = pid;
+  z->pidfd = -1;
+  z->ttyfd = ttyfd;
+  z->cmdfd = cmd_pipe[1];
+  z->watch.fd = -1;
+
+  return 0;
+}
+
+
+// Takes a zygote out of the pool for good, and reaps it.
+void zygote_discard(struct zygote *z)
+{
+  reactor_del(&reactor, &z->watch);
+  if (z->pidfd >= 0) {
+    close(z->pidfd);
+  }
+  close(z->ttyfd);
+  close(z->cmdfd);
+
+  // It exits as soon as it sees the pipe close, if it has not already.
+  waitpid(z->pid, NULL, 0);
+
+  z->pid = 0;
+  num_zygotes--;
+}
+
+
+// Discards a parked zygote to free its fds for something else. Returns
+// false if there is none.
+bool shrink_zygotes()
+{
+  for (int i = 0; i < max_zygotes && num_zygotes > 0; i++) {
+    if (zygotes[i].pid != 0) {
+      zygote_discard(&zygotes[i]);
+      zygote_backoff_ms = ZYGOTE_MAX_BACKOFF_MS;
+      zygote_retry_at = flush_now_ms() + zygote_backoff_ms;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+void on_zygote_exit(struct reactor_watch *w, int events)
+{
+  zygote_discard((struct zygote*) w->data);
+}
+
+
+// Adds a zygote to the pool. The main loop only calls this once it has
+// been idle for ZYGOTE_IDLE_MS, so a refill never competes with the
+// command that just took a zygote for getting to its first prompt.
+// Returns -1 if it failed, in which case the next try waits.
+int fill_zygote()
+{
+  struct zygote *z = zygotes;
+  while (z->pid != 0) {
+    z++;
+  }
+
+  if (zygote_spawn(z) < 0) {
+    perror("ERROR starting zygote");
+
+    zygote_backoff_ms = zygote_backoff_ms == 0 ? ZYGOTE_IDLE_MS :
+                        2 * zygote_backoff_ms;
+    if (zygote_backoff_ms > ZYGOTE_MAX_BACKOFF_MS) {
+      zygote_backoff_ms = ZYGOTE_MAX_BACKOFF_MS;
+    }
+    zygote_retry_at = flush_now_ms() + zygote_backoff_ms;
+    return -1;
+  }
+
+  num_zygotes++;
+  zygote_backoff_ms = 0;
+
+  z->pidfd = open_pidfd(z->pid);
+  if (z->pidfd < 0 ||
+      reactor_add(&reactor, &z->watch, z->pidfd, REACTOR_READ,
+                  on_zygote_exit, z) < 0) {
+    perror("ERROR watching zygote");
+    zygote_discard(z);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+// Hands the command to a parked zygote. Returns the pid, or -1 if the
+// pool is empty or the zygote is gone, in which case the caller spawns
+// the command itself.
+int run_with_zygote(struct channel *c, struct cmd_msg *message)
+{
+  for (int i = 0; i < max_zygotes && num_zygotes > 0; i++) {
+    struct zygote *z = &zygotes[i];
+    if (z->pid == 0) {
+      continue;
+    }
+
+    // The pipe is blocking; the zygote is sitting in read() on it.
+    if (ioctl(z->ttyfd, TIOCSWINSZ, &message->winsize) < 0 ||
+        write_all(z->cmdfd, (char*) message,
+                  sizeof(*message) + message->strtab_size) < 0) {
+      zygote_discard(z);
+      continue;
+    }
+
+    // From here on it is the channel's child.
+    reactor_del(&reactor, &z->watch);
+    close(z->pidfd);
+    close(z->cmdfd);
+
+    c->pid = z->pid;
+    c->infd = z->ttyfd;
+    c->outfds[0] = z->ttyfd;
+
+    z->pid = 0;
+    num_zygotes--;
+
+    return c->pid;
+  }
+
+  return -1;
+}
+
+
+int run_with_pty(struct channel *c, struct cmd_msg *message)
+{
+  if (run_with_zygote(c, message) >= 0) {
+    return c->pid;
+  }
+
+  char tty_name[256];
+  int ttyfd = open_pty(tty_name, sizeof(tty_name), &message->winsize);
+  if (ttyfd < 0) {
+    return -1;
+  }
+
+  char **cmd = build_cmd_array(message);
+  if (cmd == NULL) {
+    close(ttyfd);
+    return -1;
+  }
+
+  int pid = spawn_cmd(cmd, NULL, tty_name, -1);
+  free(cmd);
+
+  if (pid < 0 || make_non_blocking(ttyfd) < 0) {
+    int saved_errno = errno;
+    close(ttyfd);
+    errno = saved_errno;
+    return -1;
+  }
+
+  c->pid = pid;
+  c->infd = ttyfd;
+  c->outfds[0] = ttyfd;
+
+  return pid;
+}
+
+
+int run_without_pty(struct channel *c, struct cmd_msg *message)
+{
+  // The server's ends of the pipes are close-on-exec from the start,
+  // so the child never sees them.
+  int pipes[3][2] = { { -1, -1 }, { -1, -1 }, { -1, -1 } };
+
+  // Commands that take no input get /dev/null, so they see EOF at once.
+  if (message->null_stdin) {
+    pipes[0][0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  } else if (pipe2(pipes[0], O_CLOEXEC) < 0) {
+    pipes[0][0] = -1;
+  }
+
+  int pid = -1;
+  char **cmd = NULL;
+
+  if (pipes[0][0] >= 0 &&
+      pipe2(pipes[1], O_CLOEXEC) == 0 &&
+      pipe2(pipes[2], O_CLOEXEC) == 0) {
+    cmd = build_cmd_array(message);
+  }
+
+  if (cmd != NULL) {
+    int fds[3] = { pipes[0][0], pipes[1][1], pipes[2][1] };
+    pid = spawn_cmd(cmd, fds, NULL, -1);
+    free(cmd);
+  }
+
+  int saved_errno = errno;
+
+  close(pipes[0][0]);
+  close(pipes[1][1]);
+  close(pipes[2][1]);
+
+  c->infd = pipes[0][1];
+  c->outfds[0] = pipes[1][0];
+  c->outfds[1] = pipes[2][0];
+
+  if (pid < 0) {
+    errno = saved_errno;
+    return pid;
+  }
+
+  c->pid = pid;
+
+  if ((c->infd >= 0 && make_non_blocking(c->infd) < 0) ||
+      make_non_blocking(c->outfds[0]) < 0 ||
+      make_non_blocking(c->outfds[1]) < 0) {
+    return -1;
+  }
+
+  return pid;
+}
+
+
+// Sends the FDS_MSGs of the channels whose fds wait for the queue to
+// drain, as they must not overtake anything queued before them. A
+// socket that is full holds them back until it takes more.
+void session_pass_fds(struct session *s)
+{
+  struct channel *c = s->channels;
+  while (c != NULL && s->passing_fds > 0) {
+    struct channel *next = c->next;
+    if (c->num_pass_fds == 0) {
+      c = next;
+      continue;
+    }
+
+    if (s->sockfd < 0 || !send_queue_empty(&s->sock_queue)) {
+      return;
+    }
+
+    struct msg_wrapper message;
+    message.type = FDS_MSG;
+    message.channel = c->id;
+    message.msg.fds.num_fds = c->num_pass_fds;
+
+    size_t size = MSG_HEADER_SIZE + sizeof(struct fds_msg);
+    ssize_t n = write_fds(s->sockfd, (char*) &message, size,
+                          c->pass_fds, c->num_pass_fds);
+    if (n < 0) {
+      if (errno != EWOULDBLOCK) {
+        session_lost(s, "ERROR passing fds to newsockfd");
+      }
+      return;
+    }
+
+    // The fds went with the first bytes; the rest of the frame is
+    // queued like any other.
+    if ((size_t) n < size) {
+      send_queue_wrote(&s->sock_queue, SEND_URGENT, size, n);
+      if (send_queue_append(&s->sock_queue, SEND_URGENT,
+                            (char*) &message + n, size - n) < 0) {
+        session_error(s, "ERROR queueing message");
+        return;
+      }
+    }
+
+    channel_close_fds(c);
+
+    // The child may have exited while its fds waited.
+    channel_check(c);
+    c = next;
+  }
+}
+
+
+// Hands the fds of a command over to the client, which from then on
+// reads and writes them itself. The channel is left with the child
+// only, and ends with its exit status once it has been reaped and its
+// fds have gone out.
+void channel_pass_fds(struct channel *c)
+{
+  struct session *s = c->session;
+
+  c->pass_fds[0] = c->infd;
+  c->num_pass_fds = 1;
+  if (c->infd != c->outfds[0]) {
+    c->pass_fds[1] = c->outfds[0];
+    c->pass_fds[2] = c->outfds[1];
+    c->num_pass_fds = 3;
+  }
+  c->infd = -1;
+  c->outfds[0] = -1;
+  c->outfds[1] = -1;
+  s->passing_fds++;
+
+  session_pass_fds(s);
+}
+
+
+void channel_open(struct session *s, int id, struct cmd_msg *message)
+{
+  if (channel_find(s, id) != NULL) {
+    errno = EPROTO;
+    session_error(s, "ERROR opening a channel that is in use");
+    return;
+  }
+
+  // A detached session runs a single tty command.
+  if (message->detach &&
+      (!message->tty || id != 0 || s->channels != NULL || s->resumable)) {
+    errno = EPROTO;
+    session_error(s, "ERROR detaching a command that cannot be");
+    return;
+  }
+
+  if (s->id != 0 || s->viewer) {
+    errno = EPROTO;
+    session_error(s, "ERROR opening a channel in a detached session");
+    return;
+  }
+
+  // Passed fds are all the client gets, so nothing can be done to the
+  // output on the way, and the client has to be on this host.
+  if (message->pass_fds &&
+      (!s->local || message->sync || message->compress ||
+       message->detach || message->null_stdin || s->resumable)) {
+    errno = EPROTO;
+    session_error(s, "ERROR passing fds to a client that cannot take them");
+    return;
+  }
+
+  struct channel *c = channel_create(s, id);
+  if (c == NULL) {
+    session_error(s, "ERROR allocating channel");
+    return;
+  }
+
+  // A command that is out of fds gets those of the pty pool.
+  int pid = -1;
+  do {
+    channel_close_fds(c);
+    if (message->tty) {
+      pid = run_with_pty(c, message);
+    } else {
+      pid = run_without_pty(c, message);
+    }
+  } while (pid < 0 && c->pid < 0 && (errno == EMFILE || errno == ENFILE) &&
+           shrink_zygotes());
+
+  if (pid < 0) {
+    channel_error(c, "ERROR spawning cmd");
+
+    // Without a child to reap the channel ends right away, as if the
+    // command had failed.
+    if (c->pid < 0) {
+      c->child_done = true;
+      c->status = W_EXITCODE(1, 0);
+      channel_check(c);
+    }
+    return;
+  }
+
+  if (message->pass_fds) {
+    channel_pass_fds(c);
+  }
+
+  if (message->tty && message->sync) {
+    c->term = (struct term*) malloc(sizeof(struct term));
+    if (c->term == NULL ||
+        term_init(c->term, message->winsize.ws_row,
+                  message->winsize.ws_col) < 0) {
+      free(c->term);
+      c->term = NULL;
+      channel_error(c, "ERROR allocating terminal");
+      return;
+    }
+
+    if (term_screen_init(&c->shown, c->term->screen.rows,
+                         c->term->screen.cols) < 0) {
+      term_destroy(c->term);
+      free(c->term);
+      c->term = NULL;
+      channel_error(c, "ERROR allocating terminal");
+      return;
+    }
+    c->sync_reset = true;
+    echo_log_init(&c->echo);
+  }
+
+  if (message->detach && c->term == NULL &&
+      scrollback_init(&c->scrollback, scrollback_size) < 0) {
+    channel_error(c, "ERROR allocating scrollback");
+    return;
+  }
+
+  // Compressed output has to pass through here, so it is not spliced.
+  c->tty = message->tty;
+  c->compress = message->compress;
+  c->splice = !message->tty && !message->compress && !s->resumable;
+
+  if (channel_watch_child(c) < 0) {
+    channel_error(c, "ERROR watching child");
+
+    // A child nobody watches would never be reaped.
+    if (c->child_watch.fd < 0) {
+      kill(c->pid, SIGKILL);
+      channel_reap(c, 0);
+    }
+    return;
+  }
+
+  // From here on whatever the session sends goes to its viewers.
+  if (message->detach) {
+    struct msg_wrapper reply;
+    reply.type = ATTACH_MSG;
+    reply.channel = 0;
+    reply.msg.attach.id = next_session_id;
+    reply.msg.attach.flags = c->term != NULL ? ATTACH_SYNC : 0;
+
+    session_send(s, SEND_URGENT, (char*) &reply,
+                 MSG_HEADER_SIZE + sizeof(struct attach_msg));
+    s->id = next_session_id;
+    next_session_id += num_workers;
+  }
+}
+
+
+// Writes what the socket takes of the queue.
+void session_flush(struct session *s)
+{
+  if (s->viewer && s->sockfd >= 0) {
+    if (fanout_queue_flush(s->fanout, s->sockfd) < 0) {
+      session_lost(s, "ERROR writing to newsockfd");
+      return;
+    }
+
+    if (s->lagging && fanout_queue_empty(s->fanout)) {
+      viewer_catch_up(s);
+    }
+
+    // The tty may have been waiting for this viewer.
+    if (s->viewing != NULL) {
+      for (struct channel *c = s->viewing->channels; c != NULL;
+           c = c->next) {
+        channel_update_watches(c);
+      }
+    }
+    return;
+  }
+
+  if (s->sockfd < 0 || send_queue_empty(&s->sock_queue)) {
+    session_pass_fds(s);
+    return;
+  }
+
+  if (send_queue_flush(&s->sock_queue, s->sockfd) < 0) {
+    session_lost(s, "ERROR writing to newsockfd");
+  } else if (send_queue_empty(&s->sock_queue)) {
+    // Spliced output waits in its pipe for the queue to drain.
+    for (struct channel *c = s->channels; c != NULL; c = c->next) {
+      if (c->splice) {
+        channel_update_watches(c);
+      }
+    }
+
+    if (s->sock_closing) {
+      s->sock_done = true;
+    }
+
+    session_pass_fds(s);
+  }
+}
+
+
+// Stops reading from the connection of 's' and closes it once what is
+// queued for it has been written.
+void session_finish(struct session *s)
+{
+  s->sock_closing = true;
+
+  if (s->sockfd < 0 || send_queue_empty(&s->sock_queue)) {
+    s->sock_done = true;
+  }
+}
+
+
+// Answers the SESSION_MSG a connection starts with, ahead of anything
+// the session has queued and outside of its resume log.
+void session_send_hello(
+    struct session *s,
+    const char *token,
+    unsigned int received,
+    int log_size)
+{
+  struct msg_wrapper message;
+  message.type = SESSION_MSG;
+  message.channel = 0;
+  memcpy(message.msg.session.token, token, RESUME_TOKEN_SIZE);
+  message.msg.session.received = received;
+  message.msg.session.log_size = log_size;
+
+  send_queue_hello(&s->sock_queue, (char*) &message,
+                   MSG_HEADER_SIZE + sizeof(struct session_msg));
+  session_flush(s);
+}
+
+
+void session_send_ack(struct session *s)
+{
+  struct msg_wrapper message;
+  message.type = ACK_MSG;
+  message.channel = 0;
+  message.msg.ack.received = resume_log_acking(&s->resume);
+
+  session_send(
+      s,
+      SEND_URGENT,
+      (char*) &message,
+      MSG_HEADER_SIZE + sizeof(struct ack_msg));
+}
+
+
+// Moves the connection of 's', which has only sent 'message' so far,
+// over to another worker, which takes it from the message on.
+void worker_post(struct worker *worker, struct handoff *h)
+{
+  pthread_mutex_lock(&worker->lock);
+  h->next = worker->inbox;
+  worker->inbox = h;
+  pthread_mutex_unlock(&worker->lock);
+
+  uint64_t one = 1;
+  if (write(worker->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    perror("ERROR waking worker");
+  }
+}
+
+
+int read_watch(void *ctx, char *buf, size_t count);
+
+
+// Frames a client sends without waiting for the answer to the one that
+// takes its connection over to another session go along with the
+// connection: those already in the receive buffer, and those io_uring
+// has received for it, which are moved into the buffer here. Whatever
+// is still in the socket goes with the socket. Fails with EPROTO if
+// they do not fit.
+int session_drain_rx(struct session *s)
+{
+  while (reactor_buffered(&s->sock_watch) &&
+         msg_recv_buffer_fill(&s->rx, read_watch, &s->sock_watch) > 0) {}
+
+  if (reactor_buffered(&s->sock_watch)) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+void session_hand_off(
+    struct session *s,
+    struct worker *worker,
+    struct msg_wrapper *message)
+{
+  struct handoff *h = (struct handoff*) malloc(sizeof(struct handoff));
+  if (h == NULL) {
+    session_error(s, "ERROR handing off session");
+    return;
+  }
+
+  h->sockfd = s->sockfd;
+  h->session = NULL;
+  h->message = *message;
+
+  if (session_drain_rx(s) < 0) {
+    free(h);
+    session_error(s, "ERROR client sent too much ahead of the handoff");
+    return;
+  }
+
+  h->rx = s->rx;
+  msg_recv_buffer_init(&s->rx, &buffers);
+
+  reactor_del(&reactor, &s->sock_watch);
+  s->sockfd = -1;
+  s->sock_done = true;
+
+  worker_post(worker, h);
+}
+
+
+// Whether a session can move to another worker. Sessions started
+// detached and their viewers are tied to each other, and the token of a
+// resumable session names the worker it is with, so those stay put.
+bool session_movable(struct session *s)
+{
+  return !s->dead &&
+         !s->sock_done &&
+         s->sockfd >= 0 &&
+         s->channels != NULL &&
+         !s->resumable &&
+         s->id == 0 &&
+         !s->viewer;
+}
+
+
+// Moves a session over to another worker, which adopts it with
+// session_adopt(). Nothing of it is left behind: whatever it has queued
+// goes with it, and so do its buffers, into the pool of the other
+// worker.
+void session_move(struct session *s, struct worker *worker)
+{
+  struct handoff *h = (struct handoff*) malloc(sizeof(struct handoff));
+  if (h == NULL) {
+    return;
+  }
+
+  h->sockfd = -1;
+  h->session = s;
+
+  session_uncork(s);
+  session_unpause(s);
+  reactor_del(&reactor, &s->sock_watch);
+
+  for (struct channel *c = s->channels; c != NULL; c = c->next) {
+    reactor_del(&reactor, &c->child_watch);
+    reactor_del(&reactor, &c->out_watches[0]);
+    reactor_del(&reactor, &c->out_watches[1]);
+    reactor_del(&reactor, &c->in_watch);
+    channel_sync_unlink(c);
+  }
+
+  session_unlink(s);
+  worker_post(worker, h);
+}
+
+
+// Answers the SESSION_MSG a client starts a connection with. A new
+// session is given a token; a known token moves its session over to
+// this connection, which then sends again what the client is missing.
+void session_resume(struct session *s, struct session_msg *hello)
+{
+  char token[RESUME_TOKEN_SIZE];
+  memset(token, 0, sizeof(token));
+
+  if (s->resumable || s->channels != NULL) {
+    errno = EPROTO;
+    session_error(s, "ERROR session message in a running session");
+    return;
+  }
+
+  if (hello->log_size < RESUME_MIN_SIZE) {
+    errno = EPROTO;
+    session_error(s, "ERROR client resume log too small");
+    return;
+  }
+
+  if (memcmp(hello->token, token, sizeof(token)) == 0) {
+    if (resume_size > 0) {
+      if (resume_log_init(&s->resume, resume_size) < 0) {
+        session_error(s, "ERROR allocating resume log");
+        return;
+      }
+      if (getrandom(s->token, sizeof(s->token), 0) < 0) {
+        session_error(s, "ERROR generating session token");
+        return;
+      }
+      s->token[0] = (char) self->index;
+
+      s->resumable = true;
+      s->resume.peer_size = hello->log_size;
+      s->sock_queue.log = &s->resume;
+      memcpy(token, s->token, sizeof(token));
+    }
+
+    session_send_hello(s, token, 0, resume_size);
+    return;
+  }
+
+  int index = (unsigned char) hello->token[0];
+  if (index != self->index && index < num_workers) {
+    struct msg_wrapper message;
+    message.type = SESSION_MSG;
+    message.channel = 0;
+    message.msg.session = *hello;
+    session_hand_off(s, &workers[index], &message);
+    return;
+  }
+
+  struct session *target = sessions;
+  while (target != NULL &&
+         (!target->resumable ||
+          target->sock_done ||
+          memcmp(target->token, hello->token, sizeof(token)) != 0)) {
+    target = target->next;
+  }
+
+  if (target == NULL ||
+      resume_log_rewind(&target->resume, hello->received) < 0) {
+    fprintf(stderr, "ERROR resuming an unknown session\n");
+    session_send_hello(s, token, 0, 0);
+    session_finish(s);
+    return;
+  }
+
+  if (session_drain_rx(s) < 0) {
+    session_error(s, "ERROR client sent too much ahead of the resume");
+    return;
+  }
+
+  // The old connection may not have noticed yet that it is gone.
+  if (target->sockfd >= 0) {
+    session_detach(target);
+  }
+
+  int sockfd = s->sockfd;
+  reactor_del(&reactor, &s->sock_watch);
+  s->sockfd = -1;
+  s->sock_done = true;
+
+  if (reactor_add(&reactor, &target->sock_watch, sockfd,
+                  REACTOR_READ | REACTOR_RECV, on_socket, target) < 0) {
+    perror("ERROR resuming session");
+    close(sockfd);
+    return;
+  }
+
+  session_unlink_detached(target);
+  target->sockfd = sockfd;
+  target->resume.acked = target->resume.received;
+  target->resume.peer_size = hello->log_size;
+
+  // A partial frame from the old connection is sent again by the client.
+  msg_recv_buffer_destroy(&target->rx);
+  target->rx = s->rx;
+  msg_recv_buffer_init(&s->rx, &buffers);
+
+  session_send_hello(target, target->token,
+                     (uint32_t) target->resume.received,
+                     target->resume.size);
+  on_socket(&target->sock_watch, REACTOR_READ);
+}
+
+
+// Makes 's', which starts with an ATTACH_MSG, a viewer of the detached
+// session it names, along with whichever viewers it has already.
+void session_attach(struct session *s, struct attach_msg *attach)
+{
+  if (s->resumable || s->channels != NULL || s->id != 0) {
+    errno = EPROTO;
+    session_error(s, "ERROR attaching from a running session");
+    return;
+  }
+
+  int index = attach->id != 0 ? (int) ((attach->id - 1) % num_workers) : 0;
+  if (index != self->index) {
+    struct msg_wrapper message;
+    message.type = ATTACH_MSG;
+    message.channel = 0;
+    message.msg.attach = *attach;
+    session_hand_off(s, &workers[index], &message);
+    return;
+  }
+
+  struct session *target = sessions;
+  while (target != NULL &&
+         (target->id == 0 || target->id != attach->id)) {
+    target = target->next;
+  }
+
+  if (target == NULL || target->channels == NULL) {
+    fprintf(stderr, "ERROR attaching to an unknown session\n");
+    struct msg_wrapper reply;
+    reply.type = ATTACH_MSG;
+    reply.channel = 0;
+    reply.msg.attach.id = 0;
+    reply.msg.attach.flags = 0;
+    session_send(s, SEND_URGENT, (char*) &reply,
+                 MSG_HEADER_SIZE + sizeof(struct attach_msg));
+    session_finish(s);
+    return;
+  }
+
+  s->fanout = (struct fanout_queue*) malloc(sizeof(struct fanout_queue));
+  if (s->fanout == NULL) {
+    session_error(s, "ERROR allocating viewer");
+    return;
+  }
+  fanout_queue_init(s->fanout, &buffers);
+
+  s->viewer = true;
+  s->read_only = attach->flags & ATTACH_READ_ONLY;
+  s->viewing = target;
+  s->viewer_next = target->viewers;
+  if (target->viewers != NULL) {
+    target->viewers->viewer_prev = s;
+  }
+  target->viewers = s;
+
+  struct msg_wrapper reply;
+  reply.type = ATTACH_MSG;
+  reply.channel = 0;
+  reply.msg.attach.id = target->id;
+  reply.msg.attach.flags =
+    target->channels->term != NULL ? ATTACH_SYNC : 0;
+
+  session_send(s, SEND_URGENT, (char*) &reply,
+               MSG_HEADER_SIZE + sizeof(struct attach_msg));
+  viewer_catch_up(s);
+
+  // An exit status may have been waiting for a viewer.
+  struct channel *c = target->channels;
+  while (c != NULL) {
+    struct channel *next = c->next;
+    channel_check(c);
+    c = next;
+  }
+
+  session_update_watch(s);
+}
+
+
+void channel_resize(struct channel *c, struct winsize *winsize)
+{
+  if (ioctl(c->infd, TIOCSWINSZ, winsize) < 0) {
+    channel_error(c, "ERROR setting winsize parameters");
+    return;
+  }
+
+  if (c->term != NULL) {
+    if (term_resize(c->term, winsize->ws_row, winsize->ws_col) < 0) {
+      channel_error(c, "ERROR resizing terminal");
+      return;
+    }
+    channel_sync_schedule(c);
+  }
+}
+
+
+// A viewer types into and sizes the tty of the session it views, unless
+// it is read only. Its input is credited as it arrives; should the tty
+// not take it for a whole credit window, what does not fit is dropped,
+// much like a tty does with input it has no room for.
+void viewer_message(struct session *v, struct msg_wrapper *message)
+{
+  struct session *s = v->viewing;
+  if (s == NULL || v->read_only) {
+    return;
+  }
+
+  struct channel *c = channel_find(s, message->channel);
+  if (c == NULL || c->infd < 0) {
+    return;
+  }
+
+  switch (message->type) {
+    case WINSIZE_MSG: {
+      channel_resize(c, &message->msg.winsize.winsize);
+      break;
+    }
+    case IO_MSG: {
+      int size = message->msg.io.data_size;
+
+      if (c->in_queue.bytes < MSG_CREDIT_WINDOW) {
+        channel_input_written(c, out_queue_write(
+            &c->in_queue,
+            c->infd,
+            message->msg.io.data,
+            size));
+        channel_update_watches(c);
+      }
+
+      v->stdin_received += size;
+      if (v->stdin_received >= MSG_CREDIT_THRESHOLD) {
+        session_send_credit(v, c->id, STDIN_FILENO, v->stdin_received);
+        v->stdin_received = 0;
+      }
+      break;
+    }
+  }
+}
+
+
+void handle_message(struct session *s, struct msg_wrapper *message)
+{
+  if (s->viewer) {
+    viewer_message(s, message);
+    return;
+  }
+
+  if (message->type == CMD_MSG) {
+    channel_open(s, message->channel, &message->msg.cmd);
+    return;
+  }
+
+  if (message->type == SESSION_MSG) {
+    session_resume(s, &message->msg.session);
+    return;
+  }
+
+  if (message->type == ATTACH_MSG) {
+    session_attach(s, &message->msg.attach);
+    return;
+  }
+
+  if (message->type == ACK_MSG) {
+    if (s->resumable) {
+      resume_log_ack(&s->resume, message->msg.ack.received);
+      session_flush(s);
+      session_update_watch(s);
+    }
+    return;
+  }
+
+  // Anything for a channel that has already ended is dropped.
+  struct channel *c = channel_find(s, message->channel);
+  if (c == NULL) {
+    return;
+  }
+
+  switch (message->type) {
+    case WINSIZE_MSG: {
+      if (c->infd >= 0) {
+        channel_resize(c, &message->msg.winsize.winsize);
+      }
+      break;
+    }
+    case IO_MSG: {
+      if (c->infd < 0) {
+        break;
+      }
+
+      assert(message->msg.io.destfd == STDIN_FILENO);
+
+      // A client that keeps sending without credit is cut off rather
+      // than queued for without bound.
+      if (c->in_queue.bytes > MSG_CREDIT_WINDOW) {
+        errno = EPROTO;
+        session_error(s, "ERROR client exceeded its stdin window");
+        break;
+      }
+
+      channel_input_written(c, out_queue_write(
+          &c->in_queue,
+          c->infd,
+          message->msg.io.data,
+          message->msg.io.data_size));
+      channel_update_watches(c);
+      break;
+    }
+    case CREDIT_MSG: {
+      int destfd = message->msg.credit.destfd;
+
+      if (destfd == STDOUT_FILENO || destfd == STDERR_FILENO) {
+        c->credits[destfd] += message->msg.credit.bytes;
+        channel_update_watches(c);
+      }
+      break;
+    }
+    case CLOSE_MSG: {
+      channel_close_fds(c);
+      channel_check(c);
+      break;
+    }
+    case EOF_MSG: {
+      c->stdin_eof = true;
+      channel_check_input(c);
+      break;
+    }
+  }
+}
+
+
+int read_watch(void *ctx, char *buf, size_t count)
+{
+  return reactor_read(&reactor, (struct reactor_watch*) ctx, buf, count);
+}
+
+
+void on_socket(struct reactor_watch *w, int events)
+{
+  struct session *s = (struct session*) w->data;
+
+  session_flush(s);
+
+  while (!s->sock_done && !s->sock_closing && s->sockfd >= 0) {
+    struct msg_wrapper *message;
+    size_t start = s->rx.start;
+    int n = msg_recv_buffer_next(&s->rx, &message);
+
+    if (n < 0) {
+      session_error(s, "ERROR parsing message from newsockfd");
+      break;
+    }
+
+    if (n > 0) {
+      bool counted = s->resumable && message->type != SESSION_MSG;
+      size_t size = s->rx.start - start;
+
+      handle_message(s, message);
+
+      if (counted && resume_log_received(&s->resume, size) &&
+          s->sockfd >= 0) {
+        session_send_ack(s);
+      }
+      continue;
+    }
+
+    n = msg_recv_buffer_fill(&s->rx, read_watch, w);
+
+    if (n < 0) {
+      if (errno != EWOULDBLOCK) {
+        session_lost(s, "ERROR reading from newsockfd");
+      }
+      break;
+    }
+
+    if (n == 0) {
+      if ((s->resumable || s->id != 0) && s->channels != NULL) {
+        session_detach(s);
+      } else {
+        s->sock_done = true;
+      }
+      break;
+    }
+  }
+
+  session_update_watch(s);
+  session_check(s);
+}
+
+
+// Copies 'size' bytes of a channel's output into the socket queue, to
+// finish a frame the socket did not take all of.
+int channel_queue_output(struct channel *c, int idx, size_t size)
+{
+  while (size > 0) {
+    char buffer[MSG_MAX_IO_SIZE];
+
+    int n = read_all(c->outfds[idx], buffer,
+                     size < sizeof(buffer) ? size : sizeof(buffer));
+    if (n <= 0) {
+      return -1;
+    }
+
+    if (send_queue_append(&c->session->sock_queue, SEND_BULK,
+                          buffer, n) < 0) {
+      return -1;
+    }
+    size -= n;
+  }
+
+  return 0;
+}
+
+
+// Sends the next frame of a non-tty stdout with its payload spliced
+// from the pipe into the socket, so bulk output is never copied through
+// the server. Only done while nothing else waits to go out on the
+// socket; whatever of the frame the socket does not take is copied to
+// the queue, after which the stdout pipe is left alone until the queue
+// has drained. Returns the payload size, 0 if the output should rather
+// be copied, or -1 with errno set.
+int channel_splice_output(struct channel *c)
+{
+  struct session *s = c->session;
+
+  if (out_batch.len > 0 || !send_queue_empty(&s->sock_queue)) {
+    return 0;
+  }
+
+  int available;
+  if (ioctl(c->outfds[0], FIONREAD, &available) < 0 ||
+      available < SPLICE_MIN_SIZE) {
+    return 0;
+  }
+
+  // A multiple of MSG_ALIGN, so that the frame needs no padding.
+  int size = available;
+  if (size > c->credits[STDOUT_FILENO]) {
+    size = c->credits[STDOUT_FILENO];
+  }
+  if (size > MSG_MAX_IO_SIZE) {
+    size = MSG_MAX_IO_SIZE;
+  }
+  if (size > session_budget(s)) {
+    size = session_budget(s);
+  }
+  size &= ~(MSG_ALIGN - 1);
+
+  if (size == 0) {
+    return 0;
+  }
+
+  struct msg_wrapper header;
+  header.type = IO_MSG;
+  header.channel = c->id;
+  header.msg.io.destfd = STDOUT_FILENO;
+  header.msg.io.data_size = size;
+
+  session_cork(s);
+
+  ssize_t sent = send(s->sockfd, &header, IO_MSG_HEADER_SIZE, MSG_MORE);
+  if (sent < 0) {
+    if (errno == EWOULDBLOCK || errno == EINTR) {
+      return 0;
+    }
+    return -1;
+  }
+
+  c->credits[STDOUT_FILENO] -= size;
+
+  if (sent < (ssize_t) IO_MSG_HEADER_SIZE) {
+    send_queue_wrote(&s->sock_queue, SEND_BULK,
+                     IO_MSG_HEADER_SIZE + size, sent);
+    c->bulk_mark = send_queue_bulk_mark(&s->sock_queue);
+
+    if (send_queue_append(&s->sock_queue, SEND_BULK, (char*) &header + sent,
+                          IO_MSG_HEADER_SIZE - sent) < 0 ||
+        channel_queue_output(c, 0, size) < 0) {
+      return -1;
+    }
+    return size;
+  }
+
+  size_t left = size;
 
-#include "common.h"
-#include "msgs.h"
+  while (left > 0) {
+    ssize_t n = splice(c->outfds[0], NULL, s->sockfd, NULL, left,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (n < 0 && errno != EWOULDBLOCK) {
+        return -1;
+      }
+      break;
+    }
+    left -= n;
+  }
 
-volatile bool child_done;
+  send_queue_wrote(&s->sock_queue, SEND_BULK,
+                   IO_MSG_HEADER_SIZE + size, IO_MSG_HEADER_SIZE + size - left);
+  c->bulk_mark = send_queue_bulk_mark(&s->sock_queue);
 
+  if (left > 0 && channel_queue_output(c, 0, left) < 0) {
+    return -1;
+  }
 
-void sigchld(int sig)
-{
-  child_done = true;
+  return size;
 }
 
 
-void usage(char *cmd)
+// Feeds what a synchronized tty has to say to its terminal, and writes
+// the terminal's answers to queries back. A command that never stops
+// writing would keep this going forever, so after SYNC_MAX_READ bytes
+// the watch is dropped, to be re-armed once the event loop has had its
+// turn, updates included.
+void channel_read_screen(struct channel *c, struct reactor_watch *w)
 {
-  fprintf(stderr, "Usage: %s <port>\n", cmd);
-  exit(1);
-}
+  size_t total = 0;
 
+  while (c->outfds[0] >= 0 && session_budget(c->session) > 0) {
+    char buffer[MSG_MAX_IO_SIZE];
+    size_t size = sizeof(buffer);
+    if ((int64_t) size > session_budget(c->session)) {
+      size = session_budget(c->session);
+    }
 
-int run_with_pty(int sockfd, int newsockfd, struct cmd_msg *message)
-{
-  int ttyfd;
-  char tty_name[256];
-  int pid = forkpty(&ttyfd, tty_name, NULL, &message->winsize);
+    if (total >= SYNC_MAX_READ) {
+      if (reactor_update(&reactor, w, 0) < 0) {
+        channel_error(c, "ERROR updating watches");
+      }
+      break;
+    }
 
-  if (pid == 0) {
-    char **cmd = build_cmd_array(message);
+    int n = reactor_read(&reactor, w, buffer, size);
 
-    close(newsockfd);
-    close(sockfd);
+    if (n < 0) {
+      if (errno != EWOULDBLOCK) {
+        channel_error(c, "ERROR reading from child output");
+      }
+      break;
+    }
 
-    int result = execvp(cmd[0], cmd);
-    if (result < 0) {
-      error("ERROR execing cmd");
+    if (n == 0) {
+      reactor_del(&reactor, w);
+      close(c->outfds[0]);
+      c->infd = -1;
+      c->outfds[0] = -1;
+      out_queue_clear(&c->in_queue);
+      break;
     }
-  }
 
-  if (make_non_blocking(newsockfd) < 0) {
-    error("ERROR making sockfd non blocking");
+    term_write(c->term, buffer, n);
+    session_charge(c->session, n);
+    total += n;
+
+    // Answers are a few bytes that a tty always has room for; they go
+    // past the input queue so that they take no credit from the client.
+    if (c->term->reply_len > 0) {
+      if (write(c->outfds[0], c->term->reply, c->term->reply_len) < 0 &&
+          errno != EWOULDBLOCK) {
+        channel_error(c, "ERROR writing to child stdin");
+        break;
+      }
+      c->term->reply_len = 0;
+    }
   }
 
-  if (make_non_blocking(ttyfd) < 0) {
-    error("ERROR making ttyfd non blocking");
+  if (c->term->dirty) {
+    channel_sync_schedule(c);
   }
+}
 
-  struct async_msg_state msg_state;
-  memset(&msg_state, 0, sizeof(struct async_msg_state));
 
-  int sockfd_n = -1, ttyfd_n = -1;
+// Reads the tty of a session started detached, SCROLLBACK_MAX_READ
+// bytes at a time like channel_read_screen(). While nobody watches it
+// goes straight into the scrollback; otherwise into a frame that all
+// viewers share, and from there into the scrollback.
+void channel_read_scrollback(struct channel *c, struct reactor_watch *w)
+{
+  struct session *s = c->session;
+  size_t total = 0;
+
+  while (c->outfds[0] >= 0 && session_viewers_ready(s) &&
+         session_budget(s) > 0) {
+    if (total >= SCROLLBACK_MAX_READ) {
+      if (reactor_update(&reactor, w, 0) < 0) {
+        channel_error(c, "ERROR updating watches");
+      }
+      break;
+    }
 
-  while(true) {
-    fd_set readfds;
-    FD_ZERO(&readfds);
+    struct shared_frame *frame = NULL;
+    char *space;
+    size_t size;
 
-    if (sockfd_n != 0) {
-      FD_SET(newsockfd, &readfds);
+    if (s->viewers != NULL) {
+      frame = shared_frame_get(&buffers);
+      if (frame == NULL) {
+        channel_error(c, "ERROR allocating frame");
+        break;
+      }
+      space = frame->data + IO_MSG_HEADER_SIZE;
+      size = MSG_MAX_IO_SIZE;
+    } else {
+      size = scrollback_space(&c->scrollback, &space);
     }
-    if (ttyfd != 0) {
-      FD_SET(ttyfd, &readfds);
+    if ((int64_t) size > session_budget(s)) {
+      size = session_budget(s);
     }
 
-    int maxfd = sockfd > ttyfd ? sockfd : ttyfd;
+    int n = reactor_read(&reactor, w, space, size);
 
-    int result = select(maxfd + 1, &readfds, NULL, NULL, NULL);
+    if (n <= 0 && frame != NULL) {
+      shared_frame_put(&buffers, frame);
+    }
 
-    if (result < 0) {
-      if (errno == EINTR) {
-        continue;
+    if (n < 0) {
+      if (errno != EWOULDBLOCK) {
+        channel_error(c, "ERROR reading from child output");
       }
-      error("ERROR waiting on select");
+      break;
     }
 
-    if (result == 0) {
-      continue;
+    if (n == 0) {
+      reactor_del(&reactor, w);
+      close(c->outfds[0]);
+      c->infd = -1;
+      c->outfds[0] = -1;
+      out_queue_clear(&c->in_queue);
+      break;
     }
 
-    if (FD_ISSET(newsockfd, &readfds)) {
-      sockfd_n = recv_msg_async(newsockfd, &msg_state);
-
-      if (sockfd_n < 0) {
-        error("ERROR reading from newsockfd");
-      }
+    if (frame != NULL) {
+      scrollback_append(&c->scrollback, space, n);
+      frame->size = msg_frame_io(frame->data, IO_MSG, c->id,
+                                 STDOUT_FILENO, n);
+      session_broadcast(s, frame);
+      shared_frame_put(&buffers, frame);
+    } else {
+      scrollback_commit(&c->scrollback, n);
+    }
+    session_charge(s, n);
+    total += n;
+  }
+}
 
-      if (msg_state.finished) {
-        switch (msg_state.message->type) {
-          case WINSIZE_MSG: {
-            int result = ioctl(
-                ttyfd,
-                TIOCSWINSZ,
-                &msg_state.message->msg.winsize.winsize);
 
-            if (result < 0) {
-              error("ERROR setting winsize parameters");
-            }
-            break;
-          }
-          case IO_MSG: {
-            sockfd_n = write_all(
-                ttyfd,
-                msg_state.message->msg.io.data,
-                msg_state.message->msg.io.data_size);
+void on_output(struct reactor_watch *w, int events)
+{
+  struct channel *c = (struct channel*) w->data;
+  struct session *s = c->session;
+  int idx = w == &c->out_watches[0] ? 0 : 1;
+  int destfd = idx == 0 ? STDOUT_FILENO : STDERR_FILENO;
 
-            if (sockfd_n < 0) {
-              error("ERROR writing to ttyfd");
-            }
-            break;
-          }
-        }
+  if (events & REACTOR_WRITE) {
+    channel_flush_input(c);
+  }
 
-        free(msg_state.message);
-        memset(&msg_state, 0, sizeof(async_msg_state));
-      }
+  if (c->term != NULL || c->scrollback.buf != NULL) {
+    if (c->term != NULL) {
+      channel_read_screen(c, w);
+    } else {
+      channel_read_scrollback(c, w);
+    }
+    if (c->outfds[0] >= 0 && session_budget(s) <= 0) {
+      session_pause(s);
     }
+    channel_update_watches(c);
+    session_update_watch(s);
+    channel_check(c);
+    session_check(s);
+    return;
+  }
 
-    if (FD_ISSET(ttyfd, &readfds)) {
-      char buffer[4096];
+  // Everything read in one go is framed in place and sent at once, but
+  // never more than the client has granted credit for, nor than the
+  // session has left of its share.
+  while (c->outfds[idx] >= 0 && c->credits[destfd] > 0 &&
+         session_budget(s) > 0) {
+    if (idx == 0 && c->splice) {
+      if (!send_queue_empty(&s->sock_queue)) {
+        break;
+      }
 
-      ttyfd_n = read_all(ttyfd, buffer, 4096);
-      if (ttyfd_n < 0) {
-        error("ERROR reading from ttyfd");
+      int n = channel_splice_output(c);
+      if (n < 0) {
+        session_error(s, "ERROR splicing to newsockfd");
+        break;
+      }
+      if (n > 0) {
+        s->load += n;
+        session_charge(s, n);
+        continue;
       }
+    }
 
-      if (ttyfd_n > 0) {
-        int n = send_io_msg(newsockfd, STDOUT_FILENO, buffer, ttyfd_n);
-        if (n < 0) {
-          error("ERROR writing to newsockfd");
-        }
+    if (msg_batch_room(&out_batch) < 4096) {
+      if (!c->tty) {
+        session_cork(s);
       }
+      channel_send(c, out_batch.buf, out_batch.len);
+      out_batch.len = 0;
+      continue;
+    }
+
+    size_t size = msg_batch_room(&out_batch);
+    if (size > (size_t) c->credits[destfd]) {
+      size = c->credits[destfd];
     }
+    if ((int64_t) size > session_budget(s)) {
+      size = session_budget(s);
+    }
+
+    int n = reactor_read(&reactor, w, msg_batch_payload(&out_batch), size);
 
-    if (sockfd_n == 0) {
+    if (n < 0) {
+      if (errno != EWOULDBLOCK) {
+        channel_error(c, "ERROR reading from child output");
+      }
       break;
     }
 
-    if (child_done && ttyfd_n == 0) {
+    if (n == 0) {
+      reactor_del(&reactor, w);
+      close(c->outfds[idx]);
+      if (c->infd == c->outfds[idx]) {
+        c->infd = -1;
+        out_queue_clear(&c->in_queue);
+      }
+      c->outfds[idx] = -1;
       break;
     }
+
+    c->credits[destfd] -= n;
+    session_charge(s, n);
+
+    if (c->compress && n >= COMPRESS_MIN_SIZE && lz_adapt_try(&c->lz[idx])) {
+      lz_adapt_result(&c->lz[idx],
+                      msg_batch_commit_zio(&out_batch, c->id, destfd, n));
+    } else {
+      msg_batch_commit_io(&out_batch, c->id, destfd, n);
+    }
+  }
+
+  // Output of a tty is interactive and goes out at once; anything else
+  // is bulk.
+  if (out_batch.len > 0 && !c->tty) {
+    session_cork(s);
   }
 
-  close(ttyfd);
+  channel_send(c, out_batch.buf, out_batch.len);
+  out_batch.len = 0;
 
-  return pid;
+  if (c->tty) {
+    session_uncork(s);
+  }
+
+  if (c->outfds[idx] >= 0 && session_budget(s) <= 0) {
+    session_pause(s);
+  }
+
+  channel_update_watches(c);
+  session_update_watch(s);
+  channel_check(c);
+  session_check(s);
+}
+
+
+void on_input(struct reactor_watch *w, int events)
+{
+  struct channel *c = (struct channel*) w->data;
+
+  channel_flush_input(c);
+  channel_update_watches(c);
 }
 
 
-int run_without_pty(int sockfd, int newsockfd, struct cmd_msg *message)
+// Reaps the child of a channel, waiting for it with 'options' 0, and
+// ends the channel if that was all it was waiting for.
+void channel_reap(struct channel *c, int options)
 {
-  int stdin_pipe[2];
-  if (pipe(stdin_pipe) < 0) {
-    error("ERROR creating a std_in pipe.");
+  int status;
+  int pid;
+
+  do {
+    pid = waitpid(c->pid, &status, options);
+  } while (pid < 0 && errno == EINTR);
+
+  if (pid == 0) {
+    return;
   }
 
-  int stdout_pipe[2];
-  if (pipe(stdout_pipe) < 0) {
-    error("ERROR creating a std_out pipe.");
+  if (pid < 0) {
+    perror("ERROR reaping child");
+    status = W_EXITCODE(1, 0);
   }
 
-  int stderr_pipe[2];
-  if (pipe(stderr_pipe) < 0) {
-    error("ERROR creating a std_err pipe.");
+  reactor_del(&reactor, &c->child_watch);
+  if (c->pidfd >= 0) {
+    close(c->pidfd);
+    c->pidfd = -1;
   }
 
-  int pid = fork();
+  c->child_done = true;
+  c->status = status;
+  channel_check(c);
+}
 
-  if (pid == 0) {
-    char **cmd = build_cmd_array(message);
 
-    if (dup2(stdin_pipe[0], STDIN_FILENO) != 0 ||
-        dup2(stdout_pipe[1], STDOUT_FILENO) != 1 ||
-        dup2(stderr_pipe[1], STDERR_FILENO) != 2 ) {
-      error("ERROR duplicating socket for stdin/stdout/stderr");
+// Every worker reaps its own children, through their pidfds; a SIGCHLD
+// would only tell that some child of the process has exited.
+void on_child(struct reactor_watch *w, int events)
+{
+  channel_reap((struct channel*) w->data, WNOHANG);
+}
+
+
+void on_listen(struct reactor_watch *w, int events)
+{
+  int sockfd = w->fd;
+
+  while (true) {
+    struct sockaddr_in cli_addr;
+    socklen_t clilen = sizeof(cli_addr);
+
+    int newsockfd = accept4(
+        sockfd,
+        (struct sockaddr *) &cli_addr,
+        &clilen,
+        SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (newsockfd < 0)  {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+
+      // Connections come before the pty pool, which gives up a zygote's
+      // fds (and waits before it takes them again).
+      if ((errno == EMFILE || errno == ENFILE) && shrink_zygotes()) {
+        continue;
+      }
+      if (errno != EWOULDBLOCK) {
+        perror("ERROR on accept");
+      }
+      return;
     }
 
-    close(newsockfd);
-    close(sockfd);
+    // TCP options mean nothing to a unix socket.
+    bool local = sockfd == unix_listenfd;
 
-    close(stdin_pipe[0]);
-    close(stdin_pipe[1]);
-    close(stdout_pipe[0]);
-    close(stdout_pipe[1]);
-    close(stderr_pipe[0]);
-    close(stderr_pipe[1]);
+    if (!local && flush_setup(newsockfd, &flush_policy) < 0) {
+      perror("ERROR setting up newsockfd");
+      close(newsockfd);
+      continue;
+    }
 
-    int result = execvp(cmd[0], cmd);
-    if (result < 0) {
-      error("ERROR execing cmd");
+    struct session *s = session_create(newsockfd);
+    if (s == NULL) {
+      perror("ERROR starting session for newsockfd");
+      close(newsockfd);
+      continue;
     }
+    s->local = local;
   }
+}
 
-  if (make_non_blocking(newsockfd) < 0) {
-    error("ERROR making sockfd non blocking");
-  }
 
-  if (make_non_blocking(stdout_pipe[0]) < 0) {
-    error("ERROR making stdout_pipe non blocking");
+void session_adopt(struct session *s)
+{
+  session_link(s);
+
+  // Its turn and deficit were counted against the other worker's loop,
+  // so it starts over with a fresh quantum in this one. Its tokens are
+  // kept, as they go by the clock.
+  s->sched_turn = sched_turn - 1;
+  s->deficit = 0;
+
+  s->rx.pool = &buffers;
+  send_queue_set_pool(&s->sock_queue, &buffers);
+
+  if (reactor_add(&reactor, &s->sock_watch, s->sockfd,
+                  REACTOR_READ | REACTOR_RECV, on_socket, s) < 0) {
+    session_error(s, "ERROR watching moved sockfd");
   }
 
-  if (make_non_blocking(stderr_pipe[0]) < 0) {
-    error("ERROR making stderr_pipe non blocking");
+  for (struct channel *c = s->channels; c != NULL; c = c->next) {
+    c->in_queue.pool = &buffers;
+
+    if (channel_add_watches(c) < 0) {
+      channel_error(c, "ERROR watching moved channel");
+    }
+    channel_update_watches(c);
+
+    // An update may have been due on the other worker.
+    if (c->term != NULL) {
+      channel_sync_schedule(c);
+    }
   }
 
-  close(stdin_pipe[0]);
-  close(stdout_pipe[1]);
-  close(stderr_pipe[1]);
+  session_update_watch(s);
+  session_check(s);
+}
+
 
-  struct async_msg_state msg_state;
-  memset(&msg_state, 0, sizeof(struct async_msg_state));
+// Takes over the connections and sessions other workers have handed to
+// this one.
+void on_handoff(struct reactor_watch *w, int events)
+{
+  uint64_t count;
+  while (read(self->wakefd, &count, sizeof(count)) < 0 && errno == EINTR) {}
 
-  while(true) {
-    int sockfd_n = -1, stdout_n = -1, stderr_n = -1;
+  pthread_mutex_lock(&self->lock);
+  struct handoff *inbox = self->inbox;
+  self->inbox = NULL;
+  pthread_mutex_unlock(&self->lock);
 
-    fd_set readfds;
-    FD_ZERO(&readfds);
+  while (inbox != NULL) {
+    struct handoff *h = inbox;
+    inbox = h->next;
 
-    if (sockfd_n != 0) {
-      FD_SET(newsockfd, &readfds);
+    if (h->session != NULL) {
+      session_adopt(h->session);
+      free(h);
+      continue;
     }
-    if (stdout_n != 0) {
-      FD_SET(stdout_pipe[0], &readfds);
+
+    h->rx.pool = &buffers;
+
+    struct session *s = session_create(h->sockfd);
+    if (s == NULL) {
+      perror("ERROR starting session for handed off sockfd");
+      close(h->sockfd);
+      msg_recv_buffer_destroy(&h->rx);
+    } else {
+      msg_recv_buffer_destroy(&s->rx);
+      s->rx = h->rx;
+      handle_message(s, &h->message);
+      on_socket(&s->sock_watch, REACTOR_READ);
     }
-    if (stderr_n != 0) {
-      FD_SET(stderr_pipe[0], &readfds);
+
+    free(h);
+  }
+}
+
+
+// Gives the worker at 'index', which has asked for it, the busiest
+// session that leaves the two of them closer to even than they were.
+void give_session(int index)
+{
+  struct worker *thief = &workers[index];
+  uint64_t mine = __atomic_load_n(&self->load, __ATOMIC_RELAXED);
+  uint64_t theirs = __atomic_load_n(&thief->load, __ATOMIC_RELAXED);
+
+  if (mine <= theirs) {
+    return;
+  }
+
+  struct session *best = NULL;
+  for (struct session *s = sessions; s != NULL; s = s->next) {
+    if (session_movable(s) &&
+        s->load > 0 &&
+        s->load < mine - theirs &&
+        (best == NULL || s->load > best->load)) {
+      best = s;
     }
+  }
 
-    int maxfd = max3(sockfd, stdout_pipe[0], stderr_pipe[0]);
+  if (best == NULL) {
+    return;
+  }
 
-    int result = select(maxfd + 1, &readfds, NULL, NULL, NULL);
+  // Published at once, so that nobody else asks for it.
+  __atomic_store_n(&self->load, mine - best->load, __ATOMIC_RELAXED);
+  __atomic_store_n(&thief->load, theirs + best->load, __ATOMIC_RELAXED);
 
-    if (result < 0) {
-      if (errno == EINTR) {
-        continue;
-      }
-      error("ERROR waiting on select");
+  session_move(best, thief);
+}
+
+
+// Serves a pending request for a session and, every
+// BALANCE_INTERVAL_MS, publishes the load of this worker and asks the
+// busiest one for a session if this one has far less. Returns the
+// time until the next balance.
+int balance_load()
+{
+  int thief = __atomic_exchange_n(&self->steal_to, -1, __ATOMIC_ACQ_REL);
+  if (thief >= 0) {
+    give_session(thief);
+  }
+
+  int64_t now = flush_now_ms();
+  if (now < next_balance) {
+    return (int) (next_balance - now);
+  }
+  next_balance = now + BALANCE_INTERVAL_MS;
+
+  uint64_t load = 0;
+  for (struct session *s = sessions; s != NULL; s = s->next) {
+    s->load /= 2;
+    load += s->load;
+  }
+  __atomic_store_n(&self->load, load, __ATOMIC_RELAXED);
+
+  struct worker *busiest = NULL;
+  uint64_t most = 0;
+  for (int i = 0; i < num_workers; i++) {
+    uint64_t other = __atomic_load_n(&workers[i].load, __ATOMIC_RELAXED);
+    if (other > most) {
+      busiest = &workers[i];
+      most = other;
     }
+  }
 
-    if (result == 0) {
-      continue;
+  if (busiest != NULL && busiest != self &&
+      most >= BALANCE_MIN_LOAD && most > 2 * load) {
+    int none = -1;
+    __atomic_compare_exchange_n(&busiest->steal_to, &none, self->index, false,
+                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+  }
+
+  return BALANCE_INTERVAL_MS;
+}
+
+
+void *worker_main(void *arg)
+{
+  self = (struct worker*) arg;
+  next_session_id = self->index + 1;
+
+  // Receive buffers and queued output are only held while data is in
+  // flight, so a few dozen spare buffers cover a lot of busy sessions.
+  pool_init(&buffers, MSG_RECV_BUFFER_SIZE, 64);
+
+  if (reactor_init(&reactor, backend) < 0) {
+    if (backend != REACTOR_URING) {
+      error("ERROR creating reactor");
     }
 
-    if (FD_ISSET(newsockfd, &readfds)) {
-      sockfd_n = recv_msg_async(newsockfd, &msg_state);
+    perror("io_uring unavailable, falling back to epoll");
+    reactor_destroy(&reactor);
 
-      if (sockfd_n < 0) {
-        error("ERROR reading from newsockfd");
-      }
+    if (reactor_init(&reactor, REACTOR_DEFAULT) < 0) {
+      error("ERROR creating reactor");
+    }
+  }
 
-      if (msg_state.finished) {
-        assert(msg_state.message->msg.io.destfd == STDIN_FILENO);
+  struct reactor_watch listen_watch;
+  if (reactor_add(&reactor, &listen_watch, self->listenfd, REACTOR_READ,
+                  on_listen, NULL) < 0) {
+    error("ERROR watching sockfd");
+  }
 
-        sockfd_n = write_all(
-            stdin_pipe[1],
-            msg_state.message->msg.io.data,
-            msg_state.message->msg.io.data_size);
+  struct reactor_watch unix_watch;
+  if (self->index == 0 && unix_listenfd >= 0 &&
+      reactor_add(&reactor, &unix_watch, unix_listenfd, REACTOR_READ,
+                  on_listen, NULL) < 0) {
+    error("ERROR watching unix socket");
+  }
 
-        if (sockfd_n < 0) {
-          error("ERROR writing to stdin_pipe[1]");
-        }
+  struct reactor_watch wake_watch;
+  if (reactor_add(&reactor, &wake_watch, self->wakefd, REACTOR_READ,
+                  on_handoff, NULL) < 0) {
+    error("ERROR watching wakefd");
+  }
 
-        free(msg_state.message);
-        memset(&msg_state, 0, sizeof(async_msg_state));
-      }
+  if (max_zygotes > 0) {
+    zygotes = (struct zygote*) calloc(max_zygotes, sizeof(struct zygote));
+    if (zygotes == NULL) {
+      error("ERROR allocating pty pool");
     }
+    while (num_zygotes < max_zygotes && fill_zygote() == 0) {}
+  }
 
-    if (FD_ISSET(stdout_pipe[0], &readfds)) {
-      char buffer[4096];
+  while (true) {
+    int timeout = -1;
+    if (num_zygotes < max_zygotes) {
+      int64_t left = zygote_retry_at - flush_now_ms();
+      timeout = left > ZYGOTE_IDLE_MS ? (int) left : ZYGOTE_IDLE_MS;
+    }
 
-      stdout_n = read_all(stdout_pipe[0], buffer, 4096);
-      if (stdout_n < 0) {
-        error("ERROR reading from stdout");
-      }
+    sched_turn++;
 
-      if (stdout_n > 0) {
-        int n = send_io_msg(newsockfd, STDOUT_FILENO, buffer, stdout_n);
-        if (n < 0) {
-          error("ERROR writing to newsockfd");
-        }
-      }
+    int resume_timeout_ms = resume_sessions();
+    if (resume_timeout_ms >= 0 &&
+        (timeout < 0 || resume_timeout_ms < timeout)) {
+      timeout = resume_timeout_ms;
     }
 
-    if (FD_ISSET(stderr_pipe[0], &readfds)) {
-      char buffer[4096];
+    int sync_timeout = run_syncs();
+    if (sync_timeout >= 0 && (timeout < 0 || sync_timeout < timeout)) {
+      timeout = sync_timeout;
+    }
 
-      stderr_n = read_all(stderr_pipe[0], buffer, 4096);
-      if (stderr_n < 0) {
-        error("ERROR reading from stderr");
+    if (corked_head != NULL) {
+      int flush_timeout_ms = flush_timeout(&corked_head->flush, flush_now_ms());
+      if (timeout < 0 || flush_timeout_ms < timeout) {
+        timeout = flush_timeout_ms;
       }
+    }
 
-      if (stderr_n > 0) {
-        int n = send_io_msg(newsockfd, STDERR_FILENO, buffer, stderr_n);
-        if (n < 0) {
-          error("ERROR writing to newsockfd");
-        }
+    if (detached_head != NULL) {
+      int64_t left = detached_head->detach_deadline - flush_now_ms();
+      int detach_timeout = left > 0 ? (int) left : 0;
+      if (timeout < 0 || detach_timeout < timeout) {
+        timeout = detach_timeout;
       }
     }
 
-    if (sockfd_n == 0) {
-      break;
+    // A session that is moved would lose whatever io_uring has received
+    // for it and not yet delivered, so sessions stay put with it.
+    if (balance && num_workers > 1 && reactor.backend != REACTOR_URING) {
+      int balance_timeout = balance_load();
+      if (timeout < 0 || balance_timeout < timeout) {
+        timeout = balance_timeout;
+      }
     }
 
-    if (child_done && stdout_n == 0 && stderr_n == 0) {
-      break;
+    int result = reactor_run_once(&reactor, timeout);
+
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error("ERROR waiting on reactor");
+    }
+
+    expire_detached_sessions();
+    free_dead_sessions();
+    expire_corked_sessions();
+
+    if (result == 0 && num_zygotes < max_zygotes &&
+        flush_now_ms() >= zygote_retry_at) {
+      fill_zygote();
     }
   }
 
-  close(stdin_pipe[1]);
-  close(stdout_pipe[0]);
-  close(stderr_pipe[0]);
+  reactor_destroy(&reactor);
+  pool_destroy(&buffers);
 
-  return pid;
+  return NULL;
 }
 
 
-int main(int argc, char *argv[])
+// Opens the unix socket at 'path', replacing whatever is left of an
+// earlier one.
+int open_unix_listener(const char *path)
 {
-  if (argc < 2) {
-    usage(argv[0]);
+  int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sockfd < 0) {
+    error("ERROR opening unix socket");
   }
 
-  int portno = atoi(argv[1]);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    error("ERROR binding unix socket");
+  }
+  strcpy(addr.sun_path, path);
+
+  if (unix_remove_stale(path) < 0 ||
+      bind(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    error("ERROR binding unix socket");
+  }
+
+  if (listen(sockfd, 1024) < 0) {
+    error("ERROR listening on unix socket");
+  }
+
+  if (make_non_blocking(sockfd) < 0) {
+    error("ERROR setting up unix socket");
+  }
 
-  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  return sockfd;
+}
+
+
+// Opens a listening socket of its own for a worker.
+int open_listener(int portno)
+{
+  int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
   if (sockfd < 0)  {
     error("ERROR opening socket");
   }
@@ -347,18 +3468,12 @@ int main(int argc, char *argv[])
   serv_addr.sin_port = htons(portno);
 
   int yes = 1;
-  int result = setsockopt(
-      sockfd,
-      SOL_SOCKET,
-      SO_REUSEADDR,
-      &yes,
-      sizeof(yes));
-
-  if (result < 0) {
+  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0 ||
+      setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0) {
     error("ERROR on setsockopt");
   }
 
-  result = bind(
+  int result = bind(
       sockfd,
       (struct sockaddr *) &serv_addr,
       sizeof(serv_addr));
@@ -367,53 +3482,142 @@ int main(int argc, char *argv[])
     error("ERROR on binding");
   }
 
-  result = listen(sockfd, 64);
+  result = listen(sockfd, 1024);
 
   if (result < 0) {
     error("ERROR on listen");
   }
 
-  signal(SIGCHLD, sigchld);
+  if (make_non_blocking(sockfd) < 0) {
+    error("ERROR setting up sockfd");
+  }
 
-  while (true) {
-    struct sockaddr_in cli_addr;
-    socklen_t clilen = sizeof(cli_addr);
+  return sockfd;
+}
 
-    int newsockfd = accept(
-        sockfd,
-        (struct sockaddr *) &cli_addr,
-        &clilen);
 
-    if (newsockfd < 0)  {
-      error("ERROR on accept");
+int main(int argc, char *argv[])
+{
+  if (argc == 2 && strcmp(argv[1], "--zygote") == 0) {
+    return zygote_main();
+  }
+
+  if (argc < 2) {
+    usage(argv[0]);
+  }
+
+  int portno = atoi(argv[1]);
+  const char *unix_path = NULL;
+
+  // Synchronized ttys need the widths of characters (wcwidth()), which
+  // only a UTF-8 locale knows.
+  setlocale(LC_CTYPE, "C.UTF-8");
+
+  flush_policy_init(&flush_policy);
+
+  for (int i = 2; i < argc; i++) {
+    int flush_option = flush_policy_option(&flush_policy, argc, argv, &i);
+    if (flush_option < 0) {
+      usage(argv[0]);
+    }
+    if (flush_option > 0) {
+      i--;
+      continue;
     }
 
-    struct msg_wrapper *message;
-    int n = recv_msg(newsockfd, &message);
-    if (n < 0) {
-      error("ERROR reading cmd from socket");
+    if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "epoll") == 0) {
+        backend = REACTOR_EPOLL;
+      } else if (strcmp(argv[i], "poll") == 0) {
+        backend = REACTOR_POLL;
+      } else if (strcmp(argv[i], "io_uring") == 0) {
+        backend = REACTOR_URING;
+      } else {
+        usage(argv[0]);
+      }
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      num_workers = atoi(argv[++i]);
+      if (num_workers < 1 || num_workers > MAX_WORKERS) {
+        usage(argv[0]);
+      }
+    } else if (strcmp(argv[i], "--pty-pool") == 0 && i + 1 < argc) {
+      max_zygotes = atoi(argv[++i]);
+      if (max_zygotes < 0) {
+        usage(argv[0]);
+      }
+    } else if (strcmp(argv[i], "--resume-buffer") == 0 && i + 1 < argc) {
+      long long size = atoll(argv[++i]);
+      if (size != 0 && (size < RESUME_MIN_SIZE || size > RESUME_MAX_SIZE)) {
+        usage(argv[0]);
+      }
+      resume_size = (size_t) size;
+    } else if (strcmp(argv[i], "--scrollback") == 0 && i + 1 < argc) {
+      long size = atol(argv[++i]);
+      if (size < SCROLLBACK_MIN_SIZE || size > MSG_CREDIT_WINDOW) {
+        usage(argv[0]);
+      }
+      // Rounded up to a power of two.
+      scrollback_size = SCROLLBACK_MIN_SIZE;
+      while (scrollback_size < (size_t) size) {
+        scrollback_size *= 2;
+      }
+    } else if (strcmp(argv[i], "--quantum") == 0 && i + 1 < argc) {
+      sched_quantum = atoll(argv[++i]);
+      if (sched_quantum < SCHED_MIN_QUANTUM) {
+        usage(argv[0]);
+      }
+    } else if (strcmp(argv[i], "--rate-limit") == 0 && i + 1 < argc) {
+      rate_limit = atoll(argv[++i]);
+      if (rate_limit < 0) {
+        usage(argv[0]);
+      }
+    } else if (strcmp(argv[i], "--no-balance") == 0) {
+      balance = false;
+    } else if (strcmp(argv[i], "--unix") == 0 && i + 1 < argc) {
+      unix_path = argv[++i];
+    } else if (strcmp(argv[i], "--resume-timeout") == 0 && i + 1 < argc) {
+      resume_timeout = atoi(argv[++i]);
+      if (resume_timeout < 0) {
+        usage(argv[0]);
+      }
+    } else {
+      usage(argv[0]);
     }
+  }
 
-    child_done = false;
+  // Every listening socket is bound before any worker starts, so that
+  // a port that is in use fails the server as a whole.
+  workers = (struct worker*) calloc(num_workers, sizeof(struct worker));
+  if (workers == NULL) {
+    error("ERROR allocating workers");
+  }
 
-    int pid = -1;
-    if (message->msg.cmd.tty) {
-      pid = run_with_pty(sockfd, newsockfd, &message->msg.cmd);
-    } else {
-      pid = run_without_pty(sockfd, newsockfd, &message->msg.cmd);
+  for (int i = 0; i < num_workers; i++) {
+    workers[i].index = i;
+    workers[i].listenfd = open_listener(portno);
+    workers[i].wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (workers[i].wakefd < 0) {
+      error("ERROR creating wakefd");
     }
+    pthread_mutex_init(&workers[i].lock, NULL);
+    workers[i].steal_to = -1;
+  }
+
+  if (unix_path != NULL) {
+    unix_listenfd = open_unix_listener(unix_path);
+  }
 
-    close(newsockfd);
-    free(message);
+  signal(SIGPIPE, SIG_IGN);
 
-    int status;
-    result = wait_all(pid, &status);
-    if (result < 0) {
-      error("ERROR waiting for pid");
+  for (int i = 1; i < num_workers; i++) {
+    if (pthread_create(&workers[i].thread, NULL, worker_main,
+                       &workers[i]) != 0) {
+      error("ERROR starting worker");
     }
   }
 
-  close(sockfd);
+  worker_main(&workers[0]);
 
   return 0;
 }
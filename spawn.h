@@ -0,0 +1,149 @@
+#ifndef SPAWN_H
+#define SPAWN_H
+
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "common.h"
+
+// Commands are started with posix_spawn(), which glibc implements with
+// clone(CLONE_VM | CLONE_VFORK): the child borrows the parent's memory
+// until it execs instead of copying its page tables the way fork()
+// does, so starting a command costs the same no matter how many
+// sessions and buffers the server holds. Everything the child needs
+// done between clone and exec is expressed as file actions and spawn
+// attributes; the fds the parent keeps must be close-on-exec.
+
+extern char **environ;
+
+
+// Opens the master side of a new pty with the given window size and
+// returns it (close-on-exec), storing the path of the slave side in
+// 'tty_name'.
+static inline int open_pty(
+    char *tty_name,
+    size_t size,
+    const struct winsize *winsize)
+{
+  int fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (grantpt(fd) < 0 ||
+      unlockpt(fd) < 0 ||
+      ptsname_r(fd, tty_name, size) != 0 ||
+      ioctl(fd, TIOCSWINSZ, winsize) < 0) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+  }
+
+  return fd;
+}
+
+
+// Starts 'cmd' with fds[0], fds[1] and fds[2] as its stdin, stdout and
+// stderr, or, if 'tty_name' is set, in a new session with that tty as
+// its controlling terminal and stdio (what forkpty() would do). The
+// child gets the default SIGPIPE disposition and an empty signal mask.
+// If 'extra_fd' is not -1 it is passed on as fd 3 of the child.
+// Returns the pid, or -1 with errno set, including when the exec fails.
+static inline pid_t spawn_cmd(
+    char **cmd,
+    const int fds[3],
+    const char *tty_name,
+    int extra_fd)
+{
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t sigdefault;
+  sigset_t sigmask;
+
+  int result = posix_spawn_file_actions_init(&actions);
+  if (result != 0) {
+    errno = result;
+    return -1;
+  }
+
+  result = posix_spawnattr_init(&attr);
+  if (result != 0) {
+    posix_spawn_file_actions_destroy(&actions);
+    errno = result;
+    return -1;
+  }
+
+  sigemptyset(&sigdefault);
+  sigaddset(&sigdefault, SIGPIPE);
+  sigemptyset(&sigmask);
+
+  short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+
+  if (tty_name != NULL) {
+    // glibc runs setsid() before the file actions, and a session
+    // leader without a controlling terminal acquires the first tty it
+    // opens without O_NOCTTY.
+    flags |= POSIX_SPAWN_SETSID;
+
+    result = posix_spawn_file_actions_addopen(
+        &actions, STDIN_FILENO, tty_name, O_RDWR, 0);
+    if (result == 0) {
+      result = posix_spawn_file_actions_adddup2(
+          &actions, STDIN_FILENO, STDOUT_FILENO);
+    }
+    if (result == 0) {
+      result = posix_spawn_file_actions_adddup2(
+          &actions, STDIN_FILENO, STDERR_FILENO);
+    }
+  } else {
+    for (int i = 0; i < 3 && result == 0; i++) {
+      result = posix_spawn_file_actions_adddup2(&actions, fds[i], i);
+    }
+  }
+
+  // Duplicating an fd onto itself clears its close-on-exec flag too.
+  if (result == 0 && extra_fd >= 0) {
+    result = posix_spawn_file_actions_adddup2(&actions, extra_fd, 3);
+  }
+
+  if (result == 0) {
+    result = posix_spawnattr_setflags(&attr, flags);
+  }
+  if (result == 0) {
+    result = posix_spawnattr_setsigdefault(&attr, &sigdefault);
+  }
+  if (result == 0) {
+    result = posix_spawnattr_setsigmask(&attr, &sigmask);
+  }
+
+  pid_t pid = -1;
+  if (result == 0) {
+    result = posix_spawnp(&pid, cmd[0], &actions, &attr, cmd, environ);
+  }
+
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+
+  if (result != 0) {
+    errno = result;
+    return -1;
+  }
+
+  return pid;
+}
+
+
+// Returns a pidfd for 'pid' (close-on-exec), which polls readable once
+// the child has exited. glibc only wraps pidfd_open() from 2.36 on.
+static inline int open_pidfd(pid_t pid)
+{
+  return (int) syscall(SYS_pidfd_open, pid, 0);
+}
+
+#endif // SPAWN_H
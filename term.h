@@ -0,0 +1,1265 @@
+#ifndef TERM_H
+#define TERM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+// A small terminal emulator for synchronized tty sessions: the server
+// feeds a command's tty output into a struct term and sends the client
+// the changes to its screen instead of the output itself, and the
+// client draws the screen it is sent on its own terminal. Only the
+// latest screen matters, so output that scrolled past between two
+// updates is never sent at all.
+//
+// The emulator understands what full screen programs and shells
+// commonly use of xterm: cursor movement, erasing, insertion and
+// deletion, scroll regions, SGR attributes with 256 colors, the
+// alternate screen, autowrap and UTF-8. Anything else is parsed and
+// ignored. There is no scrollback.
+//
+// Changes are encoded as spans of cells: a 2 byte row, column and count
+// (little endian), then each cell as the UTF-8 encoding of its
+// character, preceded by TERM_STYLE_MARK and 2 bytes each of foreground,
+// background and attributes if its style differs from the cell before
+// it (the first cell of a frame compares against the default style).
+// The character 0 marks the right half of a double width character.
+
+#define TERM_COLOR_DEFAULT 0xffff
+
+#define TERM_BOLD 0x01
+#define TERM_DIM 0x02
+#define TERM_ITALIC 0x04
+#define TERM_UNDERLINE 0x08
+#define TERM_BLINK 0x10
+#define TERM_REVERSE 0x20
+#define TERM_INVISIBLE 0x40
+#define TERM_STRIKE 0x80
+
+#define TERM_STYLE_MARK 0xff
+
+#define TERM_MAX_PARAMS 16
+#define TERM_MAX_REPLY 64
+
+// Largest encoding of one span header and of one cell.
+#define TERM_SPAN_HEADER_SIZE 6
+#define TERM_MAX_CELL_SIZE 11
+
+struct term_cell
+{
+  uint32_t ch;
+  uint16_t fg;
+  uint16_t bg;
+  uint16_t attrs;
+};
+
+struct term_screen
+{
+  int rows;
+  int cols;
+  struct term_cell *cells;
+  int cursor_row;
+  int cursor_col;
+  bool cursor_visible;
+};
+
+enum term_state
+{
+  TERM_GROUND,
+  TERM_ESCAPE,
+  TERM_ESCAPE_INTERMEDIATE,
+  TERM_CSI,
+  TERM_STRING,
+  TERM_STRING_ESCAPE,
+};
+
+struct term
+{
+  struct term_screen screen;
+
+  // The screen not shown: the main one while the alternate one is.
+  struct term_cell *other_cells;
+  bool alternate;
+
+  struct term_cell style;
+  int top;
+  int bottom;
+  bool wrap_next;
+  bool autowrap;
+  bool origin;
+  bool insert;
+
+  int saved_row;
+  int saved_col;
+  struct term_cell saved_style;
+  bool saved_origin;
+
+  enum term_state state;
+  int params[TERM_MAX_PARAMS];
+  int num_params;
+  char private_marker;
+
+  uint32_t utf8_ch;
+  int utf8_left;
+
+  // Answers to queries such as cursor position reports, to be written
+  // back to the tty.
+  char reply[TERM_MAX_REPLY];
+  int reply_len;
+
+  bool dirty;
+};
+
+
+static inline struct term_cell term_blank(const struct term_cell *style)
+{
+  struct term_cell cell;
+  cell.ch = ' ';
+  cell.fg = style != NULL ? style->fg : TERM_COLOR_DEFAULT;
+  cell.bg = style != NULL ? style->bg : TERM_COLOR_DEFAULT;
+  cell.attrs = 0;
+  return cell;
+}
+
+
+static inline bool term_cell_equal(
+    const struct term_cell *a,
+    const struct term_cell *b)
+{
+  return a->ch == b->ch && a->fg == b->fg && a->bg == b->bg &&
+         a->attrs == b->attrs;
+}
+
+
+static inline bool term_style_equal(
+    const struct term_cell *a,
+    const struct term_cell *b)
+{
+  return a->fg == b->fg && a->bg == b->bg && a->attrs == b->attrs;
+}
+
+
+static inline struct term_cell *term_cell_at(
+    struct term_screen *s,
+    int row,
+    int col)
+{
+  return &s->cells[row * s->cols + col];
+}
+
+
+static inline void term_fill(
+    struct term_cell *cells,
+    size_t count,
+    struct term_cell cell)
+{
+  for (size_t i = 0; i < count; i++) {
+    cells[i] = cell;
+  }
+}
+
+
+// Sets up a blank screen of the given size. Returns 0, or -1 with errno
+// set if it cannot be allocated.
+static inline int term_screen_init(struct term_screen *s, int rows, int cols)
+{
+  s->rows = rows > 0 ? rows : 24;
+  s->cols = cols > 0 ? cols : 80;
+  s->cursor_row = 0;
+  s->cursor_col = 0;
+  s->cursor_visible = true;
+
+  s->cells = (struct term_cell*) malloc(
+      (size_t) s->rows * s->cols * sizeof(struct term_cell));
+  if (s->cells == NULL) {
+    return -1;
+  }
+
+  term_fill(s->cells, (size_t) s->rows * s->cols, term_blank(NULL));
+  return 0;
+}
+
+
+static inline void term_screen_destroy(struct term_screen *s)
+{
+  free(s->cells);
+  s->cells = NULL;
+}
+
+
+// Changes the size of a screen, keeping its top left corner.
+static inline int term_screen_resize(
+    struct term_screen *s,
+    int rows,
+    int cols)
+{
+  struct term_screen resized;
+  if (term_screen_init(&resized, rows, cols) < 0) {
+    return -1;
+  }
+
+  for (int row = 0; row < resized.rows && row < s->rows; row++) {
+    for (int col = 0; col < resized.cols && col < s->cols; col++) {
+      *term_cell_at(&resized, row, col) = *term_cell_at(s, row, col);
+    }
+  }
+
+  resized.cursor_row = s->cursor_row < resized.rows ?
+    s->cursor_row : resized.rows - 1;
+  resized.cursor_col = s->cursor_col < resized.cols ?
+    s->cursor_col : resized.cols - 1;
+  resized.cursor_visible = s->cursor_visible;
+
+  free(s->cells);
+  *s = resized;
+  return 0;
+}
+
+
+static inline int term_init(struct term *t, int rows, int cols)
+{
+  memset(t, 0, sizeof(struct term));
+
+  if (term_screen_init(&t->screen, rows, cols) < 0) {
+    return -1;
+  }
+
+  size_t count = (size_t) t->screen.rows * t->screen.cols;
+  t->other_cells = (struct term_cell*) malloc(
+      count * sizeof(struct term_cell));
+  if (t->other_cells == NULL) {
+    term_screen_destroy(&t->screen);
+    return -1;
+  }
+  term_fill(t->other_cells, count, term_blank(NULL));
+
+  t->style = term_blank(NULL);
+  t->saved_style = t->style;
+  t->top = 0;
+  t->bottom = t->screen.rows - 1;
+  t->autowrap = true;
+  t->state = TERM_GROUND;
+  t->dirty = true;
+  return 0;
+}
+
+
+static inline void term_destroy(struct term *t)
+{
+  term_screen_destroy(&t->screen);
+  free(t->other_cells);
+  t->other_cells = NULL;
+}
+
+
+static inline int term_resize(struct term *t, int rows, int cols)
+{
+  struct term_screen other;
+  other.rows = t->screen.rows;
+  other.cols = t->screen.cols;
+  other.cells = t->other_cells;
+  other.cursor_row = 0;
+  other.cursor_col = 0;
+  other.cursor_visible = true;
+
+  if (term_screen_resize(&t->screen, rows, cols) < 0 ||
+      term_screen_resize(&other, rows, cols) < 0) {
+    return -1;
+  }
+
+  t->other_cells = other.cells;
+  t->top = 0;
+  t->bottom = t->screen.rows - 1;
+  t->wrap_next = false;
+  if (t->saved_row >= t->screen.rows) {
+    t->saved_row = t->screen.rows - 1;
+  }
+  if (t->saved_col >= t->screen.cols) {
+    t->saved_col = t->screen.cols - 1;
+  }
+  t->dirty = true;
+  return 0;
+}
+
+
+static inline void term_move(struct term *t, int row, int col)
+{
+  int top = t->origin ? t->top : 0;
+  int bottom = t->origin ? t->bottom : t->screen.rows - 1;
+
+  row = row < top ? top : row > bottom ? bottom : row;
+  col = col < 0 ? 0 : col >= t->screen.cols ? t->screen.cols - 1 : col;
+
+  t->screen.cursor_row = row;
+  t->screen.cursor_col = col;
+  t->wrap_next = false;
+}
+
+
+// Scrolls rows 'top' to 'bottom' up (n > 0) or down (n < 0) by |n|.
+static inline void term_scroll(struct term *t, int top, int bottom, int n)
+{
+  struct term_screen *s = &t->screen;
+  int height = bottom - top + 1;
+  int count = n > 0 ? n : -n;
+
+  if (count > height) {
+    count = height;
+  }
+
+  struct term_cell *first = term_cell_at(s, top, 0);
+  size_t moved = (size_t) (height - count) * s->cols;
+  size_t cleared = (size_t) count * s->cols;
+
+  if (n > 0) {
+    memmove(first, first + cleared, moved * sizeof(struct term_cell));
+    term_fill(first + moved, cleared, term_blank(&t->style));
+  } else {
+    memmove(first + cleared, first, moved * sizeof(struct term_cell));
+    term_fill(first, cleared, term_blank(&t->style));
+  }
+}
+
+
+static inline void term_linefeed(struct term *t)
+{
+  if (t->screen.cursor_row == t->bottom) {
+    term_scroll(t, t->top, t->bottom, 1);
+  } else if (t->screen.cursor_row < t->screen.rows - 1) {
+    t->screen.cursor_row++;
+  }
+  t->wrap_next = false;
+}
+
+
+static inline void term_reverse_index(struct term *t)
+{
+  if (t->screen.cursor_row == t->top) {
+    term_scroll(t, t->top, t->bottom, -1);
+  } else if (t->screen.cursor_row > 0) {
+    t->screen.cursor_row--;
+  }
+  t->wrap_next = false;
+}
+
+
+// Blanks halves of double width characters that lost the other half
+// to erasing, insertion or deletion, so that a 0 always follows the
+// character it belongs to.
+static inline void term_fix_row(struct term *t, int row)
+{
+  struct term_cell *cells = term_cell_at(&t->screen, row, 0);
+  bool wide = false;
+
+  for (int col = 0; col < t->screen.cols; col++) {
+    if (cells[col].ch == 0) {
+      if (!wide) {
+        cells[col].ch = ' ';
+      }
+      wide = false;
+      continue;
+    }
+
+    wide = wcwidth((wchar_t) cells[col].ch) == 2;
+    if (wide && (col + 1 == t->screen.cols || cells[col + 1].ch != 0)) {
+      cells[col].ch = ' ';
+      wide = false;
+    }
+  }
+}
+
+
+static inline void term_erase(struct term *t, int row, int from, int to)
+{
+  if (from < to) {
+    term_fill(term_cell_at(&t->screen, row, from), to - from,
+              term_blank(&t->style));
+    term_fix_row(t, row);
+  }
+}
+
+
+static inline void term_put(struct term *t, uint32_t ch)
+{
+  struct term_screen *s = &t->screen;
+
+  int width = wcwidth((wchar_t) ch);
+  if (width == 0) {
+    return;
+  }
+  if (width < 0 || width > s->cols) {
+    width = 1;
+  }
+
+  if (t->wrap_next && t->autowrap) {
+    s->cursor_col = 0;
+    term_linefeed(t);
+  }
+  t->wrap_next = false;
+
+  if (s->cursor_col + width > s->cols) {
+    if (t->autowrap) {
+      term_erase(t, s->cursor_row, s->cursor_col, s->cols);
+      s->cursor_col = 0;
+      term_linefeed(t);
+    } else {
+      s->cursor_col = s->cols - width;
+    }
+  }
+
+  struct term_cell *cell = term_cell_at(s, s->cursor_row, s->cursor_col);
+
+  // Whatever is left of a double width character partly overwritten
+  // becomes blank.
+  if (cell->ch == 0 && s->cursor_col > 0) {
+    cell[-1].ch = ' ';
+  }
+  if (s->cursor_col + width < s->cols && cell[width].ch == 0) {
+    cell[width].ch = ' ';
+  }
+
+  if (t->insert) {
+    int after = s->cols - s->cursor_col - width;
+    memmove(cell + width, cell, after * sizeof(struct term_cell));
+  }
+
+  *cell = t->style;
+  cell->ch = ch;
+  if (width == 2) {
+    cell[1] = t->style;
+    cell[1].ch = 0;
+  }
+
+  if (t->insert) {
+    term_fix_row(t, s->cursor_row);
+  }
+
+  s->cursor_col += width;
+  if (s->cursor_col >= s->cols) {
+    s->cursor_col = s->cols - 1;
+    t->wrap_next = true;
+  }
+}
+
+
+static inline void term_save_cursor(struct term *t)
+{
+  t->saved_row = t->screen.cursor_row;
+  t->saved_col = t->screen.cursor_col;
+  t->saved_style = t->style;
+  t->saved_origin = t->origin;
+}
+
+
+static inline void term_restore_cursor(struct term *t)
+{
+  t->style = t->saved_style;
+  t->origin = t->saved_origin;
+  t->screen.cursor_row = t->saved_row;
+  t->screen.cursor_col = t->saved_col;
+  t->wrap_next = false;
+}
+
+
+static inline void term_set_alternate(struct term *t, bool alternate)
+{
+  if (t->alternate == alternate) {
+    return;
+  }
+
+  struct term_cell *cells = t->screen.cells;
+  t->screen.cells = t->other_cells;
+  t->other_cells = cells;
+  t->alternate = alternate;
+
+  if (alternate) {
+    term_fill(t->screen.cells, (size_t) t->screen.rows * t->screen.cols,
+              term_blank(&t->style));
+  }
+}
+
+
+static inline void term_reply(struct term *t, const char *reply)
+{
+  size_t length = strlen(reply);
+  if (t->reply_len + length <= sizeof(t->reply)) {
+    memcpy(t->reply + t->reply_len, reply, length);
+    t->reply_len += length;
+  }
+}
+
+
+static inline int term_param(struct term *t, int i, int fallback)
+{
+  return i < t->num_params && t->params[i] > 0 ? t->params[i] : fallback;
+}
+
+
+// Maps a 24 bit color to the 6x6x6 cube of the 256 color palette.
+static inline uint16_t term_rgb(int r, int g, int b)
+{
+  return 16 + 36 * (r * 5 / 255) + 6 * (g * 5 / 255) + b * 5 / 255;
+}
+
+
+static inline void term_sgr(struct term *t)
+{
+  if (t->num_params == 0) {
+    t->style = term_blank(NULL);
+    return;
+  }
+
+  for (int i = 0; i < t->num_params; i++) {
+    int p = t->params[i];
+
+    if (p == 0) {
+      t->style = term_blank(NULL);
+    } else if (p == 1) {
+      t->style.attrs |= TERM_BOLD;
+    } else if (p == 2) {
+      t->style.attrs |= TERM_DIM;
+    } else if (p == 3) {
+      t->style.attrs |= TERM_ITALIC;
+    } else if (p == 4) {
+      t->style.attrs |= TERM_UNDERLINE;
+    } else if (p == 5) {
+      t->style.attrs |= TERM_BLINK;
+    } else if (p == 7) {
+      t->style.attrs |= TERM_REVERSE;
+    } else if (p == 8) {
+      t->style.attrs |= TERM_INVISIBLE;
+    } else if (p == 9) {
+      t->style.attrs |= TERM_STRIKE;
+    } else if (p == 21 || p == 22) {
+      t->style.attrs &= ~(TERM_BOLD | TERM_DIM);
+    } else if (p == 23) {
+      t->style.attrs &= ~TERM_ITALIC;
+    } else if (p == 24) {
+      t->style.attrs &= ~TERM_UNDERLINE;
+    } else if (p == 25) {
+      t->style.attrs &= ~TERM_BLINK;
+    } else if (p == 27) {
+      t->style.attrs &= ~TERM_REVERSE;
+    } else if (p == 28) {
+      t->style.attrs &= ~TERM_INVISIBLE;
+    } else if (p == 29) {
+      t->style.attrs &= ~TERM_STRIKE;
+    } else if (p >= 30 && p <= 37) {
+      t->style.fg = p - 30;
+    } else if (p == 39) {
+      t->style.fg = TERM_COLOR_DEFAULT;
+    } else if (p >= 40 && p <= 47) {
+      t->style.bg = p - 40;
+    } else if (p == 49) {
+      t->style.bg = TERM_COLOR_DEFAULT;
+    } else if (p >= 90 && p <= 97) {
+      t->style.fg = p - 90 + 8;
+    } else if (p >= 100 && p <= 107) {
+      t->style.bg = p - 100 + 8;
+    } else if ((p == 38 || p == 48) && i + 1 < t->num_params) {
+      uint16_t color = TERM_COLOR_DEFAULT;
+
+      if (t->params[i + 1] == 5 && i + 2 < t->num_params) {
+        color = t->params[i + 2] & 0xff;
+        i += 2;
+      } else if (t->params[i + 1] == 2 && i + 4 < t->num_params) {
+        color = term_rgb(t->params[i + 2] & 0xff,
+                         t->params[i + 3] & 0xff,
+                         t->params[i + 4] & 0xff);
+        i += 4;
+      } else {
+        break;
+      }
+
+      if (p == 38) {
+        t->style.fg = color;
+      } else {
+        t->style.bg = color;
+      }
+    }
+  }
+}
+
+
+static inline void term_mode(struct term *t, bool set)
+{
+  for (int i = 0; i < t->num_params; i++) {
+    int p = t->params[i];
+
+    if (t->private_marker == 0) {
+      if (p == 4) {
+        t->insert = set;
+      }
+      continue;
+    }
+
+    if (t->private_marker != '?') {
+      continue;
+    }
+
+    switch (p) {
+      case 6:
+        t->origin = set;
+        term_move(t, 0, 0);
+        break;
+      case 7:
+        t->autowrap = set;
+        break;
+      case 25:
+        t->screen.cursor_visible = set;
+        break;
+      case 47:
+      case 1047:
+        term_set_alternate(t, set);
+        break;
+      case 1048:
+        if (set) {
+          term_save_cursor(t);
+        } else {
+          term_restore_cursor(t);
+        }
+        break;
+      case 1049:
+        if (set) {
+          term_save_cursor(t);
+          term_set_alternate(t, true);
+        } else {
+          term_set_alternate(t, false);
+          term_restore_cursor(t);
+        }
+        break;
+    }
+  }
+}
+
+
+static inline void term_csi(struct term *t, char final)
+{
+  struct term_screen *s = &t->screen;
+  int row = s->cursor_row;
+  int col = s->cursor_col;
+  int n = term_param(t, 0, 1);
+
+  if (t->private_marker != 0 && final != 'h' && final != 'l' &&
+      final != 'c' && final != 'n') {
+    return;
+  }
+
+  switch (final) {
+    case 'A':
+      term_move(t, row - n < t->top && row >= t->top ? t->top : row - n, col);
+      break;
+    case 'B':
+    case 'e':
+      term_move(t, row + n > t->bottom && row <= t->bottom ?
+                t->bottom : row + n, col);
+      break;
+    case 'C':
+    case 'a':
+      term_move(t, row, col + n);
+      break;
+    case 'D':
+      term_move(t, row, col - n);
+      break;
+    case 'E':
+      term_move(t, row + n, 0);
+      break;
+    case 'F':
+      term_move(t, row - n, 0);
+      break;
+    case 'G':
+    case '`':
+      term_move(t, row, n - 1);
+      break;
+    case 'd':
+      term_move(t, (t->origin ? t->top : 0) + n - 1, col);
+      break;
+    case 'H':
+    case 'f':
+      term_move(t, (t->origin ? t->top : 0) + term_param(t, 0, 1) - 1,
+                term_param(t, 1, 1) - 1);
+      break;
+    case 'J': {
+      int mode = term_param(t, 0, 0);
+      if (mode == 0) {
+        term_erase(t, row, col, s->cols);
+        for (int r = row + 1; r < s->rows; r++) {
+          term_erase(t, r, 0, s->cols);
+        }
+      } else if (mode == 1) {
+        for (int r = 0; r < row; r++) {
+          term_erase(t, r, 0, s->cols);
+        }
+        term_erase(t, row, 0, col + 1);
+      } else if (mode == 2 || mode == 3) {
+        for (int r = 0; r < s->rows; r++) {
+          term_erase(t, r, 0, s->cols);
+        }
+      }
+      break;
+    }
+    case 'K': {
+      int mode = term_param(t, 0, 0);
+      if (mode == 0) {
+        term_erase(t, row, col, s->cols);
+      } else if (mode == 1) {
+        term_erase(t, row, 0, col + 1);
+      } else if (mode == 2) {
+        term_erase(t, row, 0, s->cols);
+      }
+      break;
+    }
+    case 'L':
+    case 'M':
+      if (row >= t->top && row <= t->bottom) {
+        term_scroll(t, row, t->bottom, final == 'L' ? -n : n);
+        t->screen.cursor_col = 0;
+        t->wrap_next = false;
+      }
+      break;
+    case '@':
+    case 'P': {
+      int after = s->cols - col;
+      if (n > after) {
+        n = after;
+      }
+      struct term_cell *cell = term_cell_at(s, row, col);
+      if (final == '@') {
+        memmove(cell + n, cell, (after - n) * sizeof(struct term_cell));
+        term_erase(t, row, col, col + n);
+      } else {
+        memmove(cell, cell + n, (after - n) * sizeof(struct term_cell));
+        term_erase(t, row, s->cols - n, s->cols);
+      }
+      t->wrap_next = false;
+      break;
+    }
+    case 'X':
+      term_erase(t, row, col, col + n < s->cols ? col + n : s->cols);
+      t->wrap_next = false;
+      break;
+    case 'S':
+      term_scroll(t, t->top, t->bottom, n);
+      break;
+    case 'T':
+      term_scroll(t, t->top, t->bottom, -n);
+      break;
+    case 'm':
+      term_sgr(t);
+      break;
+    case 'r': {
+      int top = term_param(t, 0, 1) - 1;
+      int bottom = term_param(t, 1, s->rows) - 1;
+      if (bottom >= s->rows) {
+        bottom = s->rows - 1;
+      }
+      if (top < bottom) {
+        t->top = top;
+        t->bottom = bottom;
+        term_move(t, t->origin ? top : 0, 0);
+      }
+      break;
+    }
+    case 's':
+      term_save_cursor(t);
+      break;
+    case 'u':
+      term_restore_cursor(t);
+      break;
+    case 'h':
+    case 'l':
+      term_mode(t, final == 'h');
+      break;
+    case 'n':
+      if (t->private_marker == 0 && term_param(t, 0, 0) == 6) {
+        char reply[32];
+        snprintf(reply, sizeof(reply), "\033[%d;%dR",
+                 row - (t->origin ? t->top : 0) + 1, col + 1);
+        term_reply(t, reply);
+      } else if (t->private_marker == 0 && term_param(t, 0, 0) == 5) {
+        term_reply(t, "\033[0n");
+      }
+      break;
+    case 'c':
+      if (t->private_marker == 0 && term_param(t, 0, 0) == 0) {
+        term_reply(t, "\033[?62;22c");
+      } else if (t->private_marker == '>') {
+        term_reply(t, "\033[>1;10;0c");
+      }
+      break;
+  }
+}
+
+
+static inline void term_escape(struct term *t, char c)
+{
+  switch (c) {
+    case '7':
+      term_save_cursor(t);
+      break;
+    case '8':
+      term_restore_cursor(t);
+      break;
+    case 'D':
+      term_linefeed(t);
+      break;
+    case 'E':
+      t->screen.cursor_col = 0;
+      term_linefeed(t);
+      break;
+    case 'M':
+      term_reverse_index(t);
+      break;
+    case 'c':
+      term_set_alternate(t, false);
+      t->style = term_blank(NULL);
+      t->top = 0;
+      t->bottom = t->screen.rows - 1;
+      t->wrap_next = false;
+      t->autowrap = true;
+      t->origin = false;
+      t->insert = false;
+      t->screen.cursor_row = 0;
+      t->screen.cursor_col = 0;
+      t->screen.cursor_visible = true;
+      term_save_cursor(t);
+      term_fill(t->screen.cells, (size_t) t->screen.rows * t->screen.cols,
+                term_blank(NULL));
+      break;
+  }
+}
+
+
+static inline void term_control(struct term *t, char c)
+{
+  struct term_screen *s = &t->screen;
+
+  switch (c) {
+    case '\b':
+      if (s->cursor_col > 0) {
+        s->cursor_col--;
+      }
+      t->wrap_next = false;
+      break;
+    case '\t':
+      term_move(t, s->cursor_row,
+                s->cursor_col + 8 - s->cursor_col % 8);
+      break;
+    case '\n':
+    case '\v':
+    case '\f':
+      term_linefeed(t);
+      break;
+    case '\r':
+      s->cursor_col = 0;
+      t->wrap_next = false;
+      break;
+  }
+}
+
+
+// Feeds output of the tty to the emulator.
+static inline void term_write(struct term *t, const char *buf, size_t count)
+{
+  t->dirty = true;
+
+  for (size_t i = 0; i < count; i++) {
+    unsigned char c = buf[i];
+
+    // Control characters act even in the middle of escape sequences;
+    // CAN and SUB cancel them.
+    if (c < 0x20 && c != 0x1b && t->state != TERM_STRING) {
+      if (c == 0x18 || c == 0x1a) {
+        t->state = TERM_GROUND;
+      } else {
+        term_control(t, c);
+      }
+      continue;
+    }
+
+    switch (t->state) {
+      case TERM_GROUND:
+        if (c == 0x1b) {
+          t->state = TERM_ESCAPE;
+          t->utf8_left = 0;
+        } else if (c < 0x80) {
+          t->utf8_left = 0;
+          if (c != 0x7f) {
+            term_put(t, c);
+          }
+        } else if (c < 0xc0) {
+          if (t->utf8_left > 0) {
+            t->utf8_ch = (t->utf8_ch << 6) | (c & 0x3f);
+            if (--t->utf8_left == 0) {
+              term_put(t, t->utf8_ch);
+            }
+          }
+        } else if (c < 0xe0) {
+          t->utf8_ch = c & 0x1f;
+          t->utf8_left = 1;
+        } else if (c < 0xf0) {
+          t->utf8_ch = c & 0x0f;
+          t->utf8_left = 2;
+        } else if (c < 0xf8) {
+          t->utf8_ch = c & 0x07;
+          t->utf8_left = 3;
+        } else {
+          t->utf8_left = 0;
+        }
+        break;
+      case TERM_ESCAPE:
+        if (c == '[') {
+          t->state = TERM_CSI;
+          t->num_params = 0;
+          t->private_marker = 0;
+        } else if (c == ']' || c == 'P' || c == '_' || c == '^' ||
+                   c == 'X') {
+          t->state = TERM_STRING;
+        } else if (c >= 0x20 && c < 0x30) {
+          t->state = TERM_ESCAPE_INTERMEDIATE;
+        } else {
+          term_escape(t, c);
+          t->state = TERM_GROUND;
+        }
+        break;
+      case TERM_ESCAPE_INTERMEDIATE:
+        // Character set designations and the like.
+        if (c >= 0x30) {
+          t->state = TERM_GROUND;
+        }
+        break;
+      case TERM_CSI:
+        if (c >= '0' && c <= '9') {
+          if (t->num_params == 0) {
+            t->params[t->num_params++] = 0;
+          }
+          int *p = &t->params[t->num_params - 1];
+          if (*p < 10000) {
+            *p = *p * 10 + (c - '0');
+          }
+        } else if (c == ';' || c == ':') {
+          if (t->num_params == 0) {
+            t->params[t->num_params++] = 0;
+          }
+          if (t->num_params < TERM_MAX_PARAMS) {
+            t->params[t->num_params++] = 0;
+          }
+        } else if (c >= '<' && c <= '?') {
+          t->private_marker = c;
+        } else if (c >= 0x40 && c < 0x7f) {
+          term_csi(t, c);
+          t->state = TERM_GROUND;
+        } else if (c == 0x1b) {
+          t->state = TERM_ESCAPE;
+        }
+        break;
+      case TERM_STRING:
+        // OSC, DCS and friends end with BEL or ST.
+        if (c == 0x07) {
+          t->state = TERM_GROUND;
+        } else if (c == 0x1b) {
+          t->state = TERM_STRING_ESCAPE;
+        }
+        break;
+      case TERM_STRING_ESCAPE:
+        t->state = c == '\\' ? TERM_GROUND : TERM_STRING;
+        break;
+    }
+  }
+}
+
+
+static inline char *term_put16(char *p, int value)
+{
+  *p++ = (char) (value & 0xff);
+  *p++ = (char) ((value >> 8) & 0xff);
+  return p;
+}
+
+
+static inline int term_get16(const unsigned char *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+
+static inline char *term_put_utf8(char *p, uint32_t ch)
+{
+  if (ch < 0x80) {
+    *p++ = (char) ch;
+  } else if (ch < 0x800) {
+    *p++ = (char) (0xc0 | (ch >> 6));
+    *p++ = (char) (0x80 | (ch & 0x3f));
+  } else if (ch < 0x10000) {
+    *p++ = (char) (0xe0 | (ch >> 12));
+    *p++ = (char) (0x80 | ((ch >> 6) & 0x3f));
+    *p++ = (char) (0x80 | (ch & 0x3f));
+  } else {
+    *p++ = (char) (0xf0 | ((ch >> 18) & 0x07));
+    *p++ = (char) (0x80 | ((ch >> 12) & 0x3f));
+    *p++ = (char) (0x80 | ((ch >> 6) & 0x3f));
+    *p++ = (char) (0x80 | (ch & 0x3f));
+  }
+  return p;
+}
+
+
+// Finds the first and last column in which a row of 'a' differs from
+// the same row of 'b'. Returns false if it does not.
+static inline bool term_row_changes(
+    struct term_screen *a,
+    struct term_screen *b,
+    int row,
+    int *first,
+    int *last)
+{
+  int col = 0;
+  while (col < a->cols &&
+         term_cell_equal(term_cell_at(a, row, col), term_cell_at(b, row, col))) {
+    col++;
+  }
+  if (col == a->cols) {
+    return false;
+  }
+  *first = col;
+
+  col = a->cols - 1;
+  while (term_cell_equal(term_cell_at(a, row, col), term_cell_at(b, row, col))) {
+    col--;
+  }
+  *last = col;
+  return true;
+}
+
+
+// Encodes changes that bring 'shown' closer to 'screen' (of the same
+// size) into at most 'size' bytes and applies them to 'shown'. Returns
+// the number of bytes used; '*done' tells whether 'shown' is now
+// equal to 'screen', or else it has to be called again.
+static inline size_t term_diff(
+    struct term_screen *shown,
+    struct term_screen *screen,
+    char *buf,
+    size_t size,
+    bool *done)
+{
+  char *p = buf;
+  char *end = buf + size;
+  struct term_cell style = term_blank(NULL);
+
+  *done = false;
+
+  for (int row = 0; row < screen->rows; row++) {
+    int first;
+    int last;
+
+    while (term_row_changes(shown, screen, row, &first, &last)) {
+      if (end - p < TERM_SPAN_HEADER_SIZE + TERM_MAX_CELL_SIZE) {
+        return p - buf;
+      }
+
+      char *header = p;
+      p += TERM_SPAN_HEADER_SIZE;
+
+      int col = first;
+      while (col <= last && end - p >= TERM_MAX_CELL_SIZE) {
+        struct term_cell *cell = term_cell_at(screen, row, col);
+
+        if (!term_style_equal(cell, &style)) {
+          *p++ = (char) TERM_STYLE_MARK;
+          p = term_put16(p, cell->fg);
+          p = term_put16(p, cell->bg);
+          p = term_put16(p, cell->attrs);
+          style = *cell;
+        }
+        p = term_put_utf8(p, cell->ch);
+
+        *term_cell_at(shown, row, col) = *cell;
+        col++;
+      }
+
+      term_put16(header, row);
+      term_put16(header + 2, first);
+      term_put16(header + 4, col - first);
+    }
+  }
+
+  shown->cursor_row = screen->cursor_row;
+  shown->cursor_col = screen->cursor_col;
+  shown->cursor_visible = screen->cursor_visible;
+
+  *done = true;
+  return p - buf;
+}
+
+
+// Applies changes encoded by term_diff() to a screen. Returns 0, or -1
+// if they are malformed or do not fit the screen.
+static inline int term_apply(
+    struct term_screen *screen,
+    const char *buf,
+    size_t size)
+{
+  const unsigned char *p = (const unsigned char*) buf;
+  const unsigned char *end = p + size;
+  struct term_cell style = term_blank(NULL);
+
+  while (p < end) {
+    if (end - p < TERM_SPAN_HEADER_SIZE) {
+      return -1;
+    }
+
+    int row = term_get16(p);
+    int col = term_get16(p + 2);
+    int count = term_get16(p + 4);
+    p += TERM_SPAN_HEADER_SIZE;
+
+    if (row >= screen->rows || col + count > screen->cols) {
+      return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+      if (p < end && *p == TERM_STYLE_MARK) {
+        if (end - p < 7) {
+          return -1;
+        }
+        style.fg = term_get16(p + 1);
+        style.bg = term_get16(p + 3);
+        style.attrs = term_get16(p + 5);
+        p += 7;
+      }
+
+      if (p >= end) {
+        return -1;
+      }
+
+      int length = *p < 0x80 ? 1 : *p < 0xe0 ? 2 : *p < 0xf0 ? 3 : 4;
+      if (end - p < length) {
+        return -1;
+      }
+
+      uint32_t ch = length == 1 ? *p : *p & (0x3f >> (length - 1));
+      for (int j = 1; j < length; j++) {
+        ch = (ch << 6) | (p[j] & 0x3f);
+      }
+      p += length;
+
+      struct term_cell *cell = term_cell_at(screen, row, col + i);
+      *cell = style;
+      cell->ch = ch;
+    }
+  }
+
+  return 0;
+}
+
+
+static inline char *term_render_style(char *p, const struct term_cell *cell)
+{
+  p += sprintf(p, "\033[0");
+
+  static const int codes[] = { 1, 2, 3, 4, 5, 7, 8, 9 };
+  for (int i = 0; i < 8; i++) {
+    if (cell->attrs & (1 << i)) {
+      p += sprintf(p, ";%d", codes[i]);
+    }
+  }
+
+  if (cell->fg < 8) {
+    p += sprintf(p, ";%d", 30 + cell->fg);
+  } else if (cell->fg < 16) {
+    p += sprintf(p, ";%d", 90 + cell->fg - 8);
+  } else if (cell->fg < 256) {
+    p += sprintf(p, ";38;5;%d", cell->fg);
+  }
+
+  if (cell->bg < 8) {
+    p += sprintf(p, ";%d", 40 + cell->bg);
+  } else if (cell->bg < 16) {
+    p += sprintf(p, ";%d", 100 + cell->bg - 8);
+  } else if (cell->bg < 256) {
+    p += sprintf(p, ";48;5;%d", cell->bg);
+  }
+
+  *p++ = 'm';
+  return p;
+}
+
+// Longest escape sequence term_render() emits for one cell or cursor
+// move.
+#define TERM_MAX_RENDER_SIZE 64
+
+// Like term_diff(), but encodes the changes as escape sequences that
+// redraw them on a real terminal, on which 'shown' is what is drawn
+// now. The terminal's attributes are left reset.
+static inline size_t term_render(
+    struct term_screen *shown,
+    struct term_screen *screen,
+    char *buf,
+    size_t size,
+    bool *done)
+{
+  char *p = buf;
+  char *end = buf + size;
+  struct term_cell style = term_blank(NULL);
+
+  *done = false;
+
+  for (int row = 0; row < screen->rows; row++) {
+    int first;
+    int last;
+
+    while (term_row_changes(shown, screen, row, &first, &last)) {
+      if (end - p < 3 * TERM_MAX_RENDER_SIZE) {
+        p += sprintf(p, "\033[0m");
+        return p - buf;
+      }
+
+      // The right half of a double width character is drawn with its
+      // left half.
+      if (first > 0 && term_cell_at(screen, row, first)->ch == 0) {
+        first--;
+      }
+
+      p += sprintf(p, "\033[%d;%dH", row + 1, first + 1);
+
+      int col = first;
+      while (col <= last && end - p >= 2 * TERM_MAX_RENDER_SIZE) {
+        struct term_cell *cell = term_cell_at(screen, row, col);
+
+        if (!term_style_equal(cell, &style)) {
+          p = term_render_style(p, cell);
+          style = *cell;
+        }
+        if (cell->ch != 0) {
+          p = term_put_utf8(p, cell->ch);
+        }
+
+        *term_cell_at(shown, row, col) = *cell;
+        col++;
+      }
+
+      // A double width character cut in half is drawn whole.
+      if (col < screen->cols && term_cell_at(screen, row, col)->ch == 0) {
+        *term_cell_at(shown, row, col) = *term_cell_at(screen, row, col);
+      }
+    }
+  }
+
+  p += sprintf(p, "\033[0m\033[%d;%dH", screen->cursor_row + 1,
+               screen->cursor_col + 1);
+  if (shown->cursor_visible != screen->cursor_visible) {
+    p += sprintf(p, screen->cursor_visible ? "\033[?25h" : "\033[?25l");
+  }
+
+  shown->cursor_row = screen->cursor_row;
+  shown->cursor_col = screen->cursor_col;
+  shown->cursor_visible = screen->cursor_visible;
+
+  *done = true;
+  return p - buf;
+}
+
+#endif // TERM_H
@@ -0,0 +1,61 @@
+#!/bin/bash
+# Checks that the server forwards a session's traffic without any heap
+# allocation once it has warmed up: echoes lines through 'cat' with the
+# server under tests/alloc_count.so, then counts the allocations made
+# while echoing more of them. Usage: alloc_test.sh [server options...]
+
+cd "$(dirname "$0")/.." || exit 1
+
+port=${PORT:-9099}
+warmup=${WARMUP:-20000}
+lines=${LINES:-200000}
+
+tmp=$(mktemp -d)
+trap 'kill $client $server 2>/dev/null; rm -rf $tmp' EXIT
+
+ALLOC_COUNT_FILE=$tmp/count LD_PRELOAD=$PWD/tests/alloc_count.so \
+  ./server $port "$@" 2> $tmp/server.log &
+server=$!
+sleep 0.3
+
+mkfifo $tmp/in
+./client localhost $port cat < $tmp/in > $tmp/out &
+client=$!
+exec 3> $tmp/in
+
+# Waits until 'cat' has echoed the first $1 lines.
+echoed()
+{
+  for i in $(seq 100); do
+    if [ "$(wc -l < $tmp/out)" -ge $1 ]; then
+      return 0
+    fi
+    sleep 0.1
+  done
+  echo "FAIL alloc_test $*: only $(wc -l < $tmp/out) of $1 lines echoed"
+  exit 1
+}
+
+# One write per line to start with, so each goes out in a frame of its
+# own, then bulk output in the same session.
+for i in $(seq $warmup); do echo $i >&3; done
+seq $((warmup + 1)) $((warmup * 2)) >&3
+echoed $((warmup * 2))
+
+kill -USR2 $server
+sleep 0.1
+
+for i in $(seq $warmup); do echo $i >&3; done
+seq $lines >&3
+echoed $((warmup * 3 + lines))
+
+kill -USR2 $server
+sleep 0.1
+
+count=$(cat $tmp/count)
+if [ "$count" != "0" ]; then
+  echo "FAIL alloc_test $*: $count allocations after warm-up"
+  exit 1
+fi
+
+echo "ok   alloc_test $*: no allocations for $((warmup + lines)) lines"
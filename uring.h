@@ -0,0 +1,426 @@
+#ifndef URING_H
+#define URING_H
+
+#ifdef __linux__
+
+#include <stdint.h>
+
+#include <linux/io_uring.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "common.h"
+
+// A minimal io_uring binding on top of the raw syscalls, just enough for
+// the reactor's io_uring backend: submission/completion rings, a probe
+// for the opcodes we rely on and one ring of provided buffers.
+
+// Not in every <linux/io_uring.h> we build against yet (Linux 6.7).
+#define URING_OP_READ_MULTISHOT 49
+
+#define URING_BUFFER_GROUP 0
+
+struct uring
+{
+  int fd;
+  unsigned features;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  unsigned sq_pending;
+  struct io_uring_sqe *sqes;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ptr;
+  size_t sq_len;
+  void *cq_ptr;
+  size_t cq_len;
+  size_t sqes_len;
+
+  bool read_multishot;
+
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_len;
+  char *bufs;
+  int num_bufs;
+  int buf_size;
+  unsigned short buf_tail;
+};
+
+
+static inline int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static inline int uring_enter(
+    int fd,
+    unsigned to_submit,
+    unsigned min_complete,
+    unsigned flags,
+    void *arg,
+    size_t argsz)
+{
+  return (int) syscall(
+      __NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+
+static inline int uring_register(
+    int fd,
+    unsigned opcode,
+    void *arg,
+    unsigned nr_args)
+{
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+static inline void uring_destroy(struct uring *u)
+{
+  if (u->bufs != NULL) {
+    munmap(u->bufs, (size_t) u->num_bufs * u->buf_size);
+  }
+  if (u->buf_ring != NULL) {
+    munmap(u->buf_ring, u->buf_ring_len);
+  }
+  if (u->sqes != NULL) {
+    munmap(u->sqes, u->sqes_len);
+  }
+  if (u->cq_ptr != NULL && u->cq_ptr != u->sq_ptr) {
+    munmap(u->cq_ptr, u->cq_len);
+  }
+  if (u->sq_ptr != NULL) {
+    munmap(u->sq_ptr, u->sq_len);
+  }
+  if (u->fd >= 0) {
+    close(u->fd);
+  }
+
+  memset(u, 0, sizeof(struct uring));
+  u->fd = -1;
+}
+
+
+static inline bool uring_probe_ops(struct uring *u)
+{
+  size_t size = sizeof(struct io_uring_probe) +
+                256 * sizeof(struct io_uring_probe_op);
+
+  struct io_uring_probe *probe = (struct io_uring_probe*) malloc(size);
+  if (probe == NULL) {
+    return false;
+  }
+  memset(probe, 0, size);
+
+  if (uring_register(u->fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+    free(probe);
+    return false;
+  }
+
+  int required[] = {
+    IORING_OP_POLL_ADD,
+    IORING_OP_POLL_REMOVE,
+    IORING_OP_ASYNC_CANCEL,
+    IORING_OP_RECV,
+  };
+
+  bool supported = true;
+  for (size_t i = 0; i < sizeof(required) / sizeof(required[0]); i++) {
+    if (required[i] > probe->last_op ||
+        !(probe->ops[required[i]].flags & IO_URING_OP_SUPPORTED)) {
+      supported = false;
+    }
+  }
+
+  u->read_multishot =
+    URING_OP_READ_MULTISHOT <= probe->last_op &&
+    (probe->ops[URING_OP_READ_MULTISHOT].flags & IO_URING_OP_SUPPORTED);
+
+  free(probe);
+
+  return supported;
+}
+
+
+// In C++ __DECLARE_FLEX_ARRAY puts an empty struct (of size one) in
+// front of io_uring_buf_ring::bufs, so index the ring by hand.
+static inline struct io_uring_buf *uring_buf_slot(struct uring *u, int i)
+{
+  return ((struct io_uring_buf*) u->buf_ring) + i;
+}
+
+
+static inline int uring_setup_buffers(struct uring *u, int num, int size)
+{
+  u->buf_ring_len = num * sizeof(struct io_uring_buf);
+  u->buf_ring = (struct io_uring_buf_ring*) mmap(
+      NULL, u->buf_ring_len, PROT_READ | PROT_WRITE,
+      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+
+  if (u->buf_ring == MAP_FAILED) {
+    u->buf_ring = NULL;
+    return -1;
+  }
+
+  u->bufs = (char*) mmap(
+      NULL, (size_t) num * size, PROT_READ | PROT_WRITE,
+      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+
+  if (u->bufs == MAP_FAILED) {
+    u->bufs = NULL;
+    return -1;
+  }
+
+  u->num_bufs = num;
+  u->buf_size = size;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t) (uintptr_t) u->buf_ring;
+  reg.ring_entries = num;
+  reg.bgid = URING_BUFFER_GROUP;
+
+  if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    return -1;
+  }
+
+  for (int i = 0; i < num; i++) {
+    struct io_uring_buf *buf = uring_buf_slot(u, i);
+    buf->addr = (uint64_t) (uintptr_t) (u->bufs + (size_t) i * size);
+    buf->len = size;
+    buf->bid = i;
+  }
+
+  u->buf_tail = num;
+  __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+
+static inline char *uring_buffer(struct uring *u, int bid)
+{
+  return u->bufs + (size_t) bid * u->buf_size;
+}
+
+
+// Hands a provided buffer back to the kernel once its data is consumed.
+static inline void uring_recycle_buffer(struct uring *u, int bid)
+{
+  struct io_uring_buf *buf =
+    uring_buf_slot(u, u->buf_tail & (u->num_bufs - 1));
+
+  buf->addr = (uint64_t) (uintptr_t) uring_buffer(u, bid);
+  buf->len = u->buf_size;
+  buf->bid = bid;
+
+  u->buf_tail++;
+  __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+
+// Sets up a ring with `entries` submission slots and `num_bufs` provided
+// buffers of `buf_size` bytes each (num_bufs must be a power of two).
+// Fails unless the kernel supports everything the reactor needs.
+static inline int uring_init(
+    struct uring *u,
+    unsigned entries,
+    int num_bufs,
+    int buf_size)
+{
+  memset(u, 0, sizeof(struct uring));
+  u->fd = -1;
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = entries * 4;
+
+  u->fd = uring_setup(entries, &p);
+  if (u->fd < 0) {
+    return -1;
+  }
+
+  if (make_cloexec(u->fd) < 0) {
+    uring_destroy(u);
+    return -1;
+  }
+
+  u->features = p.features;
+
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_NODROP) ||
+      !(p.features & IORING_FEAT_EXT_ARG)) {
+    uring_destroy(u);
+    errno = ENOSYS;
+    return -1;
+  }
+
+  u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (u->cq_len > u->sq_len) {
+    u->sq_len = u->cq_len;
+  }
+  u->cq_len = u->sq_len;
+
+  u->sq_ptr = mmap(
+      NULL, u->sq_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+
+  if (u->sq_ptr == MAP_FAILED) {
+    u->sq_ptr = NULL;
+    uring_destroy(u);
+    return -1;
+  }
+
+  u->cq_ptr = u->sq_ptr;
+
+  u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = (struct io_uring_sqe*) mmap(
+      NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+
+  if (u->sqes == MAP_FAILED) {
+    u->sqes = NULL;
+    uring_destroy(u);
+    return -1;
+  }
+
+  char *sq = (char*) u->sq_ptr;
+  u->sq_head = (unsigned*) (sq + p.sq_off.head);
+  u->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+  u->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned*) (sq + p.sq_off.array);
+  u->sq_entries = p.sq_entries;
+
+  char *cq = (char*) u->cq_ptr;
+  u->cq_head = (unsigned*) (cq + p.cq_off.head);
+  u->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+  u->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+  if (!uring_probe_ops(u)) {
+    uring_destroy(u);
+    errno = ENOSYS;
+    return -1;
+  }
+
+  if (uring_setup_buffers(u, num_bufs, buf_size) < 0) {
+    uring_destroy(u);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+// Submits everything queued so far and optionally waits for at least
+// one completion, all in a single io_uring_enter().
+static inline int uring_submit(struct uring *u, bool wait, int timeout_ms)
+{
+  unsigned flags = 0;
+  unsigned min_complete = 0;
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  void *argp = NULL;
+  size_t argsz = 0;
+
+  if (wait) {
+    flags |= IORING_ENTER_GETEVENTS;
+    min_complete = 1;
+
+    if (timeout_ms >= 0) {
+      ts.tv_sec = timeout_ms / 1000;
+      ts.tv_nsec = (long long) (timeout_ms % 1000) * 1000000;
+
+      memset(&arg, 0, sizeof(arg));
+      arg.ts = (uint64_t) (uintptr_t) &ts;
+
+      flags |= IORING_ENTER_EXT_ARG;
+      argp = &arg;
+      argsz = sizeof(arg);
+    }
+  }
+
+  if (u->sq_pending == 0 && !wait) {
+    return 0;
+  }
+
+  int result = uring_enter(
+      u->fd, u->sq_pending, min_complete, flags, argp, argsz);
+
+  u->sq_pending =
+    *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+  // Timeouts and a full completion queue both just mean there is
+  // nothing more to wait for right now.
+  if (result < 0 && errno != ETIME && errno != EBUSY) {
+    return result;
+  }
+
+  return 0;
+}
+
+
+// Returns a zeroed submission entry, flushing the queue first if the
+// ring is full.
+static inline struct io_uring_sqe *uring_get_sqe(struct uring *u)
+{
+  unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *u->sq_tail;
+
+  if (tail - head >= u->sq_entries) {
+    if (uring_submit(u, false, 0) < 0) {
+      return NULL;
+    }
+
+    head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= u->sq_entries) {
+      errno = EBUSY;
+      return NULL;
+    }
+  }
+
+  unsigned index = tail & *u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+  u->sq_array[index] = index;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  u->sq_pending++;
+
+  return sqe;
+}
+
+
+static inline struct io_uring_cqe *uring_peek_cqe(struct uring *u)
+{
+  unsigned head = *u->cq_head;
+  unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+  if (head == tail) {
+    return NULL;
+  }
+
+  return &u->cqes[head & *u->cq_mask];
+}
+
+
+static inline void uring_cqe_seen(struct uring *u)
+{
+  __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif // __linux__
+
+#endif // URING_H